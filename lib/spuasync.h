@@ -0,0 +1,400 @@
+/*
+  spuasync.h
+        - C++20 coroutine client of /dev/spu
+        - concurrently awaited commands are sent together by writev, results are taken by readv
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPUASYNC_H
+#define SPUASYNC_H
+
+#if !defined(__cplusplus) || __cplusplus < 202002L
+  #error "spuasync.h needs C++20 coroutines"
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "spu.h"
+
+namespace SPU
+{
+
+/* Commands sent by one writev - results of them should fit file results queue */
+#define SPU_ASYNC_BATCH_MAX 256
+
+/* Threads sending commands by write when driver has no results queue */
+#define SPU_ASYNC_POOL_THREADS 4
+
+class spu_async_client;
+
+/* Result of awaited command */
+struct spu_async_rslt
+{
+  int err;       // Negative errno of driver, 0 if command was executed
+  status_t rslt; // SPU status, see enum rslt
+  key_t key;     // Found pair of SRCH, DEL, MIN, MAX, NEXT, PREV, NSM, NGR
+  value_t val;
+  u32 power;
+
+  bool found() const { return !err && !(rslt & ERRORS_MASK); }
+};
+
+/* Awaitable command - coroutine is resumed when result is taken from driver */
+/* Formats 2 and 3 are the beginning of format 1, so one command container is used */
+class spu_async_op
+{
+public:
+  spu_async_op(spu_async_client *client, cmd_t cmd, gsid_t gsid, key_t key = key_t(), value_t val = value_t())
+    : client(client)
+  {
+    this->cmd.cmd  = cmd | P_FLAG;
+    this->cmd.gsid = gsid;
+    this->cmd.key  = key;
+    this->cmd.val  = val;
+
+    switch(cmd)
+    {
+      case INS:
+        cmd_size  = sizeof(struct cmdfrmt_1);
+        rslt_size = sizeof(struct rsltfrmt_1);
+        break;
+
+      case MIN:
+      case MAX:
+        cmd_size  = sizeof(struct cmdfrmt_3);
+        rslt_size = sizeof(struct rsltfrmt_2);
+        break;
+
+      default:
+        cmd_size  = sizeof(struct cmdfrmt_2);
+        rslt_size = sizeof(struct rsltfrmt_2);
+        break;
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+  inline bool await_suspend(std::coroutine_handle<> handle);
+
+  spu_async_rslt await_resume() const
+  {
+    if(cmd_size == sizeof(struct cmdfrmt_1))
+    {
+      return { err, rslt_1.rslt, cmd.key, cmd.val, rslt_1.power };
+    }
+    return { err, rslt_2.rslt, rslt_2.key, rslt_2.val, rslt_2.power };
+  }
+
+private:
+  friend class spu_async_client;
+
+  spu_async_client *client;
+  std::coroutine_handle<> waiter;
+  struct cmdfrmt_1 cmd;
+  size_t cmd_size;
+  struct rsltfrmt_1 rslt_1; // INS
+  struct rsltfrmt_2 rslt_2; // Others
+  size_t rslt_size;
+  int err = 0;
+
+  void *rslt_buf() { return rslt_size == sizeof(struct rsltfrmt_1) ? (void *) &rslt_1 : (void *) &rslt_2; }
+};
+
+/* Client of opened character device */
+/* Commands are sent from client threads, coroutines are resumed by post function */
+class spu_async_client
+{
+public:
+  /* Default post resumes coroutine in client thread */
+  using post_t = std::function<void(std::coroutine_handle<>)>;
+
+  spu_async_client() = default;
+  spu_async_client(const spu_async_client &) = delete;
+  spu_async_client &operator=(const spu_async_client &) = delete;
+  ~spu_async_client() { close(); }
+
+  /* Open character device, driver without results queue is served by threads pool */
+  int open(const char *path = nullptr, post_t post = nullptr, unsigned threads = SPU_ASYNC_POOL_THREADS)
+  {
+    char probe;
+
+    fd = ::open(path ? path : "/dev/" SPU_CDEV_NAME, O_RDWR);
+    if(fd < 0)
+    {
+      return -errno;
+    }
+
+    this->post = post ? std::move(post) : post_t([](std::coroutine_handle<> handle) { handle.resume(); });
+    stop = false;
+
+    /* Empty results queue is read as 0 bytes, old driver has no read */
+    vector = ::read(fd, &probe, sizeof(probe)) == 0;
+    if(vector)
+    {
+      threads = 1;
+    }
+
+    for(unsigned i=0; i<(threads ? threads : 1); i++)
+    {
+      workers.emplace_back([this] { vector ? pump() : serve(); });
+    }
+
+    return 0;
+  }
+
+  /* Stop threads - commands not sent yet fail with -ECANCELED */
+  /* Should not be called by coroutine resumed in client thread */
+  void close()
+  {
+    std::deque<spu_async_op *> left;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    ready.notify_all();
+
+    for(auto &worker : workers)
+    {
+      worker.join();
+    }
+    workers.clear();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      left.swap(queue);
+    }
+
+    for(auto op : left)
+    {
+      op->err = -ECANCELED;
+      complete(op);
+    }
+
+    if(fd >= 0)
+    {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  /* Commands are sent by writev and readv */
+  bool pipelined() const { return vector; }
+
+  /* Queue command, false if client is closed */
+  bool submit(spu_async_op *op)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(stop)
+      {
+        op->err = -ECANCELED;
+        return false;
+      }
+      queue.push_back(op);
+    }
+
+    ready.notify_one();
+    return true;
+  }
+
+private:
+  int fd = -1;
+  bool vector = false;
+  bool stop = true;
+  post_t post;
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<spu_async_op *> queue;
+  std::vector<std::thread> workers;
+
+  /* Take queued commands, false when client is closed */
+  bool take(std::vector<spu_async_op *> &batch, size_t max)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    ready.wait(lock, [this] { return stop || !queue.empty(); });
+    if(stop)
+    {
+      return false;
+    }
+
+    while(!queue.empty() && batch.size() < max)
+    {
+      batch.push_back(queue.front());
+      queue.pop_front();
+    }
+    return true;
+  }
+
+  /* Commands not executed by driver go back to queue start */
+  void requeue(const std::vector<spu_async_op *> &batch, size_t from)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for(size_t i=batch.size(); i>from; i--)
+    {
+      queue.push_front(batch[i-1]);
+    }
+  }
+
+  /* Op is not touched after post - coroutine may destroy it */
+  void complete(spu_async_op *op)
+  {
+    post(op->waiter);
+  }
+
+  /* Everything queued while previous batch was executed goes in next batch */
+  void pump()
+  {
+    std::vector<spu_async_op *> batch;
+    std::vector<struct iovec> iov;
+    ssize_t sent, got, need;
+    size_t done, i;
+
+    batch.reserve(SPU_ASYNC_BATCH_MAX);
+    iov.reserve(SPU_ASYNC_BATCH_MAX);
+
+    while(take(batch, SPU_ASYNC_BATCH_MAX))
+    {
+      iov.clear();
+      for(auto op : batch)
+      {
+        iov.push_back({ &op->cmd, op->cmd_size });
+      }
+
+      /* Failed first command is reported, commands after failed one are sent again */
+      sent = ::writev(fd, iov.data(), iov.size());
+      if(sent < (ssize_t) batch[0]->cmd_size)
+      {
+        batch[0]->err = sent < 0 ? -errno : -EIO;
+        requeue(batch, 1);
+        complete(batch[0]);
+        batch.clear();
+        continue;
+      }
+
+      iov.clear();
+      need = 0;
+      for(done=0; done<batch.size() && sent >= (ssize_t) batch[done]->cmd_size; done++)
+      {
+        sent -= batch[done]->cmd_size;
+        need += batch[done]->rslt_size;
+        iov.push_back({ batch[done]->rslt_buf(), batch[done]->rslt_size });
+      }
+      requeue(batch, done);
+
+      got = ::readv(fd, iov.data(), iov.size());
+      if(got != need)
+      {
+        for(i=0; i<done; i++)
+        {
+          batch[i]->err = got < 0 ? -errno : -EIO;
+        }
+        drain();
+      }
+
+      for(i=0; i<done; i++)
+      {
+        complete(batch[i]);
+      }
+      batch.clear();
+    }
+  }
+
+  /* Results left in driver queue after failed readv would be taken by next batch */
+  void drain()
+  {
+    alignas(8) u8 buf[256];
+
+    while(::read(fd, buf, sizeof(buf)) > 0)
+    {
+    }
+  }
+
+  /* Driver without results queue - one command by write, result is written over command */
+  void serve()
+  {
+    std::vector<spu_async_op *> batch;
+    alignas(8) u8 buf[std::max(sizeof(struct cmdfrmt_1), sizeof(struct rsltfrmt_2)) + sizeof(tsc_t)];
+    ssize_t got;
+
+    while(take(batch, 1))
+    {
+      spu_async_op *op = batch[0];
+
+      std::memcpy(buf, &op->cmd, op->cmd_size);
+      got = ::write(fd, buf, op->cmd_size);
+      if(got < 0)
+      {
+        op->err = -errno;
+      }
+      else
+      {
+        std::memcpy(op->rslt_buf(), buf, op->rslt_size);
+      }
+
+      complete(op);
+      batch.clear();
+    }
+  }
+};
+
+/* Command is queued after coroutine is suspended, so it may be resumed before submit returns */
+/* Coroutine is not suspended if client is closed */
+inline bool spu_async_op::await_suspend(std::coroutine_handle<> handle)
+{
+  waiter = handle;
+  return client->submit(this);
+}
+
+/* Structure of client - co_await structure.search(key) */
+class spu_async_structure
+{
+public:
+  spu_async_structure(spu_async_client &client, gsid_t gsid) : client(&client), gsid(gsid) {}
+
+  spu_async_op insert(key_t key, value_t val) const { return spu_async_op(client, INS, gsid, key, val); }
+  spu_async_op del(key_t key)    const { return spu_async_op(client, DEL,  gsid, key); }
+  spu_async_op search(key_t key) const { return spu_async_op(client, SRCH, gsid, key); }
+  spu_async_op min()             const { return spu_async_op(client, MIN,  gsid); }
+  spu_async_op max()             const { return spu_async_op(client, MAX,  gsid); }
+  spu_async_op next(key_t key)   const { return spu_async_op(client, NEXT, gsid, key); }
+  spu_async_op prev(key_t key)   const { return spu_async_op(client, PREV, gsid, key); }
+  spu_async_op nsm(key_t key)    const { return spu_async_op(client, NSM,  gsid, key); }
+  spu_async_op ngr(key_t key)    const { return spu_async_op(client, NGR,  gsid, key); }
+
+private:
+  spu_async_client *client;
+  gsid_t gsid;
+};
+
+} /* namespace SPU */
+
+#endif /* SPUASYNC_H */
@@ -0,0 +1,241 @@
+/*
+  spubypass.c
+        - user space SPU commands execution through mapped SPU registers
+        - kernel bypass mode of /dev/spu, see SPU_MMAP_REGS
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "spu.h"
+#include "pcidrv.h"
+#include "cmdexec.h"
+#include "spubypass.h"
+
+/* Registers page length */
+#define REGS_LEN 4096
+
+/* Internal functions */
+static inline void reg_write(const struct spu_bypass *bypass, u32 addr_shift, u32 data);
+static inline u32 reg_read(const struct spu_bypass *bypass, u32 addr_shift);
+static inline u8 status_read(const struct spu_bypass *bypass, u32 addr_shift);
+static int poll_flag(const struct spu_bypass *bypass, u32 reg, u8 shift, u8 value, u32 spins, u8 *state);
+
+/* Open character device and map SPU registers */
+int spu_bypass_open(struct spu_bypass *bypass, const char *path)
+{
+  void *regs;
+
+  bypass->fd = open(path ? path : "/dev/" SPU_CDEV_NAME, O_RDWR);
+  if(bypass->fd < 0)
+  {
+    return -errno;
+  }
+
+  regs = mmap(NULL, REGS_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, bypass->fd, SPU_MMAP_REGS);
+  if(regs == MAP_FAILED)
+  {
+    int err = -errno;
+    close(bypass->fd);
+    bypass->fd = -1;
+    return err;
+  }
+
+  bypass->regs = regs;
+  bypass->len  = REGS_LEN;
+  return 0;
+}
+
+/* Use already mapped registers, e.g. memory-backed fake SPU */
+void spu_bypass_attach(struct spu_bypass *bypass, volatile void *regs)
+{
+  bypass->regs = regs;
+  bypass->len  = 0;
+  bypass->fd   = -1;
+}
+
+/* Unmap SPU registers and close character device - driver resumes own commands */
+void spu_bypass_close(struct spu_bypass *bypass)
+{
+  if(bypass->len)
+  {
+    munmap((void *) bypass->regs, bypass->len);
+  }
+  if(bypass->fd >= 0)
+  {
+    close(bypass->fd);
+  }
+
+  bypass->regs = NULL;
+  bypass->len  = 0;
+  bypass->fd   = -1;
+}
+
+/* Get SPU structure number of GSID from driver */
+int spu_bypass_resolve(const struct spu_bypass *bypass, gsid_t gsid)
+{
+  int str;
+
+  if(bypass->fd < 0)
+  {
+    return -EBADF;
+  }
+
+  str = ioctl(bypass->fd, SPU_IOC_GET_STR, &gsid);
+  return str < 0 ? -errno : str;
+}
+
+/* Execute command the same way driver does */
+/* Result is read only with P flag, ADDS and driver special commands are not supported */
+int spu_bypass_exec(const struct spu_bypass *bypass, cmd_t cmd, struct spu_bypass_strs strs,
+                    const spu_key_t *key, const val_t *val, struct rsltfrmt_2 *rslt)
+{
+  u32 cmd_reg = CMD_SHIFT( (u32) SPU_CMD(cmd) );
+  u8 with_key = 1, with_val = 0;
+  u8 state;
+  u8 i;
+
+  /* Command register and used key, value registers by format */
+  switch(PURE_CMD(cmd))
+  {
+    CASE_CMDFRMT_1:
+      cmd_reg |= strs.a;
+      with_val = 1;
+      break;
+
+    CASE_CMDFRMT_2:
+      cmd_reg |= strs.a;
+      break;
+
+    CASE_CMDFRMT_3:
+      cmd_reg |= strs.a;
+      with_key = 0;
+      break;
+
+    CASE_CMDFRMT_4:
+      cmd_reg |= STR_A_SHIFT(strs.a) | STR_B_SHIFT(strs.b) | STR_R_SHIFT(strs.r);
+      with_key = 0;
+      break;
+
+    CASE_CMDFRMT_5:
+      cmd_reg |= STR_A_SHIFT(strs.a) | STR_R_SHIFT(strs.r);
+      break;
+
+    default:
+      return -EINVAL;
+  }
+
+  /* Registers are written only when SPU took previous ones - the same order as driver uses */
+  if(GET_Q_FLAG(cmd) == 1 && GET_R_FLAG(cmd) == 0 && poll_flag(bypass, STATE_REG_1, SYS2SPU_Q_EMP_FLAG, 1, SPU_BYPASS_POLL_SPINS, &state) != 0)
+  {
+    return -ETIMEDOUT;
+  }
+
+  if(poll_flag(bypass, STATE_REG_0, SPU_READY_FLAG, 1, SPU_BYPASS_POLL_SPINS, &state) != 0)
+  {
+    return -ETIMEDOUT;
+  }
+
+  for(i=0; i<SPU_WEIGHT; i++)
+  {
+    if(with_key)
+    {
+      reg_write(bypass, KEY_REG + i, key->cont[i]);
+    }
+    if(with_val)
+    {
+      reg_write(bypass, VAL_REG + i, val->cont[i]);
+    }
+  }
+
+  /* Key and value should reach SPU before command */
+  __sync_synchronize();
+  reg_write(bypass, CMD_REG, cmd_reg);
+
+  if(GET_P_FLAG(cmd) == 0)
+  {
+    return 0;
+  }
+
+  /* Ready flag of previous command is still set right after write - wait for SPU to drop it first */
+  /* Flag not seen dropped (command already finished) only delays the finish poll */
+  poll_flag(bypass, STATE_REG_0, SPU_READY_FLAG, 0, SPU_BYPASS_SETTLE_SPINS, &state);
+
+  /* Poll execution end */
+  if(poll_flag(bypass, STATE_REG_0, SPU_READY_FLAG, 1, SPU_BYPASS_POLL_SPINS, &state) != 0)
+  {
+    return -ETIMEDOUT;
+  }
+
+  rslt->rslt  = ERRORS(state);
+  rslt->power = reg_read(bypass, POWER_REG);
+
+  /* Only format 2 results have key and value */
+  switch(PURE_CMD(cmd))
+  {
+    CASE_RSLTFRMT_2:
+      for(i=0; i<SPU_WEIGHT; i++)
+      {
+        rslt->key.cont[i] = reg_read(bypass, KEY_REG + i);
+        rslt->val.cont[i] = reg_read(bypass, VAL_REG + i);
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+/* Single register write */
+static inline void reg_write(const struct spu_bypass *bypass, u32 addr_shift, u32 data)
+{
+  *(volatile u32 *)((volatile u8 *) bypass->regs + REG_ADDR(addr_shift)) = data;
+}
+
+/* Single register read */
+static inline u32 reg_read(const struct spu_bypass *bypass, u32 addr_shift)
+{
+  return *(volatile u32 *)((volatile u8 *) bypass->regs + REG_ADDR(addr_shift));
+}
+
+/* Single status register read */
+static inline u8 status_read(const struct spu_bypass *bypass, u32 addr_shift)
+{
+  return *((volatile u8 *) bypass->regs + REG_ADDR(addr_shift));
+}
+
+/* Busy poll untill state flag has value or there is no more attempts */
+static int poll_flag(const struct spu_bypass *bypass, u32 reg, u8 shift, u8 value, u32 spins, u8 *state)
+{
+  do
+  {
+    *state = status_read(bypass, reg);
+    if((SPU_FLAG(*state, shift) ? 1 : 0) == value)
+    {
+      return 0;
+    }
+  }
+  while(--spins);
+
+  return -ETIMEDOUT;
+}
@@ -0,0 +1,67 @@
+/*
+  spubypass.h
+        - user space SPU commands execution through mapped SPU registers
+        - kernel bypass mode of /dev/spu, see SPU_MMAP_REGS
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPUBYPASS_H
+#define SPUBYPASS_H
+
+#include <stddef.h>
+
+#include "spu.h"
+
+#ifdef __cplusplus
+extern "C" {
+using namespace SPU;
+#endif /* __cplusplus */
+
+/* Busy polling attempts before command is failed */
+#define SPU_BYPASS_POLL_SPINS 1000000
+
+/* Busy polling attempts to see SPU ready flag dropped after command write */
+#define SPU_BYPASS_SETTLE_SPINS 1000
+
+/* SPU registers mapping */
+struct spu_bypass
+{
+  volatile void *regs; // SPU registers page - mapped BAR or memory-backed fake
+  size_t len;          // Mapping length, 0 if registers are not mapped by library
+  int fd;              // Character device descriptor, -1 if not opened by library
+};
+
+/* SPU structures numbers of command, see spu_bypass_resolve */
+struct spu_bypass_strs
+{
+  u8 a; // Structure A - the only one for INS, DEL, SRCH, MIN, MAX, NEXT, PREV, NSM, NGR
+  u8 b; // Structure B of AND, OR, NOT
+  u8 r; // Result structure of AND, OR, NOT, LS, LSEQ, GR, GREQ
+};
+
+int spu_bypass_open(struct spu_bypass *bypass, const char *path);
+void spu_bypass_attach(struct spu_bypass *bypass, volatile void *regs);
+void spu_bypass_close(struct spu_bypass *bypass);
+int spu_bypass_resolve(const struct spu_bypass *bypass, gsid_t gsid);
+int spu_bypass_exec(const struct spu_bypass *bypass, cmd_t cmd, struct spu_bypass_strs strs,
+                    const spu_key_t *key, const val_t *val, struct rsltfrmt_2 *rslt);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* SPUBYPASS_H */
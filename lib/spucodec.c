@@ -0,0 +1,638 @@
+/*
+  spucodec.c
+        - order-preserving codec of typed and composite keys into SPU keys
+        - batch encode and decode with AVX2, NEON or scalar kernels
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+
+#include "spu.h"
+#include "spucodec.h"
+
+/* Key bytes */
+#define KEY_BYTES (SPU_WEIGHT*4)
+
+/* Whole key word may be stored straight from host memory */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  #define HOST_LE 1
+#else
+  #define HOST_LE 0
+#endif
+
+/* Sign bits */
+#define SIGN32 0x80000000U
+#define SIGN64 0x8000000000000000ULL
+
+/* Internal functions */
+static uint8_t field_width(uint8_t type);
+static uint64_t field_bits(uint8_t type, const union spu_field *field);
+static void set_field(uint8_t type, uint64_t bits, union spu_field *field);
+static inline uint32_t ord32(uint8_t type, uint32_t x);
+static inline uint32_t unord32(uint8_t type, uint32_t y);
+static inline uint64_t ord64(uint8_t type, uint64_t x);
+static inline uint64_t unord64(uint8_t type, uint64_t y);
+static void encode32(uint8_t type, const uint32_t *values, spu_key_t *keys, size_t count);
+static void decode32(uint8_t type, const spu_key_t *keys, uint32_t *values, size_t count);
+static void encode64(uint8_t type, const uint64_t *values, spu_key_t *keys, size_t count);
+static void decode64(uint8_t type, const spu_key_t *keys, uint64_t *values, size_t count);
+
+/* Check schema fits SPU key */
+int spu_codec_init(struct spu_codec *codec, const enum spu_field_type *types, uint8_t count)
+{
+  uint8_t i, width = 0;
+
+  if(count == 0 || count > SPU_CODEC_MAX_FIELDS)
+  {
+    return -EINVAL;
+  }
+
+  for(i=0; i<count; i++)
+  {
+    if(types[i] > SPU_FIELD_F64)
+    {
+      return -EINVAL;
+    }
+    codec->types[i] = types[i];
+    width += field_width(types[i]);
+  }
+
+  if(width > KEY_BYTES)
+  {
+    return -EINVAL;
+  }
+
+  codec->count = count;
+  return 0;
+}
+
+/* Pack fields from the highest key byte */
+void spu_codec_encode(const struct spu_codec *codec, const union spu_field *fields, spu_key_t *key)
+{
+  uint8_t bytes[KEY_BYTES] = { 0 };
+  uint8_t i, j, width, pos = 0;
+  uint64_t bits;
+
+  for(i=0; i<codec->count; i++)
+  {
+    width = field_width(codec->types[i]);
+    bits  = field_bits(codec->types[i], &fields[i]);
+
+    /* Big-endian field bytes */
+    for(j=0; j<width; j++)
+    {
+      bytes[pos + j] = (uint8_t)(bits >> 8*(width - 1 - j));
+    }
+    pos += width;
+  }
+
+  /* Words are numbers, so host byte order does not matter */
+  for(i=0; i<SPU_WEIGHT; i++)
+  {
+    key->cont[SPU_WEIGHT - 1 - i] = ((uint32_t)bytes[4*i] << 24) | ((uint32_t)bytes[4*i + 1] << 16) |
+                                    ((uint32_t)bytes[4*i + 2] << 8) | (uint32_t)bytes[4*i + 3];
+  }
+}
+
+/* Unpack fields from the highest key byte */
+void spu_codec_decode(const struct spu_codec *codec, const spu_key_t *key, union spu_field *fields)
+{
+  uint8_t bytes[KEY_BYTES];
+  uint8_t i, j, width, pos = 0;
+  uint64_t bits;
+  uint32_t word;
+
+  for(i=0; i<SPU_WEIGHT; i++)
+  {
+    word = key->cont[SPU_WEIGHT - 1 - i];
+    bytes[4*i]     = (uint8_t)(word >> 24);
+    bytes[4*i + 1] = (uint8_t)(word >> 16);
+    bytes[4*i + 2] = (uint8_t)(word >> 8);
+    bytes[4*i + 3] = (uint8_t)word;
+  }
+
+  for(i=0; i<codec->count; i++)
+  {
+    width = field_width(codec->types[i]);
+    bits  = 0;
+    for(j=0; j<width; j++)
+    {
+      bits = (bits << 8) | bytes[pos + j];
+    }
+    pos += width;
+
+    set_field(codec->types[i], bits, &fields[i]);
+  }
+}
+
+/* Encode array of one field keys */
+int spu_codec_encode_batch(enum spu_field_type type, const void *values, spu_key_t *keys, size_t count)
+{
+  struct spu_codec codec;
+  union spu_field field;
+  size_t i;
+
+  if(spu_codec_init(&codec, &type, 1) != 0)
+  {
+    return -EINVAL;
+  }
+
+  switch(field_width(type))
+  {
+    case 4:
+      encode32(type, (const uint32_t *) values, keys, count);
+      break;
+
+    case 8:
+      encode64(type, (const uint64_t *) values, keys, count);
+      break;
+
+    default:
+      for(i=0; i<count; i++)
+      {
+        switch(type)
+        {
+          case SPU_FIELD_U8:
+            field.u = ((const uint8_t *) values)[i];
+            break;
+
+          case SPU_FIELD_I8:
+            field.i = ((const int8_t *) values)[i];
+            break;
+
+          case SPU_FIELD_U16:
+            field.u = ((const uint16_t *) values)[i];
+            break;
+
+          default:
+            field.i = ((const int16_t *) values)[i];
+            break;
+        }
+        spu_codec_encode(&codec, &field, &keys[i]);
+      }
+      break;
+  }
+
+  return 0;
+}
+
+/* Decode array of one field keys */
+int spu_codec_decode_batch(enum spu_field_type type, const spu_key_t *keys, void *values, size_t count)
+{
+  struct spu_codec codec;
+  union spu_field field;
+  size_t i;
+
+  if(spu_codec_init(&codec, &type, 1) != 0)
+  {
+    return -EINVAL;
+  }
+
+  switch(field_width(type))
+  {
+    case 4:
+      decode32(type, keys, (uint32_t *) values, count);
+      break;
+
+    case 8:
+      decode64(type, keys, (uint64_t *) values, count);
+      break;
+
+    default:
+      for(i=0; i<count; i++)
+      {
+        spu_codec_decode(&codec, &keys[i], &field);
+        if(field_width(type) == 1)
+        {
+          *((uint8_t *) values + i) = (uint8_t) field.u;
+        }
+        else
+        {
+          *((uint16_t *) values + i) = (uint16_t) field.u;
+        }
+      }
+      break;
+  }
+
+  return 0;
+}
+
+/* Field width in bytes */
+static uint8_t field_width(uint8_t type)
+{
+  switch(type)
+  {
+    case SPU_FIELD_U8:
+    case SPU_FIELD_I8:
+      return 1;
+
+    case SPU_FIELD_U16:
+    case SPU_FIELD_I16:
+      return 2;
+
+    case SPU_FIELD_U32:
+    case SPU_FIELD_I32:
+    case SPU_FIELD_F32:
+      return 4;
+
+    default:
+      return 8;
+  }
+}
+
+/* Order-preserving unsigned bits of field */
+static uint64_t field_bits(uint8_t type, const union spu_field *field)
+{
+  uint8_t shift = 64 - 8*field_width(type);
+  uint32_t bits32;
+  uint64_t bits64;
+
+  switch(type)
+  {
+    case SPU_FIELD_U8:
+    case SPU_FIELD_U16:
+    case SPU_FIELD_U32:
+    case SPU_FIELD_U64:
+      return (field->u << shift) >> shift;
+
+    case SPU_FIELD_I8:
+    case SPU_FIELD_I16:
+    case SPU_FIELD_I32:
+    case SPU_FIELD_I64:
+      return (((uint64_t)field->i << shift) >> shift) ^ (SIGN64 >> shift);
+
+    case SPU_FIELD_F32:
+      memcpy(&bits32, &field->f32, sizeof(bits32));
+      return ord32(type, bits32);
+
+    default:
+      memcpy(&bits64, &field->f64, sizeof(bits64));
+      return ord64(type, bits64);
+  }
+}
+
+/* Field from order-preserving unsigned bits */
+static void set_field(uint8_t type, uint64_t bits, union spu_field *field)
+{
+  uint8_t shift = 64 - 8*field_width(type);
+  uint32_t bits32;
+  uint64_t bits64;
+
+  switch(type)
+  {
+    case SPU_FIELD_U8:
+    case SPU_FIELD_U16:
+    case SPU_FIELD_U32:
+    case SPU_FIELD_U64:
+      field->u = bits;
+      break;
+
+    case SPU_FIELD_I8:
+    case SPU_FIELD_I16:
+    case SPU_FIELD_I32:
+    case SPU_FIELD_I64:
+      /* Sign extension by arithmetic shift */
+      field->i = (int64_t)((bits ^ (SIGN64 >> shift)) << shift) >> shift;
+      break;
+
+    case SPU_FIELD_F32:
+      bits32 = unord32(type, (uint32_t) bits);
+      memcpy(&field->f32, &bits32, sizeof(bits32));
+      break;
+
+    default:
+      bits64 = unord64(type, bits);
+      memcpy(&field->f64, &bits64, sizeof(bits64));
+      break;
+  }
+}
+
+/* Order-preserving 32 bits - signed get sign flipped, negative floats get all bits flipped */
+static inline uint32_t ord32(uint8_t type, uint32_t x)
+{
+  switch(type)
+  {
+    case SPU_FIELD_I32:
+      return x ^ SIGN32;
+
+    case SPU_FIELD_F32:
+      return x ^ ((uint32_t)((int32_t)x >> 31) | SIGN32);
+
+    default:
+      return x;
+  }
+}
+
+/* Original 32 bits */
+static inline uint32_t unord32(uint8_t type, uint32_t y)
+{
+  switch(type)
+  {
+    case SPU_FIELD_I32:
+      return y ^ SIGN32;
+
+    case SPU_FIELD_F32:
+      return y ^ ((uint32_t)((int32_t)~y >> 31) | SIGN32);
+
+    default:
+      return y;
+  }
+}
+
+/* Order-preserving 64 bits */
+static inline uint64_t ord64(uint8_t type, uint64_t x)
+{
+  switch(type)
+  {
+    case SPU_FIELD_I64:
+      return x ^ SIGN64;
+
+    case SPU_FIELD_F64:
+      return x ^ ((uint64_t)((int64_t)x >> 63) | SIGN64);
+
+    default:
+      return x;
+  }
+}
+
+/* Original 64 bits */
+static inline uint64_t unord64(uint8_t type, uint64_t y)
+{
+  switch(type)
+  {
+    case SPU_FIELD_I64:
+      return y ^ SIGN64;
+
+    case SPU_FIELD_F64:
+      return y ^ ((uint64_t)((int64_t)~y >> 63) | SIGN64);
+
+    default:
+      return y;
+  }
+}
+
+/* Encode 32 bit fields into the highest key word */
+static void encode32(uint8_t type, const uint32_t *values, spu_key_t *keys, size_t count)
+{
+  size_t i = 0;
+
+#if defined(__AVX2__) && SPU_WEIGHT <= 2
+  /* Xor mask is sign of float or just sign bit of signed */
+  const __m256i sign = _mm256_set1_epi32((int) SIGN32);
+  __m256i x;
+  #if SPU_WEIGHT == 2
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i lo, hi;
+  #endif
+
+  for(; i + 8 <= count; i += 8)
+  {
+    x = _mm256_loadu_si256((const __m256i *)(values + i));
+    if(type == SPU_FIELD_I32)
+    {
+      x = _mm256_xor_si256(x, sign);
+    }
+    else if(type == SPU_FIELD_F32)
+    {
+      x = _mm256_xor_si256(x, _mm256_or_si256(_mm256_srai_epi32(x, 31), sign));
+    }
+
+  #if SPU_WEIGHT == 1
+    _mm256_storeu_si256((__m256i *)(keys + i), x);
+  #else
+    /* Zero low word under every value */
+    lo = _mm256_unpacklo_epi32(zero, x);
+    hi = _mm256_unpackhi_epi32(zero, x);
+    _mm256_storeu_si256((__m256i *)(keys + i),     _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(keys + i + 4), _mm256_permute2x128_si256(lo, hi, 0x31));
+  #endif
+  }
+#elif defined(__ARM_NEON) && HOST_LE && SPU_WEIGHT <= 2
+  const uint32x4_t sign = vdupq_n_u32(SIGN32);
+  uint32x4_t x;
+  #if SPU_WEIGHT == 2
+  uint32x4x2_t zip;
+  #endif
+
+  for(; i + 4 <= count; i += 4)
+  {
+    x = vld1q_u32(values + i);
+    if(type == SPU_FIELD_I32)
+    {
+      x = veorq_u32(x, sign);
+    }
+    else if(type == SPU_FIELD_F32)
+    {
+      x = veorq_u32(x, vorrq_u32(vreinterpretq_u32_s32(vshrq_n_s32(vreinterpretq_s32_u32(x), 31)), sign));
+    }
+
+  #if SPU_WEIGHT == 1
+    vst1q_u32(keys[i].cont, x);
+  #else
+    zip = vzipq_u32(vdupq_n_u32(0), x);
+    vst1q_u32(keys[i].cont,     zip.val[0]);
+    vst1q_u32(keys[i + 2].cont, zip.val[1]);
+  #endif
+  }
+#endif
+
+  /* Tail and wide keys */
+  for(; i<count; i++)
+  {
+    memset(&keys[i], 0, sizeof(spu_key_t));
+    keys[i].cont[SPU_WEIGHT - 1] = ord32(type, values[i]);
+  }
+}
+
+/* Decode 32 bit fields from the highest key word */
+static void decode32(uint8_t type, const spu_key_t *keys, uint32_t *values, size_t count)
+{
+  size_t i = 0;
+
+#if defined(__AVX2__) && SPU_WEIGHT <= 2
+  const __m256i sign = _mm256_set1_epi32((int) SIGN32);
+  const __m256i ones = _mm256_set1_epi32(-1);
+  __m256i y;
+  #if SPU_WEIGHT == 2
+  /* Odd words of two keys registers are the values */
+  const __m256i odd = _mm256_setr_epi32(1, 3, 5, 7, 0, 2, 4, 6);
+  __m256i a, b;
+  #endif
+
+  for(; i + 8 <= count; i += 8)
+  {
+  #if SPU_WEIGHT == 1
+    y = _mm256_loadu_si256((const __m256i *)(keys + i));
+  #else
+    a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(keys + i)),     odd);
+    b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(keys + i + 4)), odd);
+    y = _mm256_permute2x128_si256(a, b, 0x20);
+  #endif
+
+    if(type == SPU_FIELD_I32)
+    {
+      y = _mm256_xor_si256(y, sign);
+    }
+    else if(type == SPU_FIELD_F32)
+    {
+      y = _mm256_xor_si256(y, _mm256_or_si256(_mm256_srai_epi32(_mm256_xor_si256(y, ones), 31), sign));
+    }
+    _mm256_storeu_si256((__m256i *)(values + i), y);
+  }
+#elif defined(__ARM_NEON) && HOST_LE && SPU_WEIGHT <= 2
+  const uint32x4_t sign = vdupq_n_u32(SIGN32);
+  uint32x4_t y;
+
+  for(; i + 4 <= count; i += 4)
+  {
+  #if SPU_WEIGHT == 1
+    y = vld1q_u32(keys[i].cont);
+  #else
+    y = vld2q_u32(keys[i].cont).val[1];
+  #endif
+
+    if(type == SPU_FIELD_I32)
+    {
+      y = veorq_u32(y, sign);
+    }
+    else if(type == SPU_FIELD_F32)
+    {
+      y = veorq_u32(y, vorrq_u32(vreinterpretq_u32_s32(vshrq_n_s32(vreinterpretq_s32_u32(vmvnq_u32(y)), 31)), sign));
+    }
+    vst1q_u32(values + i, y);
+  }
+#endif
+
+  for(; i<count; i++)
+  {
+    values[i] = unord32(type, keys[i].cont[SPU_WEIGHT - 1]);
+  }
+}
+
+/* Encode 64 bit fields into two highest key words */
+/* One word keys have no 64 bit fields, see spu_codec_init */
+static void encode64(uint8_t type, const uint64_t *values, spu_key_t *keys, size_t count)
+{
+#if SPU_WEIGHT >= 2
+  size_t i = 0;
+  uint64_t y;
+
+  /* Key of two words is the little-endian 64 bit value itself */
+#if defined(__AVX2__) && SPU_WEIGHT == 2
+  const __m256i sign = _mm256_set1_epi64x((long long) SIGN64);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i x;
+
+  for(; i + 4 <= count; i += 4)
+  {
+    x = _mm256_loadu_si256((const __m256i *)(values + i));
+    if(type == SPU_FIELD_I64)
+    {
+      x = _mm256_xor_si256(x, sign);
+    }
+    else if(type == SPU_FIELD_F64)
+    {
+      x = _mm256_xor_si256(x, _mm256_or_si256(_mm256_cmpgt_epi64(zero, x), sign));
+    }
+    _mm256_storeu_si256((__m256i *)(keys + i), x);
+  }
+#elif defined(__ARM_NEON) && HOST_LE && SPU_WEIGHT == 2
+  const uint64x2_t sign = vdupq_n_u64(SIGN64);
+  uint64x2_t x;
+
+  for(; i + 2 <= count; i += 2)
+  {
+    x = vld1q_u64(values + i);
+    if(type == SPU_FIELD_I64)
+    {
+      x = veorq_u64(x, sign);
+    }
+    else if(type == SPU_FIELD_F64)
+    {
+      x = veorq_u64(x, vorrq_u64(vreinterpretq_u64_s64(vshrq_n_s64(vreinterpretq_s64_u64(x), 63)), sign));
+    }
+    vst1q_u32(keys[i].cont, vreinterpretq_u32_u64(x));
+  }
+#endif
+
+  for(; i<count; i++)
+  {
+    y = ord64(type, values[i]);
+    memset(&keys[i], 0, sizeof(spu_key_t));
+    keys[i].cont[SPU_WEIGHT - 2] = (uint32_t) y;
+    keys[i].cont[SPU_WEIGHT - 1] = (uint32_t)(y >> 32);
+  }
+#endif /* SPU_WEIGHT >= 2 */
+}
+
+/* Decode 64 bit fields from two highest key words */
+static void decode64(uint8_t type, const spu_key_t *keys, uint64_t *values, size_t count)
+{
+#if SPU_WEIGHT >= 2
+  size_t i = 0;
+
+#if defined(__AVX2__) && SPU_WEIGHT == 2
+  const __m256i sign = _mm256_set1_epi64x((long long) SIGN64);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i y;
+
+  for(; i + 4 <= count; i += 4)
+  {
+    y = _mm256_loadu_si256((const __m256i *)(keys + i));
+    if(type == SPU_FIELD_I64)
+    {
+      y = _mm256_xor_si256(y, sign);
+    }
+    else if(type == SPU_FIELD_F64)
+    {
+      /* Originally negative floats have sign bit cleared */
+      y = _mm256_xor_si256(y, _mm256_or_si256(_mm256_cmpgt_epi64(zero, _mm256_xor_si256(y, sign)), sign));
+    }
+    _mm256_storeu_si256((__m256i *)(values + i), y);
+  }
+#elif defined(__ARM_NEON) && HOST_LE && SPU_WEIGHT == 2
+  const uint64x2_t sign = vdupq_n_u64(SIGN64);
+  uint64x2_t y;
+
+  for(; i + 2 <= count; i += 2)
+  {
+    y = vreinterpretq_u64_u32(vld1q_u32(keys[i].cont));
+    if(type == SPU_FIELD_I64)
+    {
+      y = veorq_u64(y, sign);
+    }
+    else if(type == SPU_FIELD_F64)
+    {
+      y = veorq_u64(y, vorrq_u64(vreinterpretq_u64_s64(vshrq_n_s64(vreinterpretq_s64_u64(veorq_u64(y, sign)), 63)), sign));
+    }
+    vst1q_u64(values + i, y);
+  }
+#endif
+
+  for(; i<count; i++)
+  {
+    values[i] = unord64(type, ((uint64_t) keys[i].cont[SPU_WEIGHT - 1] << 32) | keys[i].cont[SPU_WEIGHT - 2]);
+  }
+#endif /* SPU_WEIGHT >= 2 */
+}
@@ -0,0 +1,84 @@
+/*
+  spucodec.h
+        - order-preserving codec of typed and composite keys into SPU keys
+        - batch encode and decode with AVX2, NEON or scalar kernels
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPUCODEC_H
+#define SPUCODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spu.h"
+
+#ifdef __cplusplus
+extern "C" {
+using namespace SPU;
+#endif /* __cplusplus */
+
+/* Maximum number of fields in composite key */
+#define SPU_CODEC_MAX_FIELDS 8
+
+/* Key field types */
+/* Encoded keys compare as unsigned numbers in the same order as field values */
+/* Floats order is -inf < negative < -0 < +0 < positive < +inf, NaNs are placed outside */
+enum spu_field_type
+{
+  SPU_FIELD_U8  = 0x00,
+  SPU_FIELD_U16 = 0x01,
+  SPU_FIELD_U32 = 0x02,
+  SPU_FIELD_U64 = 0x03,
+  SPU_FIELD_I8  = 0x04,
+  SPU_FIELD_I16 = 0x05,
+  SPU_FIELD_I32 = 0x06,
+  SPU_FIELD_I64 = 0x07,
+  SPU_FIELD_F32 = 0x08,
+  SPU_FIELD_F64 = 0x09
+}; /* enum spu_field_type */
+
+/* Field value - unsigned types use u, signed use i, floats use f32 and f64 */
+union spu_field
+{
+  uint64_t u;
+  int64_t i;
+  float f32;
+  double f64;
+};
+
+/* Composite key schema - first field is the most significant one */
+/* Fields are packed without gaps from the highest key bits, rest bits are zero */
+struct spu_codec
+{
+  uint8_t count;
+  uint8_t types[SPU_CODEC_MAX_FIELDS];
+};
+
+int spu_codec_init(struct spu_codec *codec, const enum spu_field_type *types, uint8_t count);
+void spu_codec_encode(const struct spu_codec *codec, const union spu_field *fields, spu_key_t *key);
+void spu_codec_decode(const struct spu_codec *codec, const spu_key_t *key, union spu_field *fields);
+
+/* Batch codec of one field keys - input and output are plain arrays of field type */
+int spu_codec_encode_batch(enum spu_field_type type, const void *values, spu_key_t *keys, size_t count);
+int spu_codec_decode_batch(enum spu_field_type type, const spu_key_t *keys, void *values, size_t count);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* SPUCODEC_H */
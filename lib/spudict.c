@@ -0,0 +1,413 @@
+/*
+  spudict.c
+        - order-preserving dictionary of strings into SPU key codes
+        - file image is used through mmap, no rebuild on restart
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spu.h"
+#include "spucodec.h"
+#include "spudict.h"
+
+/* Image identification */
+#define DICT_MAGIC   0x44555053 // "SPUD"
+#define DICT_VERSION 1
+
+/* Code field type of SPU key */
+#if SPU_WEIGHT == 1
+  #define CODE_FIELD SPU_FIELD_U32
+#else
+  #define CODE_FIELD SPU_FIELD_U64
+#endif
+
+/* Internal functions */
+static size_t image_len(uint32_t capacity, uint64_t heap_size);
+static int map_image(struct spu_dict *dict, int fd, size_t len, uint32_t capacity, int writable);
+static int raw_cmp(const char *a, size_t a_len, const char *b, size_t b_len);
+static int str_cmp(const struct spu_dict *dict, const struct spu_dict_entry *entry, const char *str, size_t len);
+static uint32_t lower_bound(const struct spu_dict *dict, const char *str, size_t len);
+static uint32_t prefix_end(const struct spu_dict *dict, uint32_t start, const char *prefix, size_t len);
+static uint64_t code_at(const struct spu_dict *dict, uint32_t idx);
+
+/* Create empty dictionary in file, anonymous memory if path is NULL */
+int spu_dict_create(struct spu_dict *dict, const char *path, uint32_t capacity, uint64_t heap_size)
+{
+  size_t len = image_len(capacity, heap_size);
+  int fd = -1, err;
+
+  if(path)
+  {
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+      return -errno;
+    }
+    if(ftruncate(fd, len) != 0)
+    {
+      err = -errno;
+      close(fd);
+      return err;
+    }
+  }
+
+  err = map_image(dict, fd, len, capacity, 1);
+  if(err)
+  {
+    return err;
+  }
+
+  dict->hdr->magic     = DICT_MAGIC;
+  dict->hdr->version   = DICT_VERSION;
+  dict->hdr->count     = 0;
+  dict->hdr->capacity  = capacity;
+  dict->hdr->heap_used = 0;
+  dict->hdr->heap_size = heap_size;
+  dict->hdr->code_end  = SPU_DICT_CODE_END;
+
+  return 0;
+}
+
+/* Map existing dictionary file */
+int spu_dict_open(struct spu_dict *dict, const char *path, int writable)
+{
+  struct spu_dict_hdr hdr;
+  struct stat st;
+  int fd;
+
+  fd = open(path, writable ? O_RDWR : O_RDONLY);
+  if(fd < 0)
+  {
+    return -errno;
+  }
+
+  /* Check header before mapping */
+  if(fstat(fd, &st) != 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+     hdr.magic != DICT_MAGIC || hdr.version != DICT_VERSION || hdr.code_end != SPU_DICT_CODE_END ||
+     (size_t) st.st_size < image_len(hdr.capacity, hdr.heap_size))
+  {
+    close(fd);
+    return -EINVAL;
+  }
+
+  return map_image(dict, fd, image_len(hdr.capacity, hdr.heap_size), hdr.capacity, writable);
+}
+
+/* Write dictionary image to file */
+int spu_dict_sync(const struct spu_dict *dict)
+{
+  if(dict->fd < 0)
+  {
+    return 0;
+  }
+
+  return msync(dict->hdr, dict->len, MS_SYNC) == 0 ? 0 : -errno;
+}
+
+/* Unmap dictionary */
+void spu_dict_close(struct spu_dict *dict)
+{
+  if(dict->hdr)
+  {
+    munmap(dict->hdr, dict->len);
+  }
+  if(dict->fd >= 0)
+  {
+    close(dict->fd);
+  }
+
+  dict->hdr     = NULL;
+  dict->entries = NULL;
+  dict->heap    = NULL;
+  dict->fd      = -1;
+}
+
+/* Fill empty dictionary from sorted unique strings - codes are spread evenly to leave gaps */
+int spu_dict_build(struct spu_dict *dict, const char *const *strs, const size_t *lens, uint32_t count)
+{
+  struct spu_dict_entry *entry;
+  uint64_t heap_need = 0, step;
+  uint32_t i;
+
+  if(dict->hdr->count != 0 || count > dict->hdr->capacity)
+  {
+    return -EINVAL;
+  }
+
+  for(i=0; i<count; i++)
+  {
+    heap_need += lens[i];
+    if(i && raw_cmp(strs[i-1], lens[i-1], strs[i], lens[i]) >= 0)
+    {
+      return -EINVAL;
+    }
+  }
+  if(heap_need > dict->hdr->heap_size)
+  {
+    return -ENOSPC;
+  }
+
+  step = SPU_DICT_CODE_END / ((uint64_t) count + 1);
+  for(i=0; i<count; i++)
+  {
+    entry = &dict->entries[i];
+    entry->code     = step * (i + 1);
+    entry->offset   = dict->hdr->heap_used;
+    entry->len      = lens[i];
+    entry->reserved = 0;
+
+    memcpy(dict->heap + entry->offset, strs[i], lens[i]);
+    dict->hdr->heap_used += lens[i];
+  }
+  dict->hdr->count = count;
+
+  return 0;
+}
+
+/* Insert string into gap between neighbours, existing string keeps its code */
+/* Returns -ENOSPC if there is no free code between neighbours, dictionary should be rebuilt then */
+int spu_dict_insert(struct spu_dict *dict, const char *str, size_t len, uint64_t *code)
+{
+  struct spu_dict_entry *entry;
+  uint32_t idx = lower_bound(dict, str, len);
+  uint64_t below, above;
+
+  if(idx < dict->hdr->count && str_cmp(dict, &dict->entries[idx], str, len) == 0)
+  {
+    *code = dict->entries[idx].code;
+    return 0;
+  }
+
+  if(dict->hdr->count == dict->hdr->capacity || dict->hdr->heap_used + len > dict->hdr->heap_size)
+  {
+    return -ENOSPC;
+  }
+
+  below = idx ? dict->entries[idx-1].code : 0;
+  above = idx < dict->hdr->count ? dict->entries[idx].code : SPU_DICT_CODE_END;
+  if(above - below < 2)
+  {
+    return -ENOSPC;
+  }
+
+  memmove(&dict->entries[idx+1], &dict->entries[idx], (dict->hdr->count - idx)*sizeof(struct spu_dict_entry));
+
+  entry = &dict->entries[idx];
+  entry->code     = below + (above - below)/2;
+  entry->offset   = dict->hdr->heap_used;
+  entry->len      = len;
+  entry->reserved = 0;
+
+  memcpy(dict->heap + entry->offset, str, len);
+  dict->hdr->heap_used += len;
+  dict->hdr->count++;
+
+  *code = entry->code;
+  return 0;
+}
+
+/* Get code of string */
+int spu_dict_lookup(const struct spu_dict *dict, const char *str, size_t len, uint64_t *code)
+{
+  uint32_t idx = lower_bound(dict, str, len);
+
+  if(idx == dict->hdr->count || str_cmp(dict, &dict->entries[idx], str, len) != 0)
+  {
+    return -ENOENT;
+  }
+
+  *code = dict->entries[idx].code;
+  return 0;
+}
+
+/* Get string of code - string points into mapped heap */
+int spu_dict_string(const struct spu_dict *dict, uint64_t code, const char **str, size_t *len)
+{
+  uint32_t lo = 0, hi = dict->hdr->count, mid;
+
+  while(lo < hi)
+  {
+    mid = lo + (hi - lo)/2;
+    if(dict->entries[mid].code < code)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  if(lo == dict->hdr->count || dict->entries[lo].code != code)
+  {
+    return -ENOENT;
+  }
+
+  *str = dict->heap + dict->entries[lo].offset;
+  *len = dict->entries[lo].len;
+  return 0;
+}
+
+/* Strings range [from, to) as codes range [code_from, code_to) */
+void spu_dict_range(const struct spu_dict *dict, const char *from, size_t from_len, const char *to, size_t to_len,
+                    uint64_t *code_from, uint64_t *code_to)
+{
+  *code_from = code_at(dict, lower_bound(dict, from, from_len));
+  *code_to   = code_at(dict, lower_bound(dict, to, to_len));
+}
+
+/* Strings with prefix as codes range [code_from, code_to) */
+void spu_dict_prefix(const struct spu_dict *dict, const char *prefix, size_t len, uint64_t *code_from, uint64_t *code_to)
+{
+  uint32_t start = lower_bound(dict, prefix, len);
+
+  *code_from = code_at(dict, start);
+  *code_to   = code_at(dict, prefix_end(dict, start, prefix, len));
+}
+
+/* Code placed into the highest key words */
+void spu_dict_key(uint64_t code, spu_key_t *key)
+{
+#if SPU_WEIGHT == 1
+  uint32_t code_32 = (uint32_t) code;
+  spu_codec_encode_batch(CODE_FIELD, &code_32, key, 1);
+#else
+  spu_codec_encode_batch(CODE_FIELD, &code, key, 1);
+#endif
+}
+
+/* Code from the highest key words */
+uint64_t spu_dict_code(const spu_key_t *key)
+{
+#if SPU_WEIGHT == 1
+  uint32_t code_32;
+  spu_codec_decode_batch(CODE_FIELD, key, &code_32, 1);
+  return code_32;
+#else
+  uint64_t code;
+  spu_codec_decode_batch(CODE_FIELD, key, &code, 1);
+  return code;
+#endif
+}
+
+/* Header, entries and strings heap */
+static size_t image_len(uint32_t capacity, uint64_t heap_size)
+{
+  return sizeof(struct spu_dict_hdr) + (size_t) capacity*sizeof(struct spu_dict_entry) + heap_size;
+}
+
+/* Map image and set dictionary pointers */
+static int map_image(struct spu_dict *dict, int fd, size_t len, uint32_t capacity, int writable)
+{
+  void *image;
+  int err;
+
+  image = mmap(NULL, len, PROT_READ | (writable ? PROT_WRITE : 0),
+               fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, fd, 0);
+  if(image == MAP_FAILED)
+  {
+    err = -errno;
+    if(fd >= 0)
+    {
+      close(fd);
+    }
+    return err;
+  }
+
+  dict->hdr     = image;
+  dict->entries = (struct spu_dict_entry *)(dict->hdr + 1);
+  dict->heap    = (char *)(dict->entries + capacity);
+  dict->len     = len;
+  dict->fd      = fd;
+
+  return 0;
+}
+
+/* Lexicographic compare of byte strings */
+static int raw_cmp(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+  int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+  if(cmp)
+  {
+    return cmp;
+  }
+
+  return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
+
+/* Lexicographic compare of entry string and string */
+static int str_cmp(const struct spu_dict *dict, const struct spu_dict_entry *entry, const char *str, size_t len)
+{
+  return raw_cmp(dict->heap + entry->offset, entry->len, str, len);
+}
+
+/* First entry not less than string */
+static uint32_t lower_bound(const struct spu_dict *dict, const char *str, size_t len)
+{
+  uint32_t lo = 0, hi = dict->hdr->count, mid;
+
+  while(lo < hi)
+  {
+    mid = lo + (hi - lo)/2;
+    if(str_cmp(dict, &dict->entries[mid], str, len) < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* First entry after start without prefix */
+static uint32_t prefix_end(const struct spu_dict *dict, uint32_t start, const char *prefix, size_t len)
+{
+  uint32_t lo = start, hi = dict->hdr->count, mid;
+  const struct spu_dict_entry *entry;
+
+  while(lo < hi)
+  {
+    mid   = lo + (hi - lo)/2;
+    entry = &dict->entries[mid];
+    if(entry->len >= len && memcmp(dict->heap + entry->offset, prefix, len) == 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* Code of entry or end code after last entry */
+static uint64_t code_at(const struct spu_dict *dict, uint32_t idx)
+{
+  return idx < dict->hdr->count ? dict->entries[idx].code : SPU_DICT_CODE_END;
+}
@@ -0,0 +1,97 @@
+/*
+  spudict.h
+        - order-preserving dictionary of strings into SPU key codes
+        - file image is used through mmap, no rebuild on restart
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPUDICT_H
+#define SPUDICT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spu.h"
+
+#ifdef __cplusplus
+extern "C" {
+using namespace SPU;
+#endif /* __cplusplus */
+
+/* Codes are as wide as key allows, but not wider than 64 bits */
+/* Code 0 is below every string and SPU_DICT_CODE_END is above every string */
+#if SPU_WEIGHT == 1
+  #define SPU_DICT_CODE_END 0xFFFFFFFFULL
+#else
+  #define SPU_DICT_CODE_END 0xFFFFFFFFFFFFFFFFULL
+#endif
+
+/* Dictionary image header */
+struct spu_dict_hdr
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;     // Strings in dictionary
+  uint32_t capacity;  // Maximal count of strings
+  uint64_t heap_used; // Bytes of strings heap used
+  uint64_t heap_size; // Bytes of strings heap
+  uint64_t code_end;  // SPU_DICT_CODE_END of SPU the image was built for
+};
+
+/* Dictionary entry - entries are sorted by string and by code at the same time */
+struct spu_dict_entry
+{
+  uint64_t code;
+  uint64_t offset; // String offset in heap
+  uint32_t len;    // String length, strings are not zero terminated
+  uint32_t reserved;
+};
+
+/* Mapped dictionary - header, entries and strings heap in one image */
+struct spu_dict
+{
+  struct spu_dict_hdr *hdr;
+  struct spu_dict_entry *entries;
+  char *heap;
+  size_t len; // Image length
+  int fd;     // Image file, -1 for anonymous dictionary
+};
+
+int spu_dict_create(struct spu_dict *dict, const char *path, uint32_t capacity, uint64_t heap_size);
+int spu_dict_open(struct spu_dict *dict, const char *path, int writable);
+int spu_dict_sync(const struct spu_dict *dict);
+void spu_dict_close(struct spu_dict *dict);
+
+int spu_dict_build(struct spu_dict *dict, const char *const *strs, const size_t *lens, uint32_t count);
+int spu_dict_insert(struct spu_dict *dict, const char *str, size_t len, uint64_t *code);
+int spu_dict_lookup(const struct spu_dict *dict, const char *str, size_t len, uint64_t *code);
+int spu_dict_string(const struct spu_dict *dict, uint64_t code, const char **str, size_t *len);
+
+/* Code ranges of strings ranges - slice by GREQ from and LS to */
+void spu_dict_range(const struct spu_dict *dict, const char *from, size_t from_len, const char *to, size_t to_len,
+                    uint64_t *code_from, uint64_t *code_to);
+void spu_dict_prefix(const struct spu_dict *dict, const char *prefix, size_t len, uint64_t *code_from, uint64_t *code_to);
+
+/* Code as SPU key and back */
+void spu_dict_key(uint64_t code, spu_key_t *key);
+uint64_t spu_dict_code(const spu_key_t *key);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* SPUDICT_H */
@@ -0,0 +1,80 @@
+/*
+  spustatus.c
+        - user space reading of driver status page
+        - syscall-free SPU state and structures power, see SPU_MMAP_STATUS
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "spu.h"
+#include "spustatus.h"
+
+/* Map status page of opened character device, NULL on fault with errno set */
+const volatile struct spu_status *spu_status_map(int fd)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  void *page;
+
+  page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, SPU_MMAP_STATUS * page_size);
+  if(page == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  return (const volatile struct spu_status *) page;
+}
+
+/* Unmap status page */
+void spu_status_unmap(const volatile struct spu_status *page)
+{
+  munmap((void *) page, sysconf(_SC_PAGESIZE));
+}
+
+/* Copy consistent status - retried while driver updates page */
+void spu_status_read(const volatile struct spu_status *page, struct spu_status *status)
+{
+  u32 seq;
+
+  do
+  {
+    while((seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1);
+    memcpy(status, (const void *) page, sizeof(*status));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  }
+  while(__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* Find power of structure in status copy, -ENOENT if structure is not in SPU */
+int spu_status_power(const struct spu_status *status, gsid_t gsid, u32 *power)
+{
+  int i;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    if(!memcmp(&status->strs[i].gsid, &gsid, sizeof(gsid_t)))
+    {
+      *power = status->strs[i].power;
+      return 0;
+    }
+  }
+
+  return -ENOENT;
+}
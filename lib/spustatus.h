@@ -0,0 +1,41 @@
+/*
+  spustatus.h
+        - user space reading of driver status page
+        - syscall-free SPU state and structures power, see SPU_MMAP_STATUS
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPUSTATUS_H
+#define SPUSTATUS_H
+
+#include "spu.h"
+
+#ifdef __cplusplus
+extern "C" {
+using namespace SPU;
+#endif /* __cplusplus */
+
+const volatile struct spu_status *spu_status_map(int fd);
+void spu_status_unmap(const volatile struct spu_status *page);
+void spu_status_read(const volatile struct spu_status *page, struct spu_status *status);
+int spu_status_power(const struct spu_status *status, gsid_t gsid, u32 *power);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* SPUSTATUS_H */
@@ -0,0 +1,214 @@
+/*
+  aggrexec.c
+        - range aggregate command executor implementation
+        - COUNT by slices or scan, SUM, MIN, MAX of values by scan
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "AGGR execution"
+
+#include <linux/slab.h>
+
+#include "spu.h"
+#include "log.h"
+#include "pcidrv.h"
+#include "cmdexec.h"
+#include "aggrexec.h"
+#include "gsidresolver.h"
+#include "partition.h"
+
+/* Value as unsigned integer of lower 64 bits */
+#if SPU_WEIGHT == 1
+  #define VAL_U64(val) ( (u64)(val).cont[0] )
+#else
+  #define VAL_U64(val) ( (u64)(val).cont[0] | ((u64)(val).cont[1] << 32) )
+#endif
+
+/* Internal functions */
+static int count_sliced(const struct cmdfrmt_10 *cmd, struct rsltfrmt_7 *rslt, struct exec_ctx *ctx);
+static int scan(const struct cmdfrmt_10 *cmd, struct rsltfrmt_7 *rslt, struct exec_ctx *ctx);
+static void free_tmp(gsid_t gsid, struct exec_ctx *ctx);
+
+/* AGGR command executor */
+size_t execute_aggr(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_10 *cmd = CMDFRMT_10(cmd_buf);
+  struct rsltfrmt_7 *rslt;
+  int err = -ENOKEY;
+
+  LOG_DEBUG("AGGR command execution with function %d", cmd->func);
+
+  /* Check command and result fit buffer */
+  if(ctx->size < sizeof(struct cmdfrmt_10) || ctx->size < sizeof(struct rsltfrmt_7))
+  {
+    LOG_ERROR("Wrong AGGR command size");
+    return -EINVAL;
+  }
+
+  if(cmd->func > AGGR_MAX)
+  {
+    LOG_ERROR("Unknown aggregate function %d", cmd->func);
+    return -EINVAL;
+  }
+
+  if(!part_is(cmd->gsid) && resolve_gsid(cmd->gsid, SRCH) <= 0)
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "was not found", GSID_VAR(cmd->gsid));
+    return -ENOKEY;
+  }
+
+  /* Allocate result */
+  rslt = kzalloc(sizeof(struct rsltfrmt_7), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+  *res_buf = rslt;
+
+  if(key_cmp(&cmd->from, &cmd->to) >= 0)
+  {
+    LOG_DEBUG("Empty range");
+    rslt->rslt = OK;
+    return sizeof(struct rsltfrmt_7);
+  }
+
+  /* Slices are not cheaper than scan of small structures */
+  /* Power is an upper estimation of keys in range, logical structure is scanned across partitions */
+  if(cmd->func == AGGR_COUNT && !part_is(cmd->gsid) && get_gsid_power(cmd->gsid) > AGGR_SLICE_CMDS)
+  {
+    err = count_sliced(cmd, rslt, ctx);
+  }
+
+  /* Values are read only by scan, range is scanned as well if slices failed or there are no free structures */
+  if(err == -ENOKEY || err == -EIO)
+  {
+    err = scan(cmd, rslt, ctx);
+  }
+
+  rslt->rslt = err ? ERR : OK;
+  LOG_DEBUG("AGGR counted %u keys, value %llu", rslt->count, (unsigned long long)rslt->value);
+  return sizeof(struct rsltfrmt_7);
+}
+
+/* Count keys of range as power of GREQ slice sliced by LS */
+/* Returns -ENOKEY if there is no space for temporary structures */
+static int count_sliced(const struct cmdfrmt_10 *cmd, struct rsltfrmt_7 *rslt, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_5 cmd_5;
+  struct rsltfrmt_1 rslt_1;
+  gsid_t tmp_greq, tmp_ls;
+  int err;
+
+  if(create_gsid(&tmp_greq) != 0)
+  {
+    return -ENOKEY;
+  }
+  if(create_gsid(&tmp_ls) != 0)
+  {
+    resolve_gsid(tmp_greq, DELS);
+    return -ENOKEY;
+  }
+
+  cmd_5 = (struct cmdfrmt_5) { .cmd = GREQ | P_FLAG, .gsid_a = cmd->gsid, .gsid_r = tmp_greq, .key = cmd->from };
+  err = execute_int_cmd(&cmd_5, sizeof(cmd_5), &rslt_1, sizeof(rslt_1), ctx);
+
+  if(!err)
+  {
+    cmd_5 = (struct cmdfrmt_5) { .cmd = LS | P_FLAG, .gsid_a = tmp_greq, .gsid_r = tmp_ls, .key = cmd->to };
+    err = execute_int_cmd(&cmd_5, sizeof(cmd_5), &rslt_1, sizeof(rslt_1), ctx);
+  }
+
+  free_tmp(tmp_greq, ctx);
+  free_tmp(tmp_ls, ctx);
+
+  if(err)
+  {
+    return err;
+  }
+
+  rslt->sliced = 1;
+  rslt->count  = rslt_1.power;
+  rslt->value  = rslt_1.power;
+
+  return 0;
+}
+
+/* Walk range from first key not less than from by NEXT */
+static int scan(const struct cmdfrmt_10 *cmd, struct rsltfrmt_7 *rslt, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 cmd_2 =
+  {
+    .cmd  = SRCH | P_FLAG,
+    .gsid = cmd->gsid,
+    .key  = cmd->from
+  };
+  struct rsltfrmt_2 rslt_2;
+  u64 value;
+  int err;
+
+  /* Range start is the key itself or the nearest greater one */
+  err = execute_int_cmd(&cmd_2, sizeof(cmd_2), &rslt_2, sizeof(rslt_2), ctx);
+  if(err == -EIO)
+  {
+    cmd_2.cmd = NGR | P_FLAG;
+    err = execute_int_cmd(&cmd_2, sizeof(cmd_2), &rslt_2, sizeof(rslt_2), ctx);
+  }
+
+  while(!err && key_cmp(&rslt_2.key, &cmd->to) < 0)
+  {
+    value = VAL_U64(rslt_2.val);
+    switch(cmd->func)
+    {
+      case AGGR_COUNT:
+        rslt->value++;
+        break;
+
+      case AGGR_SUM:
+        rslt->value += value;
+        break;
+
+      case AGGR_MIN:
+        rslt->value = (!rslt->count || value < rslt->value) ? value : rslt->value;
+        break;
+
+      case AGGR_MAX:
+        rslt->value = (!rslt->count || value > rslt->value) ? value : rslt->value;
+        break;
+    }
+    rslt->count++;
+
+    cmd_2.cmd = NEXT | P_FLAG;
+    cmd_2.key = rslt_2.key;
+    err = execute_int_cmd(&cmd_2, sizeof(cmd_2), &rslt_2, sizeof(rslt_2), ctx);
+  }
+
+  /* Error status is returned when there are no more keys */
+  return err == -EIO ? 0 : err;
+}
+
+/* Delete temporary structure */
+static void free_tmp(gsid_t gsid, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_3 dels = { .cmd = DELS, .gsid = gsid };
+  struct rsltfrmt_0 rslt;
+
+  execute_int_cmd(&dels, sizeof(dels), &rslt, sizeof(rslt), ctx);
+  LOG_DEBUG("Temporary GSID" GSID_FORMAT "deleted", GSID_VAR(gsid));
+}
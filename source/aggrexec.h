@@ -0,0 +1,31 @@
+/*
+  aggrexec.h
+        - range aggregate command executor definitions
+        - COUNT by slices or scan, SUM, MIN, MAX of values by scan
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AGGREXEC_H
+#define AGGREXEC_H
+
+/* SPU commands of slice counting - two slices and two temporary structures deletion */
+/* Structures of not greater power are scanned */
+#define AGGR_SLICE_CMDS 4
+
+size_t execute_aggr(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+
+#endif /* AGGREXEC_H */
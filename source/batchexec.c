@@ -0,0 +1,258 @@
+/*
+  batchexec.c
+        - batch command executor
+        - bursts of INS, DEL released from suspended SPU queue
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "batch execution"
+
+#include <linux/slab.h>
+#include <linux/stddef.h>
+
+#include "spu.h"
+#include "log.h"
+#include "pcidrv.h"
+#include "cmdexec.h"
+#include "batchexec.h"
+#include "gsidresolver.h"
+#include "snapshot.h"
+#include "partition.h"
+
+/* Internal functions */
+static void load_cmd(const struct cmdfrmt_1 *cmd, int str);
+
+/* BTCH command executor */
+size_t execute_batch(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  u32 count = CMDFRMT_8(cmd_buf)->count;
+  struct rsltfrmt_5 *rslt;
+  u32 done = 0;
+  int err;
+
+  LOG_DEBUG("BTCH command execution with %u commands", count);
+
+  /* Check batch size */
+  if(count == 0 || count > SPU_BATCH_MAX_CMDS ||
+     ctx->size < offsetof(struct cmdfrmt_8, cmds) + count*sizeof(struct cmdfrmt_1))
+  {
+    LOG_ERROR("Wrong BTCH command size");
+    return -EINVAL;
+  }
+
+  /* Allocate result */
+  rslt = kzalloc(sizeof(struct rsltfrmt_5), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+  *res_buf = rslt;
+
+  err = run_batch(CMDFRMT_8(cmd_buf)->cmds, count, &done, NULL, ctx);
+
+  rslt->rslt  = err ? ERR : OK;
+  rslt->count = done;
+
+  LOG_DEBUG("BTCH sent %u commands of %u", done, count);
+  return sizeof(struct rsltfrmt_5);
+}
+
+/* Send INS, DEL commands in bursts */
+/* SPU queue is suspended while burst is loaded, then released at once */
+/* Status of every sent command is put into status if given - SPU without result queue gives status of burst */
+/* Error status of command does not stop batch, -EIO is returned after whole batch */
+int run_batch(const struct cmdfrmt_1 *cmds, u32 count, u32 *done, rslt_t *status, struct exec_ctx *ctx)
+{
+  struct rsltfrmt_2 item;
+  int *strs;
+  u8 spu_state, queued = 0, failed = 0;
+  u32 i, k, burst_start, tsc_start;
+  int err = 0;
+
+  *done = 0;
+
+  strs = kmalloc(count*sizeof(int), GFP_KERNEL);
+  if(!strs)
+  {
+    LOG_ERROR("Could not allocate batch structures");
+    return -ENOMEM;
+  }
+
+  /* Whole batch is checked before any command is sent */
+  for(i=0; i<count; i++)
+  {
+    switch(PURE_CMD(cmds[i].cmd))
+    {
+      CASE_BATCH_CMD:
+        break;
+
+      default:
+        LOG_ERROR("Command 0x%02x could not be batched", cmds[i].cmd);
+        err = -EINVAL;
+        goto out;
+    }
+
+    if(snap_is(cmds[i].gsid))
+    {
+      LOG_ERROR("Snapshot GSID" GSID_FORMAT "is read-only", GSID_VAR(cmds[i].gsid));
+      err = -EROFS;
+      goto out;
+    }
+
+    /* Logical structure command goes to partition holding key */
+    strs[i] = resolve_gsid(part_route(cmds[i].gsid, &cmds[i].key), PURE_CMD(cmds[i].cmd));
+    if(strs[i] <= 0)
+    {
+      LOG_ERROR("GSID" GSID_FORMAT "was not found", GSID_VAR(cmds[i].gsid));
+      err = -ENOKEY;
+      goto out;
+    }
+  }
+
+  /* Results of queued commands are taken from SPU to CPU queue on new SPU revisions */
+  queued = pci_get_revision() >= MISD_REVISION;
+  if(queued)
+  {
+    pci_control_set(ALLOW_MISD_FLAG, 1);
+  }
+
+  /* Burst by burst while SPU queue is not full */
+  i = 0;
+  while(i < count)
+  {
+    err = poll_spu(STATE_REG_0, SPU_READY_FLAG, &spu_state, ctx);
+    if(err)
+    {
+      LOG_ERROR("SPU is not ready for operation");
+      recover_poll(err);
+      break;
+    }
+
+    burst_start = i;
+    pci_control_set(SUSPEND_Q_FLAG, 1);
+
+    do
+    {
+      load_cmd(&cmds[i], strs[i]);
+      i++;
+    }
+    while(i < count && !spu_queue_full());
+
+    /* Release burst */
+    tsc_start = pci_single_read(TSC_REG);
+    pci_control_set(SUSPEND_Q_FLAG, 0);
+    pci_shadow_invalidate(); // DEL results are placed by SPU into key and value registers
+    LOG_DEBUG("Released burst of %u commands", i - burst_start);
+
+    /* Status of every command from its own result */
+    for(k=burst_start; queued && k<i; k++)
+    {
+      err = poll_spu_finish(STATE_REG_1, SPU2CPU_Q_EMP_FLAG, 0, &spu_state, ctx);
+      if(err)
+      {
+        LOG_ERROR("SPU can not finish command %u of batch", k);
+        drain_results(i - k);
+        *done = k;
+        goto out;
+      }
+
+      take_result(&item);
+      item.rslt = queued_status(cmds[k].cmd, &cmds[k].key, &item);
+      set_str_power(strs[k], item.power);
+      failed |= ERRORS(item.rslt) != 0;
+      if(status)
+      {
+        status[k] = item.rslt;
+      }
+    }
+
+    err = poll_spu_finish(STATE_REG_1, SYS2SPU_Q_EMP_FLAG, 1, &spu_state, ctx);
+    if(!err)
+    {
+      err = poll_spu_finish(STATE_REG_0, SPU_READY_FLAG, 1, &spu_state, ctx);
+    }
+    if(err)
+    {
+      LOG_ERROR("SPU can not finish burst");
+      recover_poll(err);
+      break;
+    }
+    ctx->tsc += pci_single_read(TSC_REG) - tsc_start;
+
+    *done = i;
+    if(!queued && ERRORS(spu_state))
+    {
+      LOG_ERROR("SPU finished burst with error 0x%02x", ERRORS(spu_state));
+      failed = 1;
+    }
+    for(k=burst_start; !queued && status && k<i; k++)
+    {
+      status[k] = ERRORS(spu_state) ? ERR : OK;
+    }
+  }
+
+out:
+  if(queued)
+  {
+    pci_control_set(ALLOW_MISD_FLAG, 0);
+  }
+  kfree(strs);
+  return !err && failed ? -EIO : err;
+}
+
+/* Load one command into suspended SPU queue */
+static void load_cmd(const struct cmdfrmt_1 *cmd, int str)
+{
+  u32 addr_shift[SPU_WEIGHT*2 + 1], data[SPU_WEIGHT*2 + 1];
+  struct pci_burst pci_burst =
+  {
+    .count      = 0,
+    .addr_shift = addr_shift,
+    .data       = data
+  };
+  u8 i;
+
+  for(i=0; i<SPU_WEIGHT; i++)
+  {
+    addr_shift[pci_burst.count] = KEY_REG + i;
+    data[pci_burst.count++]     = cmd->key.cont[i];
+  }
+
+  /* Only INS has a value */
+  if(PURE_CMD(cmd->cmd) == INS)
+  {
+    for(i=0; i<SPU_WEIGHT; i++)
+    {
+      addr_shift[pci_burst.count] = VAL_REG + i;
+      data[pci_burst.count++]     = cmd->val.cont[i];
+    }
+  }
+
+  addr_shift[pci_burst.count] = CMD_REG;
+  data[pci_burst.count++]     = CMD_SHIFT( PURE_CMD(cmd->cmd) | Q_FLAG ) | str;
+
+  pci_burst_write(&pci_burst);
+
+  /* Power is not returned - upper estimation */
+  if(PURE_CMD(cmd->cmd) == INS)
+  {
+    set_str_power(str, get_str_power(str) + 1);
+  }
+}
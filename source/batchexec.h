@@ -0,0 +1,32 @@
+/*
+  batchexec.h
+        - batch command executor definitions
+        - bursts of INS, DEL released from suspended SPU queue
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATCHEXEC_H
+#define BATCHEXEC_H
+
+/* Macros to switch across batch commands */
+#define CASE_BATCH_CMD case INS:\
+                       case DEL
+
+size_t execute_batch(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+int run_batch(const struct cmdfrmt_1 *cmds, u32 count, u32 *done, rslt_t *status, struct exec_ctx *ctx);
+
+#endif /* BATCHEXEC_H */
@@ -28,31 +28,123 @@
 #include <linux/uaccess.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/capability.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/semaphore.h>
+#include <linux/ktime.h>
 
 #include "spu.h"
 #include "log.h"
 #include "info.h"
 #include "chardev.h"
 #include "cmdexec.h"
+#include "pcidrv.h"
+#include "gsidresolver.h"
+#include "wbuffer.h"
+#include "snapshot.h"
+#include "handle.h"
+#include "replica.h"
+#include "status.h"
 
 /* Static global vars */
 static struct device* device = NULL;    // Device itself
 static struct cdev char_device;         // Character device
 static int cdev_major = 0;              // Device major number
 static struct class* cdev_class = NULL; // Device class structure, need to interact with udev
+static DEFINE_SEMAPHORE(spu_sem);        // SPU commands are executed one by one
+static int bypass_maps = 0;             // Mappings of SPU registers into user space, driver is stopped while any
+
+/* Opened file private data */
+struct spu_file
+{
+  u32 opts;                 // File options, see enum file_opt
+  struct mutex lock;        // Results queue lock
+  u8 *rslt_queue;           // Results of writev commands waiting for read, SPU_RSLT_QUEUE_SIZE bytes
+  size_t rslt_head;         // First not read result byte
+  size_t rslt_tail;         // End of queued results
+  struct hndl_table *hndls; // Structure handles, allocated with first handle
+  u32 deadline_ms;          // Time to wait busy SPU for, 0 to wait without limit
+  int iter_err;             // Error of writev command after executed ones, returned by next writev
+};
+
+/* Commands accepted by writev - fixed size ones */
+union iter_cmd
+{
+  struct cmdfrmt_0 frmt_0;
+  struct cmdfrmt_1 frmt_1;
+  struct cmdfrmt_2 frmt_2;
+  struct cmdfrmt_3 frmt_3;
+  struct rsltfrmt_9 frmt_3_room; // SNAP and HNDL commands are padded to result size, see cmd_size
+  struct cmdfrmt_4 frmt_4;
+  struct cmdfrmt_5 frmt_5;
+  struct cmdfrmt_6 frmt_6;
+  struct cmdfrmt_7 frmt_7;
+  struct rsltfrmt_4 frmt_7_room; // MISD command is padded to result size, see cmd_size
+  struct cmdfrmt_10 frmt_10;
+  struct cmdfrmt_12 frmt_12;
+  struct cmdfrmt_13 frmt_13;
+  struct cmdfrmt_14 frmt_14;
+};
+
+/* Results of commands accepted by writev */
+union iter_rslt
+{
+  struct rsltfrmt_0 frmt_0;
+  struct rsltfrmt_1 frmt_1;
+  struct rsltfrmt_2 frmt_2;
+  struct rsltfrmt_3 frmt_3;
+  struct rsltfrmt_4 frmt_4;
+  struct rsltfrmt_7 frmt_7;
+  struct rsltfrmt_9 frmt_9;
+  struct rsltfrmt_10 frmt_10;
+  struct rsltfrmt_11 frmt_11;
+};
+
+/* Queue space needed by one result with trailer */
+#define ITER_RSLT_SIZE ( sizeof(union iter_rslt) + sizeof(tsc_t) )
 
 /* Char device file operations functions definitions */
 static int cdev_open(struct inode *inode, struct file *file);
 static int cdev_release(struct inode *inode, struct file *file);
 static ssize_t cdev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset);
+static ssize_t cdev_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t cdev_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static long cdev_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg);
+static int cdev_mmap(struct file *file, struct vm_area_struct *vma);
+static void bypass_vm_open(struct vm_area_struct *vma);
+static void bypass_vm_close(struct vm_area_struct *vma);
+static int cdev_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+static void set_deadline(struct exec_ctx *exec_ctx, const struct file *file);
+static int lock_spu(const struct exec_ctx *exec_ctx);
+static void unlock_spu(void);
+static int flush_wbuf(void);
+static void wbuf_flush_work(struct work_struct *work);
 
 /* Char device file operations registration */
 static const struct file_operations cdev_fops =
 {
-  .owner   = THIS_MODULE,
-  .open    = cdev_open,
-  .release = cdev_release,
-  .write   = cdev_write
+  .owner          = THIS_MODULE,
+  .open           = cdev_open,
+  .release        = cdev_release,
+  .write          = cdev_write,
+  .write_iter     = cdev_write_iter,
+  .read_iter      = cdev_read_iter,
+  .unlocked_ioctl = cdev_ioctl,
+  .mmap           = cdev_mmap,
+  .fsync          = cdev_fsync
+};
+
+/* Write-behind buffer flush after SPU_WBUF_FLUSH_MS from first buffered mutation */
+static DECLARE_DELAYED_WORK(wbuf_work, wbuf_flush_work);
+
+/* SPU registers mapping operations */
+static const struct vm_operations_struct bypass_vm_ops =
+{
+  .open  = bypass_vm_open,
+  .close = bypass_vm_close
 };
 
 /* Create character device */
@@ -98,6 +190,13 @@ void destroy_char_device(void)
 {
   int cdev_minor = 0;
 
+  /* Buffered mutations are sent to SPU before driver goes away */
+  cancel_delayed_work_sync(&wbuf_work);
+  if(flush_wbuf())
+  {
+    LOG_ERROR("Write-behind buffer could not be flushed");
+  }
+
   /* Undo actions from create_char_device */
   device_destroy(cdev_class, MKDEV(cdev_major, cdev_minor));
   class_unregister(cdev_class);
@@ -108,6 +207,17 @@ void destroy_char_device(void)
 /* Function called on file open */
 static int cdev_open(struct inode *inode, struct file *file)
 {
+  struct spu_file *spu_file = kzalloc(sizeof(struct spu_file), GFP_KERNEL);
+
+  if(!spu_file)
+  {
+    LOG_ERROR("Could not allocate file private data");
+    return -ENOMEM;
+  }
+  mutex_init(&spu_file->lock);
+  spu_file->deadline_ms = SPU_DEADLINE_MS;
+  file->private_data = spu_file;
+
   LOG_DEBUG("Character device opened");
   return 0;
 }
@@ -115,6 +225,31 @@ static int cdev_open(struct inode *inode, struct file *file)
 /* Function called on file close */
 static int cdev_release(struct inode *inode, struct file *file)
 {
+  struct spu_file *spu_file = file->private_data;
+  struct exec_ctx exec_ctx = { 0 };
+
+  /* Snapshots are deleted with last reference, later if SPU registers are mapped now */
+  /* Temporary structures of handles could be deleted only now */
+  down(&spu_sem);
+  snap_release(spu_file);
+  if(!bypass_maps)
+  {
+    snap_collect(&exec_ctx);
+    if(spu_file->hndls)
+    {
+      hndl_release(spu_file->hndls, &exec_ctx);
+    }
+  }
+  else if(spu_file->hndls)
+  {
+    LOG_ERROR("SPU registers are mapped, temporary structures of handles are left");
+  }
+  up(&spu_sem);
+
+  kfree(spu_file->hndls);
+  kfree(spu_file->rslt_queue);
+  kfree(spu_file);
+
   LOG_DEBUG("Character device closed");
   return 0;
 }
@@ -122,10 +257,13 @@ static int cdev_release(struct inode *inode, struct file *file)
 /* Function called on write */
 static ssize_t cdev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
 {
+  struct spu_file *spu_file = file->private_data;
+  struct exec_ctx exec_ctx;
   void *usr_buf = (void*) buf;
   void *usr_cmd = kmalloc(count, GFP_KERNEL);
   const void *usr_res = NULL;
   int rslt_count = 0;
+  int err;
 
   LOG_DEBUG("Character device write operation invoked");
 
@@ -138,7 +276,18 @@ static ssize_t cdev_write(struct file *file, const char __user *buf, size_t coun
   LOG_DEBUG("Character device copy command from user");
 
   LOG_DEBUG("Character device gave command to execute");
-  rslt_count = execute_cmd(usr_cmd, &usr_res);
+  exec_ctx.size  = count;
+  exec_ctx.owner = spu_file;
+  exec_ctx.hndls = spu_file->hndls;
+  set_deadline(&exec_ctx, file);
+  err = lock_spu(&exec_ctx);
+  if(err)
+  {
+    kfree(usr_cmd);
+    return err;
+  }
+  rslt_count = execute_cmd(usr_cmd, &usr_res, &exec_ctx);
+  unlock_spu();
 
   /* Check if result has length */
   if(rslt_count > 0)
@@ -153,6 +302,22 @@ static ssize_t cdev_write(struct file *file, const char __user *buf, size_t coun
     }
     LOG_DEBUG("Character device wrote result to user");
 
+    /* Add device cycles trailer - only when user buffer has room for it */
+    if((spu_file->opts & TSC_OPT) && count < (size_t) rslt_count + sizeof(tsc_t))
+    {
+      LOG_DEBUG("User buffer has no room for cycles trailer");
+    }
+    else if(spu_file->opts & TSC_OPT)
+    {
+      if(copy_to_user(usr_buf + rslt_count, &exec_ctx.tsc, sizeof(tsc_t)))
+      {
+        LOG_ERROR("Character device could not copy cycles trailer into user space");
+        return -EFAULT;
+      }
+      rslt_count += sizeof(tsc_t);
+      LOG_DEBUG("Character device wrote cycles trailer to user");
+    }
+
     if(usr_cmd)
     {
       kzfree(usr_cmd);
@@ -171,4 +336,488 @@ static ssize_t cdev_write(struct file *file, const char __user *buf, size_t coun
   }
 
   return rslt_count;
+}
+
+/* Function called on writev - execute every command gathered from iovecs */
+/* Results are queued in the file and are read by read or readv */
+static ssize_t cdev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+  struct spu_file *spu_file = iocb->ki_filp->private_data;
+  struct exec_ctx exec_ctx;
+  union iter_cmd *usr_cmd;
+  const void *usr_res;
+  size_t size, rslt_count;
+  ssize_t done = 0;
+  int err = 0;
+
+  LOG_DEBUG("Character device write iterator invoked with %ld bytes", (unsigned long int)iov_iter_count(from));
+
+  usr_cmd = kmalloc(sizeof(union iter_cmd), GFP_KERNEL);
+  if(!usr_cmd)
+  {
+    LOG_ERROR("Could not allocate command container");
+    return -ENOMEM;
+  }
+
+  mutex_lock(&spu_file->lock);
+
+  /* Short count was returned before, failed command error is reported now */
+  if(spu_file->iter_err)
+  {
+    err = spu_file->iter_err;
+    spu_file->iter_err = 0;
+    LOG_DEBUG("Reporting error %d of previous writev", err);
+    goto unlock_file;
+  }
+
+  if(!spu_file->rslt_queue)
+  {
+    spu_file->rslt_queue = kmalloc(SPU_RSLT_QUEUE_SIZE, GFP_KERNEL);
+    if(!spu_file->rslt_queue)
+    {
+      LOG_ERROR("Could not allocate results queue");
+      err = -ENOMEM;
+      goto unlock_file;
+    }
+  }
+
+  set_deadline(&exec_ctx, iocb->ki_filp);
+  err = lock_spu(&exec_ctx);
+  if(err)
+  {
+    goto unlock_file;
+  }
+
+  while(iov_iter_count(from))
+  {
+    /* Command size is known from command code, command may span several iovecs */
+    if(copy_from_iter(usr_cmd, sizeof(cmd_t), from) != sizeof(cmd_t))
+    {
+      err = -EFAULT;
+      break;
+    }
+
+    size = cmd_size(CMDFRMT_0(usr_cmd)->cmd);
+    if(!size)
+    {
+      LOG_ERROR("Command 0x%02x could not be sent by writev", CMDFRMT_0(usr_cmd)->cmd);
+      err = -EINVAL;
+      break;
+    }
+
+    if(copy_from_iter((u8 *) usr_cmd + sizeof(cmd_t), size - sizeof(cmd_t), from) != size - sizeof(cmd_t))
+    {
+      LOG_ERROR("Command 0x%02x is truncated", CMDFRMT_0(usr_cmd)->cmd);
+      err = -EINVAL;
+      break;
+    }
+
+    /* Make room for result - move not read results to queue start */
+    if(SPU_RSLT_QUEUE_SIZE - spu_file->rslt_tail < ITER_RSLT_SIZE && spu_file->rslt_head)
+    {
+      spu_file->rslt_tail -= spu_file->rslt_head;
+      memmove(spu_file->rslt_queue, spu_file->rslt_queue + spu_file->rslt_head, spu_file->rslt_tail);
+      spu_file->rslt_head = 0;
+    }
+
+    if(SPU_RSLT_QUEUE_SIZE - spu_file->rslt_tail < ITER_RSLT_SIZE)
+    {
+      LOG_DEBUG("Results queue is full");
+      err = -ENOBUFS;
+      break;
+    }
+
+    exec_ctx.size  = size;
+    exec_ctx.owner = spu_file;
+    exec_ctx.hndls = spu_file->hndls;
+    set_deadline(&exec_ctx, iocb->ki_filp);
+    usr_res = NULL;
+    rslt_count = execute_cmd(usr_cmd, &usr_res, &exec_ctx);
+    if((ssize_t)rslt_count <= 0)
+    {
+      LOG_ERROR("Character device got no result of an operation");
+      kfree(usr_res);
+      err = (ssize_t)rslt_count < 0 ? (ssize_t)rslt_count : -EIO;
+      break;
+    }
+
+    memcpy(spu_file->rslt_queue + spu_file->rslt_tail, usr_res, rslt_count);
+    spu_file->rslt_tail += rslt_count;
+    kfree(usr_res);
+
+    /* Add device cycles trailer */
+    if(spu_file->opts & TSC_OPT)
+    {
+      memcpy(spu_file->rslt_queue + spu_file->rslt_tail, &exec_ctx.tsc, sizeof(tsc_t));
+      spu_file->rslt_tail += sizeof(tsc_t);
+    }
+
+    done += size;
+  }
+  unlock_spu();
+
+  /* Commands executed before failed one are reported as written, error is kept for next writev */
+  if(done && err)
+  {
+    spu_file->iter_err = err;
+  }
+
+unlock_file:
+  mutex_unlock(&spu_file->lock);
+  kfree(usr_cmd);
+
+  return done ? done : err;
+}
+
+/* Function called on read and readv - scatter queued results into iovecs */
+static ssize_t cdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+  struct spu_file *spu_file = iocb->ki_filp->private_data;
+  size_t count;
+
+  mutex_lock(&spu_file->lock);
+  count = min_t(size_t, spu_file->rslt_tail - spu_file->rslt_head, iov_iter_count(to));
+  if(count)
+  {
+    count = copy_to_iter(spu_file->rslt_queue + spu_file->rslt_head, count, to);
+    spu_file->rslt_head += count;
+    if(spu_file->rslt_head == spu_file->rslt_tail)
+    {
+      spu_file->rslt_head = 0;
+      spu_file->rslt_tail = 0;
+    }
+  }
+  mutex_unlock(&spu_file->lock);
+
+  if(!count && iov_iter_count(to) && spu_file->rslt_tail)
+  {
+    LOG_ERROR("Character device could not copy results into user space");
+    return -EFAULT;
+  }
+
+  LOG_DEBUG("Character device read %ld bytes of results", (unsigned long int)count);
+  return count;
+}
+
+/* Function called on ioctl */
+static long cdev_ioctl(struct file *file, unsigned int ioctl_cmd, unsigned long arg)
+{
+  struct spu_file *spu_file = file->private_data;
+  void __user *usr_arg = (void __user *) arg;
+  struct spu_stats stats;
+  struct spu_wbuf wbuf;
+  struct spu_hndl hndl;
+  struct exec_ctx exec_ctx = { 0 };
+  gsid_t gsid;
+  u32 hndl_num;
+  int str, err;
+
+  LOG_DEBUG("Character device ioctl 0x%08x invoked", ioctl_cmd);
+
+  switch(ioctl_cmd)
+  {
+    case SPU_IOC_SET_OPTS:
+      if(copy_from_user(&spu_file->opts, usr_arg, sizeof(u32)))
+      {
+        return -EFAULT;
+      }
+      LOG_DEBUG("File options set to 0x%08x", spu_file->opts);
+      return 0;
+
+    case SPU_IOC_GET_OPTS:
+      if(copy_to_user(usr_arg, &spu_file->opts, sizeof(u32)))
+      {
+        return -EFAULT;
+      }
+      return 0;
+
+    case SPU_IOC_GET_STATS:
+      get_stats(&stats);
+      if(copy_to_user(usr_arg, &stats, sizeof(struct spu_stats)))
+      {
+        return -EFAULT;
+      }
+      return 0;
+
+    case SPU_IOC_GET_STR:
+      if(copy_from_user(&gsid, usr_arg, sizeof(gsid_t)))
+      {
+        return -EFAULT;
+      }
+      down(&spu_sem);
+      str = resolve_gsid(gsid, SRCH);
+      up(&spu_sem);
+      return str;
+
+    case SPU_IOC_SET_WBUF:
+      if(copy_from_user(&wbuf, usr_arg, sizeof(struct spu_wbuf)))
+      {
+        return -EFAULT;
+      }
+      set_deadline(&exec_ctx, file);
+      err = lock_spu(&exec_ctx);
+      if(err)
+      {
+        return err;
+      }
+      err = snap_is(wbuf.gsid) ? -EROFS : repl_is(wbuf.gsid) ? -EBUSY : wbuf_enable(wbuf.gsid, wbuf.enable != 0, &exec_ctx);
+      unlock_spu();
+      return err;
+
+    case SPU_IOC_GET_SNAP:
+      if(copy_from_user(&gsid, usr_arg, sizeof(gsid_t)))
+      {
+        return -EFAULT;
+      }
+      down(&spu_sem);
+      err = snap_get(gsid, spu_file);
+      up(&spu_sem);
+      return err;
+
+    case SPU_IOC_PUT_SNAP:
+      if(copy_from_user(&gsid, usr_arg, sizeof(gsid_t)))
+      {
+        return -EFAULT;
+      }
+      down(&spu_sem);
+      err = snap_put(gsid, spu_file);
+      if(!err && !bypass_maps)
+      {
+        snap_collect(&exec_ctx);
+      }
+      up(&spu_sem);
+      return err;
+
+    case SPU_IOC_OPEN_HNDL:
+      if(copy_from_user(&hndl, usr_arg, sizeof(struct spu_hndl)))
+      {
+        return -EFAULT;
+      }
+      down(&spu_sem);
+      if(!spu_file->hndls)
+      {
+        spu_file->hndls = kzalloc(sizeof(struct hndl_table), GFP_KERNEL);
+      }
+      err = spu_file->hndls ? hndl_open(spu_file->hndls, hndl.gsid, hndl.flags) : -ENOMEM;
+      up(&spu_sem);
+      return err;
+
+    case SPU_IOC_CLOSE_HNDL:
+      if(copy_from_user(&hndl_num, usr_arg, sizeof(u32)))
+      {
+        return -EFAULT;
+      }
+      set_deadline(&exec_ctx, file);
+      err = lock_spu(&exec_ctx);
+      if(err)
+      {
+        return err;
+      }
+      err = spu_file->hndls ? hndl_close(spu_file->hndls, hndl_num, &exec_ctx) : -EBADF;
+      unlock_spu();
+      return err;
+
+    case SPU_IOC_SET_DEADLINE:
+      if(copy_from_user(&spu_file->deadline_ms, usr_arg, sizeof(u32)))
+      {
+        return -EFAULT;
+      }
+      LOG_DEBUG("File deadline set to %u ms", spu_file->deadline_ms);
+      return 0;
+
+    case SPU_IOC_RESET_Q:
+      set_deadline(&exec_ctx, file);
+      err = lock_spu(&exec_ctx);
+      if(err)
+      {
+        return err;
+      }
+      recover_spu();
+      unlock_spu();
+      return 0;
+
+    default:
+      LOG_ERROR("Unknown ioctl 0x%08x", ioctl_cmd);
+      return -ENOTTY;
+  }
+}
+
+/* Function called on fsync - flush write-behind buffer of every structure */
+static int cdev_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+  LOG_DEBUG("Character device fsync invoked");
+  return flush_wbuf();
+}
+
+/* Function called on mmap - map SPU registers into user space */
+static int cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct exec_ctx exec_ctx = { 0 };
+  phys_addr_t bar_start;
+  unsigned long bar_len;
+  int err;
+
+  /* Status page is read-only and does not stop driver commands */
+  if(vma->vm_pgoff == SPU_MMAP_STATUS)
+  {
+    return status_mmap(vma);
+  }
+
+  if(vma->vm_pgoff != SPU_MMAP_REGS)
+  {
+    LOG_ERROR("Unknown mmap offset 0x%lx", vma->vm_pgoff);
+    return -EINVAL;
+  }
+
+  /* Raw registers access bypasses every driver check */
+  if(!capable(CAP_SYS_RAWIO))
+  {
+    return -EPERM;
+  }
+
+  err = pci_get_bar(&bar_start, &bar_len);
+  if(err)
+  {
+    return err;
+  }
+
+  /* Only one mapping, driver stops own commands while mapped */
+  down(&spu_sem);
+  if(bypass_maps)
+  {
+    up(&spu_sem);
+    LOG_DEBUG("SPU registers are already mapped");
+    return -EBUSY;
+  }
+
+  /* User space should see every buffered mutation */
+  if(wbuf_flush_all(&exec_ctx))
+  {
+    LOG_ERROR("Write-behind buffer could not be flushed");
+  }
+
+  vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+  vma->vm_flags    |= VM_IO | VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
+  err = vm_iomap_memory(vma, bar_start, bar_len);
+  if(!err)
+  {
+    vma->vm_ops = &bypass_vm_ops;
+    bypass_maps = 1;
+    pci_shadow_invalidate(); // User space writes key and value registers by itself
+    LOG_INFO("SPU registers mapped into user space, driver commands stopped");
+  }
+  up(&spu_sem);
+
+  return err;
+}
+
+/* SPU registers mapping was split */
+static void bypass_vm_open(struct vm_area_struct *vma)
+{
+  down(&spu_sem);
+  bypass_maps++;
+  up(&spu_sem);
+}
+
+/* SPU registers mapping was removed */
+static void bypass_vm_close(struct vm_area_struct *vma)
+{
+  down(&spu_sem);
+  bypass_maps--;
+  if(!bypass_maps)
+  {
+    pci_shadow_invalidate();
+    LOG_INFO("SPU registers unmapped from user space, driver commands resumed");
+  }
+  up(&spu_sem);
+}
+
+/* Command deadline from file deadline, O_NONBLOCK file does not wait */
+static void set_deadline(struct exec_ctx *exec_ctx, const struct file *file)
+{
+  const struct spu_file *spu_file = file->private_data;
+
+  exec_ctx->nonblock    = (file->f_flags & O_NONBLOCK) != 0;
+  exec_ctx->deadline_ns = spu_file->deadline_ms ? ktime_get_ns() + (u64)spu_file->deadline_ms*NSEC_PER_MSEC : U64_MAX;
+}
+
+/* Take SPU for driver commands - fails while SPU registers are mapped into user space */
+/* Waits until command deadline, driver own work without deadline waits as long as needed */
+static int lock_spu(const struct exec_ctx *exec_ctx)
+{
+  u64 now_ns;
+
+  if(exec_ctx->nonblock)
+  {
+    if(down_trylock(&spu_sem))
+    {
+      return -EAGAIN;
+    }
+  }
+  else if(exec_ctx->deadline_ns == 0)
+  {
+    down(&spu_sem);
+  }
+  else if(exec_ctx->deadline_ns == U64_MAX)
+  {
+    if(down_interruptible(&spu_sem))
+    {
+      return -EINTR;
+    }
+  }
+  else
+  {
+    now_ns = ktime_get_ns();
+    if(now_ns >= exec_ctx->deadline_ns ||
+       down_timeout(&spu_sem, nsecs_to_jiffies(exec_ctx->deadline_ns - now_ns)))
+    {
+      LOG_DEBUG("SPU was not taken before deadline");
+      return -ETIMEDOUT;
+    }
+  }
+
+  if(bypass_maps)
+  {
+    up(&spu_sem);
+    LOG_DEBUG("SPU registers are mapped into user space");
+    return -EBUSY;
+  }
+
+  return 0;
+}
+
+/* Release SPU - delayed flush is armed while write-behind buffer has mutations */
+static void unlock_spu(void)
+{
+  if(wbuf_pending())
+  {
+    schedule_delayed_work(&wbuf_work, msecs_to_jiffies(SPU_WBUF_FLUSH_MS));
+  }
+  up(&spu_sem);
+}
+
+/* Flush write-behind buffer of every structure */
+static int flush_wbuf(void)
+{
+  struct exec_ctx exec_ctx = { 0 };
+  int err;
+
+  err = lock_spu(&exec_ctx);
+  if(err)
+  {
+    return err;
+  }
+  err = wbuf_flush_all(&exec_ctx);
+  up(&spu_sem);
+
+  return err;
+}
+
+/* Delayed write-behind buffer flush */
+static void wbuf_flush_work(struct work_struct *work)
+{
+  if(flush_wbuf())
+  {
+    LOG_ERROR("Write-behind buffer could not be flushed");
+  }
 }
\ No newline at end of file
@@ -24,26 +24,274 @@
 
 #include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/sched/signal.h>
 
 #include "spu.h"
 #include "log.h"
 #include "pcidrv.h"
 #include "cmdexec.h"
 #include "gsidresolver.h"
+#include "exprexec.h"
+#include "planner.h"
+#include "misdexec.h"
+#include "batchexec.h"
+#include "mgetexec.h"
+#include "aggrexec.h"
+#include "topkexec.h"
+#include "wbuffer.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "handle.h"
+#include "partition.h"
+#include "replica.h"
+#include "status.h"
+#include "values.h"
+
+/* Driver statistics counters */
+static atomic64_t stats_cmds       = ATOMIC64_INIT(0);
+static atomic64_t stats_polled     = ATOMIC64_INIT(0);
+static atomic64_t stats_errors     = ATOMIC64_INIT(0);
+static atomic64_t stats_dev_cycles = ATOMIC64_INIT(0);
+static atomic64_t stats_host_ns    = ATOMIC64_INIT(0);
+static atomic64_t stats_busy       = ATOMIC64_INIT(0);
+static atomic64_t stats_rejected   = ATOMIC64_INIT(0);
+static atomic64_t stats_recovered  = ATOMIC64_INIT(0);
+static atomic64_t stats_replayed   = ATOMIC64_INIT(0);
+
+/* Sleep between checks of busy SPU, us */
+#define BUSY_SLEEP_US 100
+
+/* Time for SPU to update queue flags after command write, ns */
+#define Q_SETTLE_NS 200
+
+/* Replays of idempotent command after SPU queues reset */
+#define REPLAY_MAX 1
+
+/* Depth of commands in execution - internal commands of composite ones are not traced */
+static u32 cmd_depth = 0;
+
+/* SPU structures used by command */
+struct burst_strs
+{
+  int a; // Structure A (the only one for formats 1, 2, 3)
+  int b; // Structure B
+  int r; // Result structure (same as A for formats 1, 2, 3)
+};
 
 /* Internal functions */
+static size_t exec_cmd(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static void account_cmd(u8 cmd, size_t rslt_size, const void *res_buf, const struct exec_ctx *ctx, u64 host_ns);
 static size_t alloc_rslt(const void **res_buf, u8 cmd);
 static void adds(const void *res_buf);
-static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf);
+static int send_cmd(const struct pci_burst *pci_burst_w, u8 cmd, u8 *spu_status, struct exec_ctx *ctx);
+static int cmd_replayable(u8 cmd);
+static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf, struct burst_strs *strs);
 static int init_burst_r(struct pci_burst *pci_burst, u8 cmd);
-static int poll_spu(u8 reg, u8 shift, u8 *state);
+static void free_burst(struct pci_burst *pci_burst);
+static int poll_spu_flag(u8 reg, u8 shift, u8 value, u8 *state, u64 deadline_ns, u8 nonblock);
+static int wait_spu_free(const struct exec_ctx *ctx);
 static void set_rsltfrmt(struct pci_burst *pci_burst, u8 cmd, const void *res_buf, u8 spu_status);
+static void update_power(u8 cmd, const struct burst_strs *strs, const void *res_buf);
 
 /* Commands execution in command workflow */
-size_t execute_cmd(const void *cmd_buf, const void **res_buf)
+size_t execute_cmd(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  u64 start_ns = ktime_get_ns();
+  u64 host_ns;
+  size_t rslt_size;
+
+  ctx->tsc = 0;
+  cmd_depth++;
+  rslt_size = exec_cmd(cmd_buf, res_buf, ctx);
+  cmd_depth--;
+  host_ns = ktime_get_ns() - start_ns;
+
+  account_cmd(CMDFRMT_0(cmd_buf)->cmd, rslt_size, *res_buf, ctx, host_ns);
+
+  /* Values kept by driver are freed only after structure is deleted */
+  vals_deleted(cmd_buf, rslt_size, *res_buf);
+
+  /* Only commands sent by files are traced - not flushes and snapshot deletes */
+  if(!cmd_depth && ctx->owner)
+  {
+    trace_cmd(cmd_buf, rslt_size, *res_buf, ctx, start_ns, host_ns);
+  }
+
+  /* Status page is published once for whole composite command */
+  if(!cmd_depth)
+  {
+    status_update();
+  }
+
+  return rslt_size;
+}
+
+/* Execute driver internal command and copy result into given buffer */
+/* Used by driver composite commands, device cycles are added to caller context */
+int execute_int_cmd(const void *cmd_buf, size_t cmd_size, void *rslt, size_t rslt_size, struct exec_ctx *ctx)
+{
+  struct exec_ctx int_ctx =
+  {
+    .size  = cmd_size,
+    .tsc   = 0,
+    .owner       = ctx->owner,
+    .hndls       = ctx->hndls,
+    .deadline_ns = ctx->deadline_ns,
+    .nonblock    = ctx->nonblock
+  };
+  const void *res_buf = NULL;
+  ssize_t size;
+  int err = 0;
+
+  size = execute_cmd(cmd_buf, &res_buf, &int_ctx);
+  ctx->tsc += int_ctx.tsc;
+
+  if(size <= 0 || !res_buf)
+  {
+    LOG_ERROR("Internal command 0x%02x execution failed", CMDFRMT_0(cmd_buf)->cmd);
+    err = size < 0 ? size : -ENOEXEC;
+  }
+  else
+  {
+    memcpy(rslt, res_buf, min_t(size_t, size, rslt_size));
+    if(ERRORS(RSLTFRMT_0(res_buf)->rslt))
+    {
+      LOG_DEBUG("Internal command 0x%02x returned with error status", CMDFRMT_0(cmd_buf)->cmd);
+      err = -EIO;
+    }
+  }
+
+  if(res_buf)
+  {
+    kfree(res_buf);
+  }
+
+  return err;
+}
+
+/* Get size of fixed size command, 0 for unknown and variable size commands */
+size_t cmd_size(u8 cmd)
+{
+  switch(PURE_CMD(cmd))
+  {
+    case ADDS:
+      return sizeof(struct cmdfrmt_0);
+
+    CASE_CMDFRMT_1:
+      return sizeof(struct cmdfrmt_1);
+
+    CASE_CMDFRMT_2:
+      return sizeof(struct cmdfrmt_2);
+
+    CASE_CMDFRMT_3:
+      return sizeof(struct cmdfrmt_3);
+
+    CASE_CMDFRMT_4:
+      return sizeof(struct cmdfrmt_4);
+
+    CASE_CMDFRMT_5:
+      return sizeof(struct cmdfrmt_5);
+
+    case EXPR:
+      return sizeof(struct cmdfrmt_6);
+
+    /* MISD result is written over command, so command takes room of result */
+    case MISD:
+      return max_t(size_t, sizeof(struct cmdfrmt_7), sizeof(struct rsltfrmt_4));
+
+    case AGGR:
+      return sizeof(struct cmdfrmt_10);
+
+    /* SNAP result is copied over command, so command takes room of result */
+    case SNAP:
+      return max_t(size_t, sizeof(struct cmdfrmt_3), sizeof(struct rsltfrmt_9));
+
+    /* HNDL result is result of inner command, the largest one is SNAP result */
+    case HNDL:
+      return max_t(size_t, sizeof(struct cmdfrmt_12), sizeof(struct rsltfrmt_9));
+
+    case PART:
+      return sizeof(struct cmdfrmt_13);
+
+    case REPL:
+      return sizeof(struct cmdfrmt_14);
+
+    default:
+      return 0;
+  }
+}
+
+/* Get size of result of simple command or SNAP, 0 for unknown commands */
+size_t cmd_rslt_size(u8 cmd)
+{
+  if(PURE_CMD(cmd) == SNAP)
+  {
+    return sizeof(struct rsltfrmt_9);
+  }
+
+  /* No polling - only status is returned */
+  if(GET_P_FLAG(cmd) == 0)
+  {
+    return sizeof(struct rsltfrmt_0);
+  }
+
+  switch(PURE_CMD(cmd))
+  {
+    CASE_RSLTFRMT_0:
+      return sizeof(struct rsltfrmt_0);
+
+    CASE_RSLTFRMT_1:
+      return sizeof(struct rsltfrmt_1);
+
+    CASE_RSLTFRMT_2:
+      return sizeof(struct rsltfrmt_2);
+
+    default:
+      return 0;
+  }
+}
+
+/* Compare keys as unsigned numbers - last word is the most significant */
+int key_cmp(const spu_key_t *a, const spu_key_t *b)
+{
+  u8 i;
+
+  for(i=SPU_WEIGHT; i>0; i--)
+  {
+    if(a->cont[i-1] != b->cont[i-1])
+    {
+      return a->cont[i-1] < b->cont[i-1] ? -1 : 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Get driver statistics */
+void get_stats(struct spu_stats *stats)
 {
-  u8 spu_state = 0, spu_status;
+  stats->cmds       = atomic64_read(&stats_cmds);
+  stats->polled     = atomic64_read(&stats_polled);
+  stats->errors     = atomic64_read(&stats_errors);
+  stats->dev_cycles = atomic64_read(&stats_dev_cycles);
+  stats->host_ns    = atomic64_read(&stats_host_ns);
+  stats->busy       = atomic64_read(&stats_busy);
+  stats->rejected   = atomic64_read(&stats_rejected);
+  stats->recovered  = atomic64_read(&stats_recovered);
+  stats->replayed   = atomic64_read(&stats_replayed);
+  get_vals_stats(&stats->vals_bytes, &stats->vals_live);
+}
+
+/* Execute single command */
+static size_t exec_cmd(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  u8 spu_status;
   size_t rslt_size = 0;
+  struct burst_strs strs = { 0 };
+  u8 replays;
+  int err;
   
   struct pci_burst pci_burst_w =
   {
@@ -63,134 +311,226 @@ size_t execute_cmd(const void *cmd_buf, const void **res_buf)
   u8 cmd = CMDFRMT_0(cmd_buf)->cmd;
   LOG_DEBUG("Executing command 0x%02x with Q=%d, R=%d, P=%d", PURE_CMD(cmd), GET_Q_FLAG(cmd), GET_R_FLAG(cmd), GET_P_FLAG(cmd)); 
 
-  /* Allocate result structure with pulling */
-  rslt_size = alloc_rslt(res_buf, cmd);
+  /* Structures given by handles - inner command goes through whole workflow */
+  if(PURE_CMD(cmd) == HNDL)
+  {
+    return execute_hndl(cmd_buf, res_buf, ctx);
+  }
 
-  /* Special case ADDS command - no PCI transactions need */
-  if(PURE_CMD(cmd) == ADDS)
+  /* Snapshots are read-only */
+  err = snap_check(cmd_buf);
+  if(err)
   {
-    adds(*res_buf);
-    return rslt_size;
+    return err;
   }
 
-  /* Init to-write burst structure */
-  if(init_burst_w(&pci_burst_w, cmd, cmd_buf) != 0)
+  /* Structures with values kept by driver are changed only by VALS */
+  err = vals_check(cmd_buf, ctx);
+  if(err)
   {
-    LOG_ERROR("Could not initialize to-write burst structure");
-    return -ENOMEM;
-  }  
+    return err;
+  }
 
-  /* Init burst to-read structure */
-  if(init_burst_r(&pci_burst_r, cmd) != 0)
+  /* Logical structures are executed by their partitions */
+  rslt_size = route_part(cmd_buf, res_buf, ctx);
+  if(rslt_size)
   {
-    LOG_ERROR("Could not initialize burst to-read structure");
-    return -ENOMEM;
+    return rslt_size;
   }
-  LOG_DEBUG("PCI burst structures initialized");
 
-  /* Poll SPU queue ready flag if queuing and no queue reset */
-  if((GET_Q_FLAG(cmd) == 1) && (GET_R_FLAG(cmd) == 0))
+  /* Reads of replicated structures are balanced across copies, writes go to every copy */
+  rslt_size = route_repl(cmd_buf, res_buf, ctx);
+  if(rslt_size)
   {
-    LOG_DEBUG("Polling SPU queue ready state");
-    if(poll_spu(STATE_REG_1, SYS2SPU_Q_EMP_FLAG, &spu_state) != 0)
-    {
-      LOG_ERROR("SPU queue is not ready for operation");
-      return -ENOEXEC;
-    }
-    LOG_DEBUG("SPU queue is ready for operation");
+    return rslt_size;
   }
 
-  /* Poll SPU ready for next operation */
-  if(poll_spu(STATE_REG_0, SPU_READY_FLAG, &spu_state) != 0)
+  /* Write-behind buffer keeps mutations and answers reads of buffered structures */
+  rslt_size = execute_wbuf(cmd_buf, res_buf, ctx);
+  if(rslt_size)
   {
-    LOG_ERROR("SPU is not ready for operation");
-    return -ENOEXEC;
+    return rslt_size;
   }
-  LOG_DEBUG("SPU is ready for operation");
 
-  /* Execute command */
-  LOG_DEBUG("Starting operation execution");
-  pci_burst_write(&pci_burst_w);
+  /* Special case driver composite commands - driver executes several SPU commands */
+  switch(PURE_CMD(cmd))
+  {
+    case EXPR:
+      return execute_expr(cmd_buf, res_buf, ctx);
 
-  /* Poll execution end */
-  if(GET_P_FLAG(cmd) == 1)
+    case MISD:
+      return execute_misd(cmd_buf, res_buf, ctx);
+
+    case BTCH:
+      return execute_batch(cmd_buf, res_buf, ctx);
+
+    case MGET:
+      return execute_mget(cmd_buf, res_buf, ctx);
+
+    case AGGR:
+      return execute_aggr(cmd_buf, res_buf, ctx);
+
+    case TOPK:
+      return execute_topk(cmd_buf, res_buf, ctx);
+
+    case SNAP:
+      return execute_snap(cmd_buf, res_buf, ctx);
+
+    case PART:
+      return execute_part(cmd_buf, res_buf, ctx);
+
+    case REPL:
+      return execute_repl(cmd_buf, res_buf, ctx);
+
+    case VALS:
+      return execute_vals(cmd_buf, res_buf, ctx);
+
+    default:
+      break;
+  }
+
+  /* Allocate result structure with pulling */
+  rslt_size = alloc_rslt(res_buf, cmd);
+  if((ssize_t)rslt_size < 0)
   {
-    LOG_DEBUG("Polling operation finish");
-    spu_status = 0;
-    if(poll_spu(STATE_REG_0, SPU_READY_FLAG, &spu_status) != 0)
-    {
-      LOG_ERROR("SPU can not finish operation");
-      return -ENOEXEC;
-    }
-    LOG_DEBUG("SPU finish operation");
+    *res_buf = NULL;
+    return rslt_size;
+  }
 
-    /* Read results */
-    pci_burst_read(&pci_burst_r);
-    set_rsltfrmt(&pci_burst_r, cmd, *res_buf, spu_status);
-    LOG_DEBUG("Got results of operation");
+  /* Special case ADDS command - no PCI transactions need */
+  if(PURE_CMD(cmd) == ADDS)
+  {
+    adds(*res_buf);
+    return rslt_size;
   }
-  else
+
+  /* Backpressure - command waits while SPU queue is full or overflowed */
+  err = wait_spu_free(ctx);
+  if(err)
   {
-    LOG_DEBUG("Would not poll operation end");
+    kfree(*res_buf);
+    *res_buf = NULL;
+    return err;
   }
 
-  /* Kill burst structures */
-  if(pci_burst_w.addr_shift)
+  /* Init to-write and to-read burst structures, partly allocated ones are freed too */
+  err = init_burst_w(&pci_burst_w, cmd, cmd_buf, &strs);
+  err = err ? err : init_burst_r(&pci_burst_r, cmd);
+  if(err)
   {
-    kfree(pci_burst_w.addr_shift);
+    LOG_ERROR("Could not initialize burst structures");
+    free_burst(&pci_burst_w);
+    free_burst(&pci_burst_r);
+    kfree(*res_buf);
+    *res_buf = NULL;
+    return err;
   }
-  if(pci_burst_w.data)
+  LOG_DEBUG("PCI burst structures initialized");
+
+  /* Queue error or lost SPU - reset queues and replay idempotent command */
+  for(replays = 0; ; replays++)
   {
-    kfree(pci_burst_w.data);
+    spu_status = 0;
+    err = send_cmd(&pci_burst_w, cmd, &spu_status, ctx);
+    if(!err && !SPU_FLAG(spu_status, SPU_ERROR_Q_FLAG))
+    {
+      break;
+    }
+
+    /* Slow SPU keeps its queue - non-P commands it has taken are not lost */
+    if(err)
+    {
+      if(!recover_poll(err))
+      {
+        break;
+      }
+    }
+    else
+    {
+      recover_spu();
+    }
+
+    if(replays == REPLAY_MAX || !cmd_replayable(cmd))
+    {
+      break;
+    }
+    atomic64_inc(&stats_replayed);
+    LOG_WARNING("Replaying command 0x%02x after SPU queues reset", PURE_CMD(cmd));
   }
-  if(pci_burst_r.addr_shift)
+
+  if(err)
   {
-    kfree(pci_burst_r.addr_shift);
+    LOG_ERROR("SPU could not execute operation");
+    kfree(*res_buf);
+    *res_buf = NULL;
+    rslt_size = err;
   }
-  if(pci_burst_r.data)
+  else
   {
-    kfree(pci_burst_r.data);
+    if(GET_P_FLAG(cmd) == 1)
+    {
+      /* Read results */
+      pci_burst_read(&pci_burst_r);
+      set_rsltfrmt(&pci_burst_r, cmd, *res_buf, spu_status);
+      LOG_DEBUG("Got results of operation");
+    }
+    else
+    {
+      LOG_DEBUG("Would not poll operation end");
+    }
+
+    /* Remember structures power for planning */
+    update_power(cmd, &strs, *res_buf);
   }
+
+  /* Kill burst structures */
+  free_burst(&pci_burst_w);
+  free_burst(&pci_burst_r);
   LOG_DEBUG("PCI burst structures deleted");
 
   /* Return */
   return rslt_size;
 }
 
-/* Allocate result structure */
-static size_t alloc_rslt(const void **res_buf, u8 cmd)
+/* Update statistics with executed command */
+static void account_cmd(u8 cmd, size_t rslt_size, const void *res_buf, const struct exec_ctx *ctx, u64 host_ns)
 {
-  size_t rslt_size = 0;
+  atomic64_inc(&stats_cmds);
 
-  if(GET_P_FLAG(cmd) == 0)
+  /* Driver error or SPU error status */
+  if((ssize_t)rslt_size <= 0 || ERRORS(RSLTFRMT_0(res_buf)->rslt))
   {
-    LOG_DEBUG("Allocate result format 0 structure because no polling need");
-    rslt_size = sizeof(struct rsltfrmt_0);
+    atomic64_inc(&stats_errors);
   }
-  else
+
+  /* Timings are meaningful only for polled SPU commands */
+  switch(PURE_CMD(cmd))
   {
-    /* Set result size for format */
-    switch(PURE_CMD(cmd))
-    {
-      CASE_RSLTFRMT_0:
-        LOG_DEBUG("Allocate result format 0 structure");
-        rslt_size = sizeof(struct rsltfrmt_0);
-        break;
+    CASE_RSLTFRMT_0:
+    CASE_DRVCMD:
+      return;
 
-      CASE_RSLTFRMT_1:
-        LOG_DEBUG("Allocate result format 1 structure");
-        rslt_size = sizeof(struct rsltfrmt_1);
-        break;
+    default:
+      break;
+  }
 
-      CASE_RSLTFRMT_2:
-        LOG_DEBUG("Allocate result format 2 structure");
-        rslt_size = sizeof(struct rsltfrmt_2);
-        break;
+  if(GET_P_FLAG(cmd) == 1)
+  {
+    atomic64_inc(&stats_polled);
+    atomic64_add(ctx->tsc, &stats_dev_cycles);
+    atomic64_add(host_ns, &stats_host_ns);
+  }
+}
 
-      default:
-        LOG_ERROR("Command was not found to allocate result");
-        return -ENOEXEC;
-    }
+/* Allocate result structure */
+static size_t alloc_rslt(const void **res_buf, u8 cmd)
+{
+  size_t rslt_size = cmd_rslt_size(cmd);
+
+  if(!rslt_size)
+  {
+    LOG_ERROR("Command was not found to allocate result");
+    return -ENOEXEC;
   }
 
   /* Allocate */
@@ -225,7 +565,7 @@ static void adds(const void *res_buf)
 }
 
 /* Initialize burst to-write structure */
-static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf)
+static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf, struct burst_strs *strs)
 {
   u8 count = 0;
   int str, str_a, str_b, str_r;
@@ -245,6 +585,8 @@ static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf
         return -ENOKEY;
       }
 
+      *strs = (struct burst_strs) { .a = str, .b = 0, .r = str };
+
       /* Burst count formula: key + val + cmd/str */
       count = SPU_WEIGHT*2 + 1;
       break;
@@ -260,6 +602,8 @@ static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf
         return -ENOKEY;
       }
 
+      *strs = (struct burst_strs) { .a = str, .b = 0, .r = str };
+
       /* Burst count formula: key + cmd/str */
       count = SPU_WEIGHT + 1;
       break;
@@ -275,6 +619,8 @@ static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf
         return -ENOKEY;
       }
 
+      *strs = (struct burst_strs) { .a = str, .b = 0, .r = str };
+
       /* Burst count formula: cmd/str */
       count = 1;
       break;
@@ -302,6 +648,8 @@ static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf
         return -ENOKEY;
       }
 
+      *strs = (struct burst_strs) { .a = str_a, .b = str_b, .r = str_r };
+
       /* Burst count formula: cmd/str */
       count = 1;
       break;
@@ -323,6 +671,8 @@ static int init_burst_w(struct pci_burst *pci_burst, u8 cmd, const void *cmd_buf
         return -ENOKEY;
       }
 
+      *strs = (struct burst_strs) { .a = str_a, .b = 0, .r = str_r };
+
       /* Burst count formula: cmd/str */
       count = 1;
       break;
@@ -504,28 +854,328 @@ static int init_burst_r(struct pci_burst *pci_burst, u8 cmd)
   return 0;
 }
 
-/* Poll untill SPU is ready or there is no more attempts */
-static inline int poll_spu(u8 reg, u8 shift, u8 *state)
+/* Free burst structure, partly allocated one too */
+static void free_burst(struct pci_burst *pci_burst)
+{
+  kfree(pci_burst->addr_shift);
+  kfree(pci_burst->data);
+  pci_burst->addr_shift = NULL;
+  pci_burst->data       = NULL;
+}
+
+/* Send command to SPU and poll its finish if needed */
+static int send_cmd(const struct pci_burst *pci_burst_w, u8 cmd, u8 *spu_status, struct exec_ctx *ctx)
 {
-  u8 poll_attempts = 255;
-  do
+  u8 spu_state = 0;
+  u32 tsc_start;
+  int err;
+
+  /* Poll SPU queue ready flag if queuing and no queue reset */
+  if((GET_Q_FLAG(cmd) == 1) && (GET_R_FLAG(cmd) == 0))
   {
-    msleep(1);
-    if(poll_attempts == 0)
+    LOG_DEBUG("Polling SPU queue ready state");
+    err = poll_spu(STATE_REG_1, SYS2SPU_Q_EMP_FLAG, &spu_state, ctx);
+    if(err)
     {
-      // Error return
-      return -ENOEXEC;
+      LOG_ERROR("SPU queue is not ready for operation");
+      return err;
     }
-    poll_attempts--;
+    LOG_DEBUG("SPU queue is ready for operation");
+  }
 
-    *state = pci_status_read(reg); // Get current state for result
+  /* Poll SPU ready for next operation */
+  err = poll_spu(STATE_REG_0, SPU_READY_FLAG, &spu_state, ctx);
+  if(err)
+  {
+    LOG_ERROR("SPU is not ready for operation");
+    return err;
+  }
+  LOG_DEBUG("SPU is ready for operation");
+
+  /* Execute command */
+  LOG_DEBUG("Starting operation execution");
+  pci_burst_write(pci_burst_w);
+
+  /* Counted from command register write - TSC read also pushes posted writes to SPU */
+  tsc_start = pci_single_read(TSC_REG);
+
+  /* Format 2 results are placed by SPU into key and value registers */
+  switch(PURE_CMD(cmd))
+  {
+    CASE_RSLTFRMT_2:
+      pci_shadow_invalidate();
+      break;
+
+    default:
+      break;
+  }
+
+  /* Poll execution end */
+  if(GET_P_FLAG(cmd) == 1)
+  {
+    LOG_DEBUG("Polling operation finish");
+    err = poll_spu_finish(STATE_REG_0, SPU_READY_FLAG, 1, spu_status, ctx);
+    if(err)
+    {
+      LOG_ERROR("SPU can not finish operation");
+      return err;
+    }
+    ctx->tsc = pci_single_read(TSC_REG) - tsc_start;
+    LOG_DEBUG("SPU finish operation in %u cycles", ctx->tsc);
   }
-  while ( SPU_FLAG(*state, shift) == 0 );
 
-  // Success
   return 0;
 }
 
+/* Reset SPU queues after queue error or lost SPU - structures are kept */
+void recover_spu(void)
+{
+  atomic64_inc(&stats_recovered);
+  LOG_WARNING("Resetting SPU queues");
+  pci_reset_queues();
+}
+
+/* SPU poll failed - queues are reset only if SPU does not drain them in its own deadline */
+/* Returns nonzero if queues were reset */
+int recover_poll(int err)
+{
+  const struct exec_ctx drain_ctx = { .deadline_ns = 0 }; // Command deadline is already expired
+  u8 spu_state;
+
+  /* Busy SPU is not waited for without blocking */
+  if(err == -EAGAIN)
+  {
+    return 0;
+  }
+
+  if(poll_spu_finish(STATE_REG_1, SYS2SPU_Q_EMP_FLAG, 1, &spu_state, &drain_ctx) == 0 &&
+     poll_spu_finish(STATE_REG_0, SPU_READY_FLAG, 1, &spu_state, &drain_ctx) == 0)
+  {
+    LOG_DEBUG("SPU drained its queue after deadline");
+    return 0;
+  }
+
+  LOG_ERROR("SPU did not drain its queue");
+  recover_spu();
+  return 1;
+}
+
+/* Status of result taken from SPU to CPU queue - SPU state flags belong to the last executed command */
+/* Result is an error if structure is empty or found key does not match command */
+rslt_t queued_status(u8 op, const spu_key_t *key, const struct rsltfrmt_2 *rslt)
+{
+  if(!rslt->power)
+  {
+    return ERR;
+  }
+
+  switch(PURE_CMD(op))
+  {
+    case SRCH:
+      return key_cmp(&rslt->key, key) == 0 ? OK : ERR;
+
+    case NEXT:
+    case NGR:
+      return key_cmp(&rslt->key, key) > 0 ? OK : ERR;
+
+    case PREV:
+    case NSM:
+      return key_cmp(&rslt->key, key) < 0 ? OK : ERR;
+
+    /* Deleted pair is returned */
+    case DEL:
+      return key_cmp(&rslt->key, key) == 0 ? OK : ERR;
+
+    default:
+      return OK;
+  }
+}
+
+/* Read pair and power of first result in SPU to CPU queue and remove it from queue */
+void take_result(struct rsltfrmt_2 *rslt)
+{
+  u32 addr_shift[SPU_WEIGHT*2 + 1], data[SPU_WEIGHT*2 + 1];
+  struct pci_burst pci_burst =
+  {
+    .count      = SPU_WEIGHT*2 + 1,
+    .addr_shift = addr_shift,
+    .data       = data
+  };
+  u8 j;
+
+  for(j=0; j<SPU_WEIGHT; j++)
+  {
+    addr_shift[j]            = KEY_REG + j;
+    addr_shift[j+SPU_WEIGHT] = VAL_REG + j;
+  }
+  addr_shift[SPU_WEIGHT*2] = POWER_REG;
+
+  pci_burst_read(&pci_burst);
+  for(j=0; j<SPU_WEIGHT; j++)
+  {
+    rslt->key.cont[j] = data[j];
+    rslt->val.cont[j] = data[j+SPU_WEIGHT];
+  }
+  rslt->power = data[SPU_WEIGHT*2];
+
+  pci_single_write(1<<SHIFT_SPU2CPU_Q_FLAG, CNTL_REG_1);
+  pci_shadow_invalidate();
+}
+
+/* Check SPU queue is full after command write - flag is read after SPU had time to update it */
+u8 spu_queue_full(void)
+{
+  ndelay(Q_SETTLE_NS);
+  return SPU_FLAG(pci_status_read(STATE_REG_0), SYS2SPU_Q_FULL_FLAG);
+}
+
+/* Take results left in SPU to CPU queue after failed collection */
+/* Queues are reset if results do not come */
+void drain_results(u32 count)
+{
+  const struct exec_ctx drain_ctx = { .deadline_ns = 0 }; // Own deadline - command one may be already expired
+  u8 spu_state;
+
+  for(; count > 0; count--)
+  {
+    if(poll_spu_finish(STATE_REG_1, SPU2CPU_Q_EMP_FLAG, 0, &spu_state, &drain_ctx) != 0)
+    {
+      LOG_ERROR("%u results were not taken from SPU", count);
+      recover_spu();
+      return;
+    }
+    pci_single_write(1<<SHIFT_SPU2CPU_Q_FLAG, CNTL_REG_1);
+    pci_shadow_invalidate();
+  }
+}
+
+/* Check if command gives the same result being executed twice */
+/* DEL is not - repeated one reports missing key */
+static int cmd_replayable(u8 cmd)
+{
+  switch(PURE_CMD(cmd))
+  {
+    CASE_CMDFRMT_1:
+    CASE_CMDFRMT_3:
+    CASE_CMDFRMT_4:
+    CASE_CMDFRMT_5:
+    case SRCH:
+    case NEXT:
+    case PREV:
+    case NSM:
+    case NGR:
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+/* Poll untill SPU is ready for command - until command deadline, O_NONBLOCK file does not wait */
+int poll_spu(u8 reg, u8 shift, u8 *state, const struct exec_ctx *ctx)
+{
+  return poll_spu_flag(reg, shift, 1, state, ctx->deadline_ns, ctx->nonblock);
+}
+
+/* Poll untill sent commands are finished - until command deadline even for O_NONBLOCK file */
+int poll_spu_finish(u8 reg, u8 shift, u8 value, u8 *state, const struct exec_ctx *ctx)
+{
+  return poll_spu_flag(reg, shift, value, state, ctx->deadline_ns, 0);
+}
+
+/* Poll untill SPU flag has value or deadline expires */
+static int poll_spu_flag(u8 reg, u8 shift, u8 value, u8 *state, u64 deadline_ns, u8 nonblock)
+{
+  u8 killable = deadline_ns == U64_MAX;
+
+  /* Driver own work has default deadline from the moment polling starts */
+  if(!deadline_ns)
+  {
+    deadline_ns = ktime_get_ns() + (u64)SPU_DEADLINE_MS*NSEC_PER_MSEC;
+  }
+
+  /* File without deadline still does not hold SPU forever */
+  if(killable)
+  {
+    deadline_ns = ktime_get_ns() + (u64)SPU_POLL_MAX_MS*NSEC_PER_MSEC;
+  }
+
+  while(1)
+  {
+    if(killable && fatal_signal_pending(current))
+    {
+      LOG_DEBUG("SPU polling was interrupted by fatal signal");
+      return -EINTR;
+    }
+
+    /* SPU flags are not changed right after command write */
+    usleep_range(BUSY_SLEEP_US, 2*BUSY_SLEEP_US);
+
+    *state = pci_status_read(reg); // Get current state for result
+    if((SPU_FLAG(*state, shift) ? 1 : 0) == value)
+    {
+      return 0;
+    }
+
+    if(nonblock || ktime_get_ns() >= deadline_ns)
+    {
+      LOG_DEBUG("SPU state 0x%02x was not changed before deadline", *state);
+      return nonblock ? -EAGAIN : -ETIMEDOUT;
+    }
+  }
+}
+
+/* Wait while SPU queue is full or overflowed - until command deadline */
+static int wait_spu_free(const struct exec_ctx *ctx)
+{
+  u64 deadline_ns = ctx->deadline_ns;
+  u8 killable = deadline_ns == U64_MAX;
+  u8 state, waited = 0;
+
+  while(1)
+  {
+    state = pci_status_read(STATE_REG_0);
+    if(!SPU_FLAG(state, SYS2SPU_Q_FULL_FLAG) && !SPU_FLAG(state, DDR_Q_OVF_FLAG))
+    {
+      return 0;
+    }
+
+    if(!waited)
+    {
+      atomic64_inc(&stats_busy);
+      waited = 1;
+    }
+
+    /* Driver own work has default deadline from the moment SPU was found busy */
+    if(!deadline_ns)
+    {
+      deadline_ns = ktime_get_ns() + (u64)SPU_DEADLINE_MS*NSEC_PER_MSEC;
+    }
+
+    /* File without deadline still does not hold SPU forever */
+    if(deadline_ns == U64_MAX)
+    {
+      deadline_ns = ktime_get_ns() + (u64)SPU_POLL_MAX_MS*NSEC_PER_MSEC;
+    }
+
+    if(killable && fatal_signal_pending(current))
+    {
+      atomic64_inc(&stats_rejected);
+      LOG_DEBUG("Waiting busy SPU was interrupted by fatal signal");
+      return -EINTR;
+    }
+
+    if(ctx->nonblock || ktime_get_ns() >= deadline_ns)
+    {
+      atomic64_inc(&stats_rejected);
+      LOG_DEBUG("SPU is busy with state 0x%02x, command is rejected", state);
+      return ctx->nonblock ? -EAGAIN : -ETIMEDOUT;
+    }
+
+    usleep_range(BUSY_SLEEP_US, 2*BUSY_SLEEP_US);
+  }
+}
+
 /* Set result output format */
 static void set_rsltfrmt(struct pci_burst *pci_burst, u8 cmd, const void *res_buf, u8 spu_status)
 {
@@ -568,4 +1218,42 @@ static void set_rsltfrmt(struct pci_burst *pci_burst, u8 cmd, const void *res_bu
       LOG_ERROR("Could not set result");
       return;
   }
+}
+
+/* Update structures power cache with result or estimation */
+static void update_power(u8 cmd, const struct burst_strs *strs, const void *res_buf)
+{
+  /* Polled result has exact power */
+  if(GET_P_FLAG(cmd) == 1)
+  {
+    switch(PURE_CMD(cmd))
+    {
+      CASE_RSLTFRMT_1:
+        set_str_power(strs->r, RSLTFRMT_1(res_buf)->power);
+        return;
+
+      CASE_RSLTFRMT_2:
+        set_str_power(strs->r, RSLTFRMT_2(res_buf)->power);
+        return;
+
+      default:
+        return;
+    }
+  }
+
+  /* No result - estimate power */
+  switch(PURE_CMD(cmd))
+  {
+    CASE_CMDFRMT_1:
+      set_str_power(strs->r, get_str_power(strs->r) + 1);
+      return;
+
+    CASE_CMDFRMT_4:
+    CASE_CMDFRMT_5:
+      set_str_power(strs->r, estimate_power(PURE_CMD(cmd), get_str_power(strs->a), get_str_power(strs->b)));
+      return;
+
+    default:
+      return;
+  }
 }
\ No newline at end of file
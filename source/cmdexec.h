@@ -40,6 +40,19 @@
                        case GR:\
                        case GREQ
 
+/* Macros to switch across driver composite commands */
+#define CASE_DRVCMD case EXPR:\
+                    case MISD:\
+                    case BTCH:\
+                    case MGET:\
+                    case AGGR:\
+                    case TOPK:\
+                    case SNAP:\
+                    case HNDL:\
+                    case PART:\
+                    case REPL:\
+                    case VALS
+
 /* Macros to switch across result formats */
 #define CASE_RSLTFRMT_0 case ADDS
 #define CASE_RSLTFRMT_1 case DELS:\
@@ -67,9 +80,29 @@
 #define CMDFRMT_3(ptr)  ( (struct cmdfrmt_3 *) ptr )
 #define CMDFRMT_4(ptr)  ( (struct cmdfrmt_4 *) ptr )
 #define CMDFRMT_5(ptr)  ( (struct cmdfrmt_5 *) ptr )
+#define CMDFRMT_6(ptr)  ( (struct cmdfrmt_6 *) ptr )
+#define CMDFRMT_7(ptr)  ( (struct cmdfrmt_7 *) ptr )
+#define CMDFRMT_8(ptr)  ( (struct cmdfrmt_8 *) ptr )
+#define CMDFRMT_9(ptr)  ( (struct cmdfrmt_9 *) ptr )
+#define CMDFRMT_10(ptr) ( (struct cmdfrmt_10 *) ptr )
+#define CMDFRMT_11(ptr) ( (struct cmdfrmt_11 *) ptr )
+#define CMDFRMT_12(ptr) ( (struct cmdfrmt_12 *) ptr )
+#define CMDFRMT_13(ptr) ( (struct cmdfrmt_13 *) ptr )
+#define CMDFRMT_14(ptr) ( (struct cmdfrmt_14 *) ptr )
+#define CMDFRMT_15(ptr) ( (struct cmdfrmt_15 *) ptr )
 #define RSLTFRMT_0(ptr) ( (struct rsltfrmt_0 *) ptr )
 #define RSLTFRMT_1(ptr) ( (struct rsltfrmt_1 *) ptr )
 #define RSLTFRMT_2(ptr) ( (struct rsltfrmt_2 *) ptr )
+#define RSLTFRMT_3(ptr) ( (struct rsltfrmt_3 *) ptr )
+#define RSLTFRMT_4(ptr) ( (struct rsltfrmt_4 *) ptr )
+#define RSLTFRMT_5(ptr) ( (struct rsltfrmt_5 *) ptr )
+#define RSLTFRMT_6(ptr) ( (struct rsltfrmt_6 *) ptr )
+#define RSLTFRMT_7(ptr) ( (struct rsltfrmt_7 *) ptr )
+#define RSLTFRMT_8(ptr) ( (struct rsltfrmt_8 *) ptr )
+#define RSLTFRMT_9(ptr) ( (struct rsltfrmt_9 *) ptr )
+#define RSLTFRMT_10(ptr) ( (struct rsltfrmt_10 *) ptr )
+#define RSLTFRMT_11(ptr) ( (struct rsltfrmt_11 *) ptr )
+#define RSLTFRMT_12(ptr) ( (struct rsltfrmt_12 *) ptr )
 
 /* Flag helpers */
 #define PURE_CMD(cmd)   ( cmd&CMD_MASK )
@@ -81,6 +114,33 @@
 /* SPU state flags helpers */
 #define SPU_FLAG(state, shift) ( state & (1<<shift) )
 
-size_t execute_cmd(const void *cmd_buf, const void **res_buf);
+/* Structure handles of opened file */
+struct hndl_table;
+
+/* Command execution context */
+struct exec_ctx
+{
+  size_t size;              // Command buffer size (input)
+  u32 tsc;                  // SPU TSC cycles spent by command (output, 0 if was not polled)
+  const void *owner;        // Opened file which sent command, holds created snapshots (input, may be NULL)
+  struct hndl_table *hndls; // Structure handles of file which sent command (input, may be NULL)
+  u64 deadline_ns;          // Host time to wait busy SPU until (input, U64_MAX for SPU_POLL_MAX_MS, 0 for SPU_DEADLINE_MS)
+  u8 nonblock;              // Fail with -EAGAIN instead of waiting busy SPU (input)
+};
+
+size_t execute_cmd(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+int execute_int_cmd(const void *cmd_buf, size_t cmd_size, void *rslt, size_t rslt_size, struct exec_ctx *ctx);
+size_t cmd_size(u8 cmd);
+size_t cmd_rslt_size(u8 cmd);
+int key_cmp(const spu_key_t *a, const spu_key_t *b);
+void get_stats(struct spu_stats *stats);
+void recover_spu(void);
+int recover_poll(int err);
+rslt_t queued_status(u8 op, const spu_key_t *key, const struct rsltfrmt_2 *rslt);
+void drain_results(u32 count);
+void take_result(struct rsltfrmt_2 *rslt);
+u8 spu_queue_full(void);
+int poll_spu(u8 reg, u8 shift, u8 *state, const struct exec_ctx *ctx);
+int poll_spu_finish(u8 reg, u8 shift, u8 value, u8 *state, const struct exec_ctx *ctx);
 
 #endif /* CMDEXEC_H */
\ No newline at end of file
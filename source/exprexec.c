@@ -0,0 +1,224 @@
+/*
+  exprexec.c
+        - expression tree executor
+        - chains AND, OR, NOT, LS, LSEQ, GR, GREQ over temporary structures
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "expression execution"
+
+#include <linux/slab.h>
+#include <linux/stddef.h>
+
+#include "spu.h"
+#include "log.h"
+#include "cmdexec.h"
+#include "exprexec.h"
+#include "planner.h"
+#include "gsidresolver.h"
+
+/* Expression evaluation stack entry */
+struct expr_operand
+{
+  gsid_t gsid; // Operand structure
+  u8 tmp;      // Structure is temporary and owned by executor
+};
+
+/* Internal functions */
+static int exec_node(const struct expr_node *node, struct expr_operand *stack, u8 *depth, u8 last, u32 *power, struct exec_ctx *ctx);
+static void free_operand(const struct expr_operand *operand, struct exec_ctx *ctx);
+
+/* EXPR command executor */
+size_t execute_expr(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct expr_operand stack[SPU_EXPR_MAX_NODES];
+  struct expr_plan plan;
+  u8 count = CMDFRMT_6(cmd_buf)->count;
+  u8 depth = 0;
+  u32 power = 0;
+  u8 i;
+  int err = 0;
+
+  LOG_DEBUG("EXPR command execution with %d nodes", count);
+
+  /* Check expression size */
+  if(count == 0 || count > SPU_EXPR_MAX_NODES ||
+     ctx->size < offsetof(struct cmdfrmt_6, nodes) + count*sizeof(struct expr_node))
+  {
+    LOG_ERROR("Wrong EXPR command size");
+    return -EINVAL;
+  }
+
+  /* Choose nodes execution order */
+  err = plan_expr(CMDFRMT_6(cmd_buf)->nodes, count, CMDFRMT_6(cmd_buf)->opts, &plan);
+  if(err)
+  {
+    LOG_ERROR("Could not plan expression");
+    return err;
+  }
+
+  /* Allocate result */
+  *res_buf = kzalloc(sizeof(struct rsltfrmt_3), GFP_KERNEL);
+  if(!(*res_buf))
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+  RSLTFRMT_3(*res_buf)->rslt       = ERR;
+  RSLTFRMT_3(*res_buf)->est_power  = plan.est_power;
+  RSLTFRMT_3(*res_buf)->est_cost   = plan.est_cost;
+  RSLTFRMT_3(*res_buf)->naive_cost = plan.naive_cost;
+  for(i=0; i<count; i++)
+  {
+    RSLTFRMT_3(*res_buf)->plan[i] = plan.order[i];
+  }
+
+  /* Evaluate nodes in planned postfix order */
+  for(i=0; i<count && !err; i++)
+  {
+    err = exec_node(&CMDFRMT_6(cmd_buf)->nodes[plan.order[i]], stack, &depth, i == count-1, &power, ctx);
+  }
+
+  /* Only one computed structure should left */
+  if(!err && (depth != 1 || !stack[0].tmp))
+  {
+    LOG_ERROR("Expression is not complete");
+    err = -EINVAL;
+  }
+
+  if(err)
+  {
+    /* Release all temporary structures */
+    while(depth > 0)
+    {
+      free_operand(&stack[--depth], ctx);
+    }
+    LOG_ERROR("EXPR command execution error");
+    return sizeof(struct rsltfrmt_3); // ERR result code already in result structure
+  }
+
+  /* Result generation */
+  RSLTFRMT_3(*res_buf)->rslt  = OK;
+  RSLTFRMT_3(*res_buf)->gsid  = stack[0].gsid;
+  RSLTFRMT_3(*res_buf)->power = power;
+
+  LOG_DEBUG("EXPR return result GSID" GSID_FORMAT "with power %u (estimated %u)", GSID_VAR(stack[0].gsid), power, plan.est_power);
+  return sizeof(struct rsltfrmt_3);
+}
+
+/* Execute one expression node over evaluation stack */
+static int exec_node(const struct expr_node *node, struct expr_operand *stack, u8 *depth, u8 last, u32 *power, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_4 cmd_4;
+  struct cmdfrmt_5 cmd_5;
+  struct rsltfrmt_1 rslt;
+  struct expr_operand a, b, r;
+  int err;
+
+  switch(node->op)
+  {
+    case EXPR_LEAF:
+      if(*depth == SPU_EXPR_MAX_NODES)
+      {
+        return -EINVAL;
+      }
+      stack[(*depth)++] = (struct expr_operand) { .gsid = node->gsid, .tmp = 0 };
+      return 0;
+
+    CASE_EXPR_BINARY:
+      if(*depth < 2)
+      {
+        LOG_ERROR("Not enough operands for operation 0x%02x", node->op);
+        return -EINVAL;
+      }
+      b = stack[--(*depth)];
+      a = stack[--(*depth)];
+
+      /* Temporary result structure */
+      r.tmp = 1;
+      if(create_gsid(&r.gsid) != 0)
+      {
+        stack[(*depth)++] = a;
+        stack[(*depth)++] = b;
+        return -ENOKEY;
+      }
+
+      cmd_4 = (struct cmdfrmt_4) { .cmd = node->op | P_FLAG, .gsid_a = a.gsid, .gsid_b = b.gsid, .gsid_r = r.gsid };
+      err = execute_int_cmd(&cmd_4, sizeof(cmd_4), &rslt, sizeof(rslt), ctx);
+      free_operand(&b, ctx);
+      break;
+
+    CASE_EXPR_SLICE:
+      if(*depth < 1)
+      {
+        LOG_ERROR("Not enough operands for operation 0x%02x", node->op);
+        return -EINVAL;
+      }
+      a = stack[--(*depth)];
+
+      /* Temporary result structure */
+      r.tmp = 1;
+      if(create_gsid(&r.gsid) != 0)
+      {
+        stack[(*depth)++] = a;
+        return -ENOKEY;
+      }
+
+      cmd_5 = (struct cmdfrmt_5) { .cmd = node->op | P_FLAG, .gsid_a = a.gsid, .gsid_r = r.gsid, .key = node->key };
+      err = execute_int_cmd(&cmd_5, sizeof(cmd_5), &rslt, sizeof(rslt), ctx);
+      break;
+
+    default:
+      LOG_ERROR("Unknown expression operation 0x%02x", node->op);
+      return -EINVAL;
+  }
+
+  /* Operands are consumed, result is the next operand - every node is polled, error status stops expression */
+  free_operand(&a, ctx);
+  stack[(*depth)++] = r;
+
+  if(err)
+  {
+    return err;
+  }
+
+  if(last)
+  {
+    *power = rslt.power;
+  }
+  LOG_DEBUG("Expression operation 0x%02x done into GSID" GSID_FORMAT, node->op, GSID_VAR(r.gsid));
+
+  return 0;
+}
+
+/* Delete temporary operand structure */
+static void free_operand(const struct expr_operand *operand, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_3 dels;
+  struct rsltfrmt_0 rslt;
+
+  if(!operand->tmp)
+  {
+    return;
+  }
+
+  dels = (struct cmdfrmt_3) { .cmd = DELS, .gsid = operand->gsid };
+  execute_int_cmd(&dels, sizeof(dels), &rslt, sizeof(rslt), ctx);
+  LOG_DEBUG("Temporary GSID" GSID_FORMAT "deleted", GSID_VAR(operand->gsid));
+}
@@ -0,0 +1,36 @@
+/*
+  exprexec.h
+        - expression tree executor definitions
+        - chains AND, OR, NOT, LS, LSEQ, GR, GREQ over temporary structures
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EXPREXEC_H
+#define EXPREXEC_H
+
+/* Macros to switch across expression operations */
+#define CASE_EXPR_BINARY case AND:\
+                         case OR:\
+                         case NOT
+#define CASE_EXPR_SLICE  case LS:\
+                         case LSEQ:\
+                         case GR:\
+                         case GREQ
+
+size_t execute_expr(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+
+#endif /* EXPREXEC_H */
@@ -36,15 +36,12 @@
 // Structures GSID's currently in SPU memory - init with 0 GSID's
 static gsid_t gsids_in_spu[SPU_STR_NUM] = { { .cont = {0} } };
 
-/* Create new GSID -> generate it and add into memory */
-int create_gsid(gsid_t *gsid)
-{
-  u8 i;
-  gsid_t zero_gsid =
-  {
-    .cont = {0}
-  };
+// Structures power currently in SPU memory - new structures are empty
+static u32 powers_in_spu[SPU_STR_NUM] = {0};
 
+/* Generate new GSID without adding it into memory */
+void generate_gsid(gsid_t *gsid)
+{
   /* Only GSID_WEIGHT = 4 supports - in other cases result is 0 */
 #if GSID_WEIGHT == 4
 
@@ -69,6 +66,18 @@ int create_gsid(gsid_t *gsid)
   *gsid = gen_gsid;
 
   LOG_DEBUG("Generated GSID" GSID_FORMAT, GSID_VAR(*gsid));
+}
+
+/* Create new GSID -> generate it and add into memory */
+int create_gsid(gsid_t *gsid)
+{
+  u8 i;
+  gsid_t zero_gsid =
+  {
+    .cont = {0}
+  };
+
+  generate_gsid(gsid);
 
   /* Add GSID into GSID container */
 
@@ -77,7 +86,8 @@ int create_gsid(gsid_t *gsid)
   {
     if(GSID_EQUAL(gsids_in_spu[i], zero_gsid)) // Check if GSID is zero
     {
-      gsids_in_spu[i] = *gsid;
+      gsids_in_spu[i]  = *gsid;
+      powers_in_spu[i] = 0;
       LOG_DEBUG("Add GSID:" GSID_FORMAT "to SPU memory position %d", GSID_VAR(gsids_in_spu[i]), SPU_STR(i));
       return 0;
     }
@@ -123,4 +133,56 @@ int resolve_gsid(gsid_t gsid, u8 cmd)
   }
 
   return SPU_STR(i);
+}
+
+/* Get cached structure power by GSID */
+u32 get_gsid_power(gsid_t gsid)
+{
+  u8 i;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    if(GSID_EQUAL(gsid, gsids_in_spu[i]))
+    {
+      return powers_in_spu[i];
+    }
+  }
+
+  return 0;
+}
+
+/* Get GSID by SPU structure number, zero for free structure */
+gsid_t get_str_gsid(int str)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+
+  if(str <= 0 || str > SPU_STR_NUM)
+  {
+    return zero_gsid;
+  }
+
+  return gsids_in_spu[STR_IDX(str)];
+}
+
+/* Get cached structure power by SPU structure number */
+u32 get_str_power(int str)
+{
+  if(str <= 0 || str > SPU_STR_NUM)
+  {
+    return 0;
+  }
+
+  return powers_in_spu[STR_IDX(str)];
+}
+
+/* Update cached structure power by SPU structure number */
+void set_str_power(int str, u32 power)
+{
+  if(str <= 0 || str > SPU_STR_NUM)
+  {
+    return;
+  }
+
+  powers_in_spu[STR_IDX(str)] = power;
+  LOG_DEBUG("Structure %d power is %u", str, power);
 }
\ No newline at end of file
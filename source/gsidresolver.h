@@ -22,8 +22,15 @@
 #ifndef GSIDRESOLVER_H
 #define GSIDRESOLVER_H
 
+void generate_gsid(gsid_t *gsid);
 int create_gsid(gsid_t *gsid);
 int resolve_gsid(gsid_t gsid, u8 cmd);
+gsid_t get_str_gsid(int str);
+
+/* Structures power cache - last known or estimated power */
+u32 get_gsid_power(gsid_t gsid);
+u32 get_str_power(int str);
+void set_str_power(int str, u32 power);
 
 /* Macro of two GSID's equality */
 /* Only GSID_WEIGHT = 4 supports */
@@ -34,6 +41,7 @@ int resolve_gsid(gsid_t gsid, u8 cmd);
 
 /* Acting SPU structure number macro */
 #define SPU_STR(i) (i+1)
+#define STR_IDX(str) (str-1)
 
 
 #endif /* GSIDRESOLVER_H */
\ No newline at end of file
@@ -0,0 +1,231 @@
+/*
+  handle.c
+        - structure handles
+        - per-file table of GSIDs given by small integers
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "structure handles"
+
+#include <linux/slab.h>
+
+#include "spu.h"
+#include "log.h"
+#include "cmdexec.h"
+#include "pcidrv.h"
+#include "gsidresolver.h"
+#include "snapshot.h"
+#include "handle.h"
+#include "partition.h"
+
+/* Commands accepted by HNDL */
+union hndl_cmd
+{
+  struct cmdfrmt_1 frmt_1;
+  struct cmdfrmt_2 frmt_2;
+  struct cmdfrmt_3 frmt_3;
+  struct cmdfrmt_4 frmt_4;
+  struct cmdfrmt_5 frmt_5;
+};
+
+/* Internal functions */
+static int get_gsid(const struct hndl_table *table, u8 hndl, gsid_t *gsid);
+static void delete_str(gsid_t gsid, struct exec_ctx *ctx);
+
+/* HNDL command executor - inner command with GSIDs of handles */
+size_t execute_hndl(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_12 *hndl_cmd = CMDFRMT_12(cmd_buf);
+  union hndl_cmd cmd;
+  struct exec_ctx int_ctx;
+  size_t rslt_size;
+  int err;
+
+  LOG_DEBUG("HNDL command execution of command 0x%02x", hndl_cmd->op);
+
+  if(ctx->size < sizeof(struct cmdfrmt_12))
+  {
+    LOG_ERROR("Wrong HNDL command size");
+    return -EINVAL;
+  }
+
+  if(!ctx->hndls)
+  {
+    LOG_ERROR("File has no structure handles");
+    return -EBADF;
+  }
+
+  /* Inner command in its own format */
+  memset(&cmd, 0, sizeof(cmd));
+  switch(PURE_CMD(hndl_cmd->op))
+  {
+    CASE_CMDFRMT_1:
+      cmd.frmt_1.key = hndl_cmd->key;
+      cmd.frmt_1.val = hndl_cmd->val;
+      err = get_gsid(ctx->hndls, hndl_cmd->hndl_a, &cmd.frmt_1.gsid);
+      break;
+
+    CASE_CMDFRMT_2:
+      cmd.frmt_2.key = hndl_cmd->key;
+      err = get_gsid(ctx->hndls, hndl_cmd->hndl_a, &cmd.frmt_2.gsid);
+      break;
+
+    CASE_CMDFRMT_3:
+    case SNAP:
+      err = get_gsid(ctx->hndls, hndl_cmd->hndl_a, &cmd.frmt_3.gsid);
+      break;
+
+    CASE_CMDFRMT_4:
+      err = get_gsid(ctx->hndls, hndl_cmd->hndl_a, &cmd.frmt_4.gsid_a);
+      err = err ? err : get_gsid(ctx->hndls, hndl_cmd->hndl_b, &cmd.frmt_4.gsid_b);
+      err = err ? err : get_gsid(ctx->hndls, hndl_cmd->hndl_r, &cmd.frmt_4.gsid_r);
+      break;
+
+    CASE_CMDFRMT_5:
+      cmd.frmt_5.key = hndl_cmd->key;
+      err = get_gsid(ctx->hndls, hndl_cmd->hndl_a, &cmd.frmt_5.gsid_a);
+      err = err ? err : get_gsid(ctx->hndls, hndl_cmd->hndl_r, &cmd.frmt_5.gsid_r);
+      break;
+
+    default:
+      LOG_ERROR("Command 0x%02x could not be sent by handles", hndl_cmd->op);
+      return -EINVAL;
+  }
+
+  if(err)
+  {
+    return err;
+  }
+  cmd.frmt_1.cmd = hndl_cmd->op;
+
+  /* Result of inner command is copied over HNDL command */
+  if(ctx->size < cmd_rslt_size(hndl_cmd->op))
+  {
+    LOG_ERROR("HNDL command size is less than result of command 0x%02x", hndl_cmd->op);
+    return -EINVAL;
+  }
+
+  /* Result of inner command is result of HNDL */
+  int_ctx = *ctx;
+  int_ctx.size = cmd_size(hndl_cmd->op);
+  rslt_size = execute_cmd(&cmd, res_buf, &int_ctx);
+  ctx->tsc = int_ctx.tsc;
+
+  /* Deleted structure handle is closed */
+  if(PURE_CMD(hndl_cmd->op) == DELS && (ssize_t)rslt_size > 0 && !ERRORS(RSLTFRMT_0(*res_buf)->rslt))
+  {
+    ctx->hndls->entries[hndl_cmd->hndl_a].used = 0;
+    LOG_DEBUG("Handle %u closed with deleted structure", hndl_cmd->hndl_a);
+  }
+
+  return rslt_size;
+}
+
+/* Open handle of existing structure, handle is returned */
+int hndl_open(struct hndl_table *table, gsid_t gsid, u32 flags)
+{
+  u32 i;
+
+  if(!part_is(gsid) && resolve_gsid(gsid, SRCH) <= 0)
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "was not found", GSID_VAR(gsid));
+    return -ENOKEY;
+  }
+
+  /* Snapshots are deleted by references only */
+  if((flags & HNDL_TEMP_FLAG) && snap_is(gsid))
+  {
+    LOG_ERROR("Snapshot GSID" GSID_FORMAT "could not be temporary", GSID_VAR(gsid));
+    return -EROFS;
+  }
+
+  for(i=0; i<SPU_HNDL_MAX; i++)
+  {
+    if(!table->entries[i].used)
+    {
+      table->entries[i].gsid = gsid;
+      table->entries[i].used = 1;
+      table->entries[i].temp = (flags & HNDL_TEMP_FLAG) != 0;
+      LOG_DEBUG("Handle %u opened for GSID" GSID_FORMAT, i, GSID_VAR(gsid));
+      return i;
+    }
+  }
+
+  LOG_ERROR("No free handles in file");
+  return -EMFILE;
+}
+
+/* Close handle, temporary structure is deleted */
+int hndl_close(struct hndl_table *table, u32 hndl, struct exec_ctx *ctx)
+{
+  if(hndl >= SPU_HNDL_MAX || !table->entries[hndl].used)
+  {
+    LOG_ERROR("Handle %u is not opened", hndl);
+    return -EBADF;
+  }
+
+  table->entries[hndl].used = 0;
+  if(table->entries[hndl].temp)
+  {
+    delete_str(table->entries[hndl].gsid, ctx);
+  }
+
+  LOG_DEBUG("Handle %u closed", hndl);
+  return 0;
+}
+
+/* Close every handle of closed file */
+void hndl_release(struct hndl_table *table, struct exec_ctx *ctx)
+{
+  u32 i;
+
+  for(i=0; i<SPU_HNDL_MAX; i++)
+  {
+    if(table->entries[i].used)
+    {
+      hndl_close(table, i, ctx);
+    }
+  }
+}
+
+/* Get GSID of opened handle */
+static int get_gsid(const struct hndl_table *table, u8 hndl, gsid_t *gsid)
+{
+  if(hndl >= SPU_HNDL_MAX || !table->entries[hndl].used)
+  {
+    LOG_ERROR("Handle %u is not opened", hndl);
+    return -EBADF;
+  }
+
+  *gsid = table->entries[hndl].gsid;
+  return 0;
+}
+
+/* Delete temporary structure of closed handle */
+static void delete_str(gsid_t gsid, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_3 dels;
+  struct rsltfrmt_0 rslt;
+
+  dels = (struct cmdfrmt_3) { .cmd = DELS, .gsid = gsid };
+  if(execute_int_cmd(&dels, sizeof(dels), &rslt, sizeof(rslt), ctx))
+  {
+    LOG_ERROR("Temporary GSID" GSID_FORMAT "could not be deleted", GSID_VAR(gsid));
+  }
+}
@@ -0,0 +1,44 @@
+/*
+  handle.h
+        - structure handles definitions
+        - per-file table of GSIDs given by small integers
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HANDLE_H
+#define HANDLE_H
+
+/* Handle of opened file */
+struct hndl_entry
+{
+  gsid_t gsid;
+  u8 used;
+  u8 temp; // Structure is deleted with handle
+};
+
+/* Structure handles of opened file - handle is index in table */
+struct hndl_table
+{
+  struct hndl_entry entries[SPU_HNDL_MAX];
+};
+
+size_t execute_hndl(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+int hndl_open(struct hndl_table *table, gsid_t gsid, u32 flags);
+int hndl_close(struct hndl_table *table, u32 hndl, struct exec_ctx *ctx);
+void hndl_release(struct hndl_table *table, struct exec_ctx *ctx);
+
+#endif /* HANDLE_H */
@@ -0,0 +1,261 @@
+/*
+  mgetexec.c
+        - multi-key command executor implementation
+        - one operation for many keys of one structure pipelined through SPU queue
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "MGET execution"
+
+#include <linux/slab.h>
+
+#include "spu.h"
+#include "log.h"
+#include "pcidrv.h"
+#include "cmdexec.h"
+#include "mgetexec.h"
+#include "gsidresolver.h"
+#include "partition.h"
+
+/* Internal functions */
+static int exec_pipelined(const struct cmdfrmt_9 *cmd, int str, struct rsltfrmt_6 *rslt, struct exec_ctx *ctx);
+static int exec_serial(const struct cmdfrmt_9 *cmd, struct rsltfrmt_6 *rslt, struct exec_ctx *ctx);
+static void load_key(u8 op, const spu_key_t *key, int str);
+
+/* MGET command executor */
+size_t execute_mget(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_9 *cmd = CMDFRMT_9(cmd_buf);
+  struct rsltfrmt_6 *rslt;
+  u32 i;
+  int str, err;
+
+  LOG_DEBUG("MGET command 0x%02x execution with %u keys", PURE_CMD(cmd->op), cmd->count);
+
+  /* Check command and result fit buffer */
+  if(ctx->size < sizeof(struct cmdfrmt_9) || cmd->count == 0 || cmd->count > SPU_MGET_MAX_KEYS ||
+     ctx->size < SPU_MGET_CMD_SIZE(cmd->count) || ctx->size < SPU_MGET_RSLT_SIZE(cmd->count))
+  {
+    LOG_ERROR("Wrong MGET command size");
+    return -EINVAL;
+  }
+
+  switch(PURE_CMD(cmd->op))
+  {
+    CASE_MGET_OP:
+      break;
+
+    default:
+      LOG_ERROR("Command 0x%02x could not be executed by MGET", PURE_CMD(cmd->op));
+      return -EINVAL;
+  }
+
+  /* Logical structure has no SPU structure - keys are routed one by one */
+  str = part_is(cmd->gsid) ? 0 : resolve_gsid(cmd->gsid, PURE_CMD(cmd->op));
+  if(str < 0)
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "was not found", GSID_VAR(cmd->gsid));
+    return -ENOKEY;
+  }
+
+  /* Allocate result */
+  rslt = kzalloc(SPU_MGET_RSLT_SIZE(cmd->count), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+  *res_buf = rslt;
+
+  rslt->count = cmd->count;
+  for(i=0; i<cmd->count; i++)
+  {
+    rslt->items[i].rslt = ERR;
+  }
+
+  /* Old SPU revisions do not return results through SPU to CPU queue */
+  if(pci_get_revision() >= MISD_REVISION && str > 0)
+  {
+    err = exec_pipelined(cmd, str, rslt, ctx);
+  }
+  else
+  {
+    LOG_DEBUG("SPU revision %d has no result queue or structure is logical, executing one by one", pci_get_revision());
+    err = exec_serial(cmd, rslt, ctx);
+  }
+
+  for(i=0; i<cmd->count; i++)
+  {
+    if(!ERRORS(rslt->items[i].rslt))
+    {
+      rslt->found[i/32] |= 1U<<(i%32);
+      rslt->found_count++;
+    }
+  }
+
+  rslt->rslt = err ? ERR : OK;
+  LOG_DEBUG("MGET found %u keys of %u", rslt->found_count, rslt->count);
+  return SPU_MGET_RSLT_SIZE(cmd->count);
+}
+
+/* Load keys into suspended SPU queue while it is not full, then take results */
+/* Results are taken from SPU to CPU queue in order of sent keys */
+static int exec_pipelined(const struct cmdfrmt_9 *cmd, int str, struct rsltfrmt_6 *rslt, struct exec_ctx *ctx)
+{
+  u32 addr_shift[SPU_WEIGHT*2 + 1], data[SPU_WEIGHT*2 + 1];
+  struct pci_burst pci_burst =
+  {
+    .count      = SPU_WEIGHT*2 + 1,
+    .addr_shift = addr_shift,
+    .data       = data
+  };
+  u8 op = PURE_CMD(cmd->op);
+  u8 spu_state, j;
+  u32 i = 0, k = 0, burst_start, tsc_start;
+  int err = 0;
+
+  for(j=0; j<SPU_WEIGHT; j++)
+  {
+    addr_shift[j]            = KEY_REG + j;
+    addr_shift[j+SPU_WEIGHT] = VAL_REG + j;
+  }
+  addr_shift[SPU_WEIGHT*2] = POWER_REG;
+
+  pci_control_set(ALLOW_MISD_FLAG, 1);
+
+  while(i < cmd->count && !err)
+  {
+    err = poll_spu(STATE_REG_0, SPU_READY_FLAG, &spu_state, ctx);
+    if(err)
+    {
+      LOG_ERROR("SPU is not ready for operation");
+      recover_poll(err);
+      break;
+    }
+
+    burst_start = i;
+    pci_control_set(SUSPEND_Q_FLAG, 1);
+
+    do
+    {
+      load_key(op, &cmd->keys[i], str);
+      i++;
+    }
+    while(i < cmd->count && !spu_queue_full());
+
+    /* Release burst */
+    tsc_start = pci_single_read(TSC_REG);
+    pci_control_set(SUSPEND_Q_FLAG, 0);
+    pci_shadow_invalidate();
+    LOG_DEBUG("Released burst of %u keys", i - burst_start);
+
+    /* Take results of burst */
+    for(k=burst_start; k<i; k++)
+    {
+      err = poll_spu_finish(STATE_REG_1, SPU2CPU_Q_EMP_FLAG, 0, &spu_state, ctx);
+      if(err)
+      {
+        LOG_ERROR("SPU can not finish operation with key %u", k);
+        break;
+      }
+
+      pci_burst_read(&pci_burst);
+      for(j=0; j<SPU_WEIGHT; j++)
+      {
+        rslt->items[k].key.cont[j] = data[j];
+        rslt->items[k].val.cont[j] = data[j+SPU_WEIGHT];
+      }
+      rslt->items[k].power = data[SPU_WEIGHT*2];
+      rslt->items[k].rslt  = queued_status(op, &cmd->keys[k], &rslt->items[k]);
+
+      /* Next result */
+      pci_single_write(1<<SHIFT_SPU2CPU_Q_FLAG, CNTL_REG_1);
+      pci_shadow_invalidate();
+    }
+    ctx->tsc += pci_single_read(TSC_REG) - tsc_start;
+  }
+
+  pci_control_set(ALLOW_MISD_FLAG, 0);
+
+  /* Results left in queue would be taken by next command */
+  if(err && k < i)
+  {
+    drain_results(i - k);
+    i = k;
+  }
+
+  if(i)
+  {
+    set_str_power(str, rslt->items[i-1].power);
+  }
+
+  return err;
+}
+
+/* Execute operation key by key */
+static int exec_serial(const struct cmdfrmt_9 *cmd, struct rsltfrmt_6 *rslt, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 cmd_2 =
+  {
+    .cmd  = PURE_CMD(cmd->op) | P_FLAG,
+    .gsid = cmd->gsid
+  };
+  u32 i;
+  int err = 0, cmd_err;
+
+  for(i=0; i<cmd->count; i++)
+  {
+    cmd_2.key = cmd->keys[i];
+    cmd_err   = execute_int_cmd(&cmd_2, sizeof(cmd_2), &rslt->items[i], sizeof(struct rsltfrmt_2), ctx);
+
+    /* SPU error status is kept in item result */
+    if(cmd_err && cmd_err != -EIO)
+    {
+      rslt->items[i].rslt = ERR;
+      err = cmd_err;
+      break;
+    }
+  }
+
+  return err;
+}
+
+/* Load one key and queued command into suspended SPU queue */
+static void load_key(u8 op, const spu_key_t *key, int str)
+{
+  u32 addr_shift[SPU_WEIGHT + 1], data[SPU_WEIGHT + 1];
+  struct pci_burst pci_burst =
+  {
+    .count      = 0,
+    .addr_shift = addr_shift,
+    .data       = data
+  };
+  u8 i;
+
+  for(i=0; i<SPU_WEIGHT; i++)
+  {
+    addr_shift[pci_burst.count] = KEY_REG + i;
+    data[pci_burst.count++]     = key->cont[i];
+  }
+
+  addr_shift[pci_burst.count] = CMD_REG;
+  data[pci_burst.count++]     = CMD_SHIFT( op | Q_FLAG ) | str;
+
+  pci_burst_write(&pci_burst);
+}
@@ -0,0 +1,34 @@
+/*
+  mgetexec.h
+        - multi-key command executor definitions
+        - one operation for many keys of one structure pipelined through SPU queue
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MGETEXEC_H
+#define MGETEXEC_H
+
+/* Macros to switch across MGET operations */
+#define CASE_MGET_OP case SRCH:\
+                     case NEXT:\
+                     case PREV:\
+                     case NSM:\
+                     case NGR
+
+size_t execute_mget(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+
+#endif /* MGETEXEC_H */
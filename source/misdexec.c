@@ -0,0 +1,270 @@
+/*
+  misdexec.c
+        - MISD command executor
+        - one command over several structures in parallel
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "MISD execution"
+
+#include <linux/slab.h>
+
+#include "spu.h"
+#include "log.h"
+#include "pcidrv.h"
+#include "cmdexec.h"
+#include "misdexec.h"
+#include "gsidresolver.h"
+#include "partition.h"
+
+/* Internal functions */
+static int exec_parallel(const struct cmdfrmt_7 *cmd, struct rsltfrmt_4 *rslt, struct exec_ctx *ctx);
+static int exec_serial(const struct cmdfrmt_7 *cmd, struct rsltfrmt_4 *rslt, struct exec_ctx *ctx);
+
+/* MISD command executor */
+size_t execute_misd(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_7 *cmd = CMDFRMT_7(cmd_buf);
+  struct rsltfrmt_4 *rslt;
+  u8 i, logical = 0;
+  int err;
+
+  LOG_DEBUG("MISD command 0x%02x execution over %d structures", PURE_CMD(cmd->op), cmd->count);
+
+  /* Check command and result fit buffer */
+  if(cmd->count == 0 || cmd->count > SPU_STR_NUM ||
+     ctx->size < sizeof(struct cmdfrmt_7) || ctx->size < sizeof(struct rsltfrmt_4))
+  {
+    LOG_ERROR("Wrong MISD command size");
+    return -EINVAL;
+  }
+
+  switch(PURE_CMD(cmd->op))
+  {
+    CASE_MISD_KEY:
+    CASE_MISD_NOKEY:
+      break;
+
+    default:
+      LOG_ERROR("Command 0x%02x could not be executed in MISD mode", PURE_CMD(cmd->op));
+      return -EINVAL;
+  }
+
+  /* Allocate result */
+  rslt = kzalloc(sizeof(struct rsltfrmt_4), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+  *res_buf = rslt;
+
+  /* Every result is tied to its structure */
+  rslt->count = cmd->count;
+  for(i=0; i<cmd->count; i++)
+  {
+    rslt->items[i].gsid      = cmd->gsids[i];
+    rslt->items[i].rslt.rslt = ERR;
+    logical |= part_is(cmd->gsids[i]);
+  }
+
+  /* Old SPU revisions have no MISD mode, logical structures are executed by partitions */
+  if(pci_get_revision() >= MISD_REVISION && !logical)
+  {
+    rslt->misd = 1;
+    err = exec_parallel(cmd, rslt, ctx);
+  }
+  else
+  {
+    LOG_DEBUG("SPU revision %d has no MISD mode or structure is logical, executing one by one", pci_get_revision());
+    rslt->misd = 0;
+    err = exec_serial(cmd, rslt, ctx);
+  }
+
+  rslt->rslt = err ? ERR : OK;
+  return sizeof(struct rsltfrmt_4);
+}
+
+/* Execute command over all structures at once in MISD mode */
+/* Results are taken from SPU to CPU queue in order of sent commands */
+static int exec_parallel(const struct cmdfrmt_7 *cmd, struct rsltfrmt_4 *rslt, struct exec_ctx *ctx)
+{
+  u32 addr_shift[SPU_WEIGHT*2 + 1], data[SPU_WEIGHT*2 + 1];
+  struct pci_burst pci_burst =
+  {
+    .addr_shift = addr_shift,
+    .data       = data
+  };
+  u8 op = PURE_CMD(cmd->op);
+  int strs[SPU_STR_NUM];
+  u8 spu_state, i, j;
+  u32 tsc_start, queued = 0;
+  int err = 0, poll_err;
+
+  /* Resolve all structures first */
+  for(i=0; i<cmd->count; i++)
+  {
+    strs[i] = resolve_gsid(cmd->gsids[i], op);
+    if(strs[i] <= 0)
+    {
+      LOG_ERROR("GSID" GSID_FORMAT "was not found", GSID_VAR(cmd->gsids[i]));
+      err = -ENOKEY;
+    }
+  }
+
+  poll_err = poll_spu(STATE_REG_0, SPU_READY_FLAG, &spu_state, ctx);
+  if(poll_err)
+  {
+    LOG_ERROR("SPU is not ready for operation");
+    recover_poll(poll_err);
+    return poll_err;
+  }
+
+  pci_control_set(ALLOW_MISD_FLAG, 1);
+
+  /* Key is shared by all commands */
+  switch(op)
+  {
+    CASE_MISD_KEY:
+      pci_burst.count = SPU_WEIGHT;
+      for(j=0; j<SPU_WEIGHT; j++)
+      {
+        addr_shift[j] = KEY_REG + j;
+        data[j]       = cmd->key.cont[j];
+      }
+      pci_burst_write(&pci_burst);
+      break;
+
+    default:
+      break;
+  }
+
+  /* Queue command for every found structure */
+  tsc_start = pci_single_read(TSC_REG);
+  for(i=0; i<cmd->count; i++)
+  {
+    if(strs[i] <= 0)
+    {
+      continue;
+    }
+
+    /* Full queue is running, so it takes next command after SPU executes one */
+    if(queued && spu_queue_full())
+    {
+      poll_err = poll_spu_finish(STATE_REG_0, SYS2SPU_Q_FULL_FLAG, 0, &spu_state, ctx);
+      if(poll_err)
+      {
+        LOG_ERROR("SPU queue was not freed");
+        err = poll_err;
+        break;
+      }
+    }
+
+    pci_single_write(CMD_SHIFT(op | Q_FLAG) | strs[i], CMD_REG);
+    queued++;
+  }
+  pci_shadow_invalidate();
+
+  /* Take results in the same order */
+  pci_burst.count = SPU_WEIGHT*2 + 1;
+  for(j=0; j<SPU_WEIGHT; j++)
+  {
+    addr_shift[j]            = KEY_REG + j;
+    addr_shift[j+SPU_WEIGHT] = VAL_REG + j;
+  }
+  addr_shift[SPU_WEIGHT*2] = POWER_REG;
+
+  /* Only queued commands give results */
+  for(i=0; i<cmd->count && queued; i++)
+  {
+    if(strs[i] <= 0)
+    {
+      continue;
+    }
+
+    poll_err = poll_spu_finish(STATE_REG_1, SPU2CPU_Q_EMP_FLAG, 0, &spu_state, ctx);
+    if(poll_err)
+    {
+      LOG_ERROR("SPU can not finish operation over structure %d", strs[i]);
+      err = poll_err;
+      break;
+    }
+
+    pci_burst_read(&pci_burst);
+    for(j=0; j<SPU_WEIGHT; j++)
+    {
+      rslt->items[i].rslt.key.cont[j] = data[j];
+      rslt->items[i].rslt.val.cont[j] = data[j+SPU_WEIGHT];
+    }
+    rslt->items[i].rslt.power = data[SPU_WEIGHT*2];
+    rslt->items[i].rslt.rslt  = queued_status(op, &cmd->key, &rslt->items[i].rslt);
+    set_str_power(strs[i], rslt->items[i].rslt.power);
+
+    /* Next result */
+    pci_single_write(1<<SHIFT_SPU2CPU_Q_FLAG, CNTL_REG_1);
+    pci_shadow_invalidate();
+    queued--;
+  }
+  ctx->tsc += pci_single_read(TSC_REG) - tsc_start;
+
+  pci_control_set(ALLOW_MISD_FLAG, 0);
+
+  /* Results left in queue would be taken by next command */
+  if(queued)
+  {
+    drain_results(queued);
+  }
+
+  return err;
+}
+
+/* Execute command over structures one by one */
+static int exec_serial(const struct cmdfrmt_7 *cmd, struct rsltfrmt_4 *rslt, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 cmd_2;
+  struct cmdfrmt_3 cmd_3;
+  u8 op = PURE_CMD(cmd->op);
+  u8 i;
+  int err = 0, cmd_err;
+
+  for(i=0; i<cmd->count; i++)
+  {
+    switch(op)
+    {
+      CASE_MISD_KEY:
+        cmd_2 = (struct cmdfrmt_2) { .cmd = op | P_FLAG, .gsid = cmd->gsids[i], .key = cmd->key };
+        cmd_err = execute_int_cmd(&cmd_2, sizeof(cmd_2), &rslt->items[i].rslt, sizeof(struct rsltfrmt_2), ctx);
+        break;
+
+      default:
+        cmd_3 = (struct cmdfrmt_3) { .cmd = op | P_FLAG, .gsid = cmd->gsids[i] };
+        cmd_err = execute_int_cmd(&cmd_3, sizeof(cmd_3), &rslt->items[i].rslt, sizeof(struct rsltfrmt_2), ctx);
+        break;
+    }
+
+    /* SPU error status is kept in item result */
+    if(cmd_err && cmd_err != -EIO)
+    {
+      rslt->items[i].rslt.rslt = ERR;
+      err = cmd_err;
+    }
+  }
+
+  return err;
+}
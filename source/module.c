@@ -32,6 +32,10 @@
 #include "module.h"
 #include "pcidrv.h"
 #include "chardev.h"
+#include "cmdexec.h"
+#include "trace.h"
+#include "status.h"
+#include "values.h"
 
 /* Module about information */
 MODULE_LICENSE(DRIVER_LICENSE);
@@ -64,6 +68,19 @@ static int __init module_init_func(void)
   }
   LOG_DEBUG("PCI driver created");
 
+  /* Create status page */
+  err = create_status();
+  if(err)
+  {
+    LOG_ERROR("Status page create fault");
+    return err;
+  }
+  LOG_DEBUG("Status page created");
+
+  /* Create command trace files - trace is optional */
+  create_trace();
+  LOG_DEBUG("Command trace created");
+
   /* Create character device */
   err = create_char_device();
   if(err)
@@ -82,11 +99,21 @@ static void __exit module_exit_func(void)
 {
   LOG_DEBUG("Module remove");
 
-  destroy_pci_driver();
-  LOG_DEBUG("PCI driver destroyed");
- 
+  /* Character device goes first - it sends buffered commands to SPU */
   destroy_char_device();
   LOG_DEBUG("Character device destroyed");
 
+  destroy_trace();
+  LOG_DEBUG("Command trace destroyed");
+
+  destroy_status();
+  LOG_DEBUG("Status page destroyed");
+
+  destroy_vals();
+  LOG_DEBUG("Value arenas destroyed");
+
+  destroy_pci_driver();
+  LOG_DEBUG("PCI driver destroyed");
+
   LOG_INFO("%s removed", DRIVER_DESCRIPTION);
 }
\ No newline at end of file
@@ -0,0 +1,728 @@
+/*
+  partition.c
+        - partitioned structures
+        - logical structure is a set of SPU structures holding adjacent key ranges
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "partition"
+
+#include <linux/slab.h>
+
+#include "spu.h"
+#include "log.h"
+#include "cmdexec.h"
+#include "gsidresolver.h"
+#include "snapshot.h"
+#include "partition.h"
+
+/* Logical structure partitioned by key ranges */
+struct partition
+{
+  gsid_t gsid;                   // Logical structure, zero for free slot
+  u8 count;                      // Partitions number
+  gsid_t parts[SPU_STR_NUM];     // Partitions structures in keys order
+  spu_key_t bounds[SPU_STR_NUM]; // Lowest key of every partition, the first one is not used
+};
+
+/* Logical structures - protected by SPU commands lock */
+static struct partition parts[SPU_STR_NUM] = { { .gsid = { .cont = {0} } } };
+
+/* Internal functions */
+static int create_part(const struct cmdfrmt_13 *cmd, struct rsltfrmt_10 *rslt, struct exec_ctx *ctx);
+static int split_part(const struct cmdfrmt_13 *cmd, struct rsltfrmt_10 *rslt, struct exec_ctx *ctx);
+static size_t route_key(const struct partition *part, const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t route_walk(const struct partition *part, const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t route_edge(const struct partition *part, u8 cmd, const void **res_buf, struct exec_ctx *ctx);
+static size_t route_dels(struct partition *part, const void **res_buf, struct exec_ctx *ctx);
+static size_t route_sets(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t route_slice(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t exec_part_cmd(const void *cmd_buf, size_t size, const void **res_buf, struct exec_ctx *ctx);
+static int walk_parts(const struct partition *part, int from, int step, struct rsltfrmt_2 *rslt, struct exec_ctx *ctx);
+static size_t alloc_rslt_1(const void **res_buf, int err, u32 power);
+static struct partition *get_part(gsid_t gsid);
+static struct partition *find_part(gsid_t gsid);
+static struct partition *find_member(gsid_t gsid);
+static int check_bounds(const struct cmdfrmt_13 *cmd, u8 idx, struct exec_ctx *ctx);
+static u8 part_idx(const struct partition *part, const spu_key_t *key);
+static u8 part_same(const struct partition *a, const struct partition *b);
+static u32 part_power(const struct partition *part);
+static void delete_str(gsid_t gsid, struct exec_ctx *ctx);
+
+/* PART command executor - create or split logical structure */
+size_t execute_part(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_13 *cmd = CMDFRMT_13(cmd_buf);
+  struct rsltfrmt_10 *rslt;
+  int err;
+
+  LOG_DEBUG("PART command execution with operation %d", cmd->op);
+
+  if(ctx->size < sizeof(struct cmdfrmt_13))
+  {
+    LOG_ERROR("Wrong PART command size");
+    return -EINVAL;
+  }
+
+  /* Allocate result */
+  rslt = kzalloc(sizeof(struct rsltfrmt_10), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+
+  switch(cmd->op)
+  {
+    case PART_CREATE_OP:
+      err = create_part(cmd, rslt, ctx);
+      break;
+
+    case PART_SPLIT_OP:
+      err = split_part(cmd, rslt, ctx);
+      break;
+
+    default:
+      LOG_ERROR("Unknown PART operation %d", cmd->op);
+      err = -EINVAL;
+      break;
+  }
+
+  /* Wrong command is a driver error, SPU failure is an error status */
+  if(err && err != -EIO)
+  {
+    kfree(rslt);
+    return err;
+  }
+
+  *res_buf   = rslt;
+  rslt->rslt = err ? ERR : OK;
+  return sizeof(struct rsltfrmt_10);
+}
+
+/* Execute command over partitions if it uses logical structure, 0 if it does not */
+size_t route_part(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  u8 cmd = CMDFRMT_0(cmd_buf)->cmd;
+  struct partition *part;
+
+  switch(PURE_CMD(cmd))
+  {
+    /* Structure GSID is right after command in formats 1, 2, 3 */
+    CASE_CMDFRMT_1:
+    CASE_CMDFRMT_2:
+    CASE_CMDFRMT_3:
+    case SNAP:
+      part = get_part(CMDFRMT_3(cmd_buf)->gsid);
+      break;
+
+    CASE_CMDFRMT_4:
+      return route_sets(cmd_buf, res_buf, ctx);
+
+    CASE_CMDFRMT_5:
+      return route_slice(cmd_buf, res_buf, ctx);
+
+    default:
+      return 0;
+  }
+
+  if(!part)
+  {
+    /* Partition is deleted only with its logical structure */
+    if(PURE_CMD(cmd) == DELS && find_member(CMDFRMT_3(cmd_buf)->gsid))
+    {
+      LOG_ERROR("GSID" GSID_FORMAT "is a partition of logical structure", GSID_VAR(CMDFRMT_3(cmd_buf)->gsid));
+      return -EBUSY;
+    }
+    return 0;
+  }
+
+  switch(PURE_CMD(cmd))
+  {
+    case INS:
+    case SRCH:
+    case DEL:
+      return route_key(part, cmd_buf, res_buf, ctx);
+
+    case NEXT:
+    case PREV:
+    case NSM:
+    case NGR:
+      return route_walk(part, cmd_buf, res_buf, ctx);
+
+    case MIN:
+    case MAX:
+      return route_edge(part, cmd, res_buf, ctx);
+
+    case DELS:
+      return route_dels(part, res_buf, ctx);
+
+    default:
+      LOG_ERROR("Command 0x%02x could not be executed over logical structure", PURE_CMD(cmd));
+      return -EINVAL;
+  }
+}
+
+/* Check if GSID is logical structure */
+u8 part_is(gsid_t gsid)
+{
+  return get_part(gsid) != NULL;
+}
+
+/* Get partition structure holding key, GSID itself if it is not logical structure */
+gsid_t part_route(gsid_t gsid, const spu_key_t *key)
+{
+  struct partition *part = get_part(gsid);
+
+  return part ? part->parts[part_idx(part, key)] : gsid;
+}
+
+/* Join existing structures into new logical structure */
+static int create_part(const struct cmdfrmt_13 *cmd, struct rsltfrmt_10 *rslt, struct exec_ctx *ctx)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+  struct partition *part;
+  int err;
+  u8 i, j;
+
+  if(cmd->count == 0 || cmd->count > SPU_STR_NUM)
+  {
+    LOG_ERROR("Wrong partitions number %d", cmd->count);
+    return -EINVAL;
+  }
+
+  for(i=0; i<cmd->count; i++)
+  {
+    /* Partition is an existing writable structure of one logical structure only */
+    if(resolve_gsid(cmd->gsids[i], SRCH) <= 0 || snap_is(cmd->gsids[i]) || find_member(cmd->gsids[i]))
+    {
+      LOG_ERROR("GSID" GSID_FORMAT "could not be a partition", GSID_VAR(cmd->gsids[i]));
+      return -ENOKEY;
+    }
+
+    for(j=0; j<i; j++)
+    {
+      if(GSID_EQUAL(cmd->gsids[i], cmd->gsids[j]))
+      {
+        LOG_ERROR("GSID" GSID_FORMAT "is given twice", GSID_VAR(cmd->gsids[i]));
+        return -EINVAL;
+      }
+    }
+
+    if(i > 1 && key_cmp(&cmd->bounds[i-1], &cmd->bounds[i]) >= 0)
+    {
+      LOG_ERROR("Partitions bounds are not ascending");
+      return -EINVAL;
+    }
+  }
+
+  /* Joined structures keys must already be in their partitions */
+  for(i=0; i<cmd->count; i++)
+  {
+    err = check_bounds(cmd, i, ctx);
+    if(err)
+    {
+      return err;
+    }
+  }
+
+  part = find_part(zero_gsid);
+  if(!part)
+  {
+    LOG_ERROR("No free logical structure slot");
+    return -ENOKEY;
+  }
+
+  generate_gsid(&part->gsid);
+  part->count = cmd->count;
+  for(i=0; i<cmd->count; i++)
+  {
+    part->parts[i]  = cmd->gsids[i];
+    part->bounds[i] = cmd->bounds[i];
+  }
+
+  /* Result generation */
+  rslt->gsid  = part->gsid;
+  rslt->count = part->count;
+  rslt->power = part_power(part);
+
+  LOG_DEBUG("PART created logical GSID" GSID_FORMAT "of %d partitions", GSID_VAR(part->gsid), part->count);
+  return 0;
+}
+
+/* Split partition holding key into keys less than key and the rest */
+/* Both halves are copied before old partition is deleted, so failed split changes nothing */
+static int split_part(const struct cmdfrmt_13 *cmd, struct rsltfrmt_10 *rslt, struct exec_ctx *ctx)
+{
+  struct partition *part = get_part(cmd->gsid);
+  struct cmdfrmt_5 cmd_5;
+  struct rsltfrmt_1 rslt_1;
+  gsid_t low, high, old;
+  u8 i, j;
+  int err;
+
+  if(!part)
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "is not a logical structure", GSID_VAR(cmd->gsid));
+    return -ENOKEY;
+  }
+
+  if(part->count == SPU_STR_NUM)
+  {
+    LOG_ERROR("Logical structure has no space for partition");
+    return -ENOSPC;
+  }
+
+  i = part_idx(part, &cmd->key);
+  if(i > 0 && key_cmp(&cmd->key, &part->bounds[i]) == 0)
+  {
+    LOG_ERROR("Split key is already a partition bound");
+    return -EINVAL;
+  }
+
+  if(create_gsid(&low) != 0)
+  {
+    return -ENOKEY;
+  }
+  if(create_gsid(&high) != 0)
+  {
+    delete_str(low, ctx);
+    return -ENOKEY;
+  }
+
+  cmd_5 = (struct cmdfrmt_5) { .cmd = LS | P_FLAG, .gsid_a = part->parts[i], .gsid_r = low, .key = cmd->key };
+  err = execute_int_cmd(&cmd_5, sizeof(cmd_5), &rslt_1, sizeof(rslt_1), ctx);
+
+  if(!err)
+  {
+    cmd_5 = (struct cmdfrmt_5) { .cmd = GREQ | P_FLAG, .gsid_a = part->parts[i], .gsid_r = high, .key = cmd->key };
+    err = execute_int_cmd(&cmd_5, sizeof(cmd_5), &rslt_1, sizeof(rslt_1), ctx);
+  }
+
+  if(err)
+  {
+    LOG_ERROR("Partition could not be split");
+    delete_str(low, ctx);
+    delete_str(high, ctx);
+    return -EIO;
+  }
+
+  /* Old partition leaves logical structure first, so DELS is not rejected */
+  old = part->parts[i];
+  for(j=part->count; j>i+1; j--)
+  {
+    part->parts[j]  = part->parts[j-1];
+    part->bounds[j] = part->bounds[j-1];
+  }
+  part->parts[i]    = low;
+  part->parts[i+1]  = high;
+  part->bounds[i+1] = cmd->key;
+  part->count++;
+  delete_str(old, ctx);
+
+  /* Result generation */
+  rslt->gsid  = part->gsid;
+  rslt->count = part->count;
+  rslt->power = part_power(part);
+
+  LOG_DEBUG("PART split partition %d of logical GSID" GSID_FORMAT, i, GSID_VAR(part->gsid));
+  return 0;
+}
+
+/* INS, SRCH, DEL - command goes to partition holding key */
+static size_t route_key(const struct partition *part, const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_1 cmd;
+  size_t size = cmd_size(CMDFRMT_0(cmd_buf)->cmd);
+
+  /* Format 2 is the beginning of format 1 */
+  memcpy(&cmd, cmd_buf, size);
+  cmd.gsid = part->parts[part_idx(part, &cmd.key)];
+
+  return exec_part_cmd(&cmd, size, res_buf, ctx);
+}
+
+/* NEXT, PREV, NSM, NGR - pair missing in partition of key is the edge one of neighbour partitions */
+static size_t route_walk(const struct partition *part, const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 cmd = *CMDFRMT_2(cmd_buf);
+  struct rsltfrmt_2 rslt;
+  u8 op = PURE_CMD(cmd.cmd);
+  int step = (op == NEXT || op == NGR) ? 1 : -1;
+  int i = part_idx(part, &cmd.key);
+  size_t rslt_size;
+
+  cmd.gsid  = part->parts[i];
+  rslt_size = exec_part_cmd(&cmd, sizeof(cmd), res_buf, ctx);
+  if((ssize_t)rslt_size <= 0 || GET_P_FLAG(cmd.cmd) == 0 || !(RSLTFRMT_2(*res_buf)->rslt & ERR))
+  {
+    return rslt_size;
+  }
+
+  /* NEXT and PREV go on only from existing key */
+  if(op == NEXT || op == PREV)
+  {
+    cmd.cmd = SRCH | P_FLAG;
+    if(execute_int_cmd(&cmd, sizeof(cmd), &rslt, sizeof(rslt), ctx))
+    {
+      return rslt_size;
+    }
+  }
+
+  if(!walk_parts(part, i + step, step, &rslt, ctx))
+  {
+    memcpy((void *) *res_buf, &rslt, sizeof(struct rsltfrmt_2));
+  }
+
+  return rslt_size;
+}
+
+/* MIN, MAX - the first or the last non empty partition */
+static size_t route_edge(const struct partition *part, u8 cmd, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct rsltfrmt_2 *rslt;
+  int err;
+
+  /* Allocate result */
+  rslt = kzalloc(sizeof(struct rsltfrmt_2), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+
+  if(PURE_CMD(cmd) == MIN)
+  {
+    err = walk_parts(part, 0, 1, rslt, ctx);
+  }
+  else
+  {
+    err = walk_parts(part, part->count - 1, -1, rslt, ctx);
+  }
+
+  if(err && err != -EIO)
+  {
+    kfree(rslt);
+    return err;
+  }
+
+  *res_buf = rslt;
+  return sizeof(struct rsltfrmt_2);
+}
+
+/* DELS - every partition is deleted with logical structure */
+static size_t route_dels(struct partition *part, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct partition deleted = *part;
+  gsid_t zero_gsid = { .cont = {0} };
+  struct cmdfrmt_3 dels;
+  struct rsltfrmt_1 rslt;
+  int err = 0;
+  u8 i;
+
+  /* Slot is freed first, so partitions DELS is not rejected */
+  part->gsid = zero_gsid;
+
+  /* Partitions deleted by previous failed DELS are skipped */
+  for(i=0; i<deleted.count; i++)
+  {
+    dels = (struct cmdfrmt_3) { .cmd = DELS, .gsid = deleted.parts[i] };
+    if(resolve_gsid(deleted.parts[i], SRCH) > 0 && execute_int_cmd(&dels, sizeof(dels), &rslt, sizeof(rslt), ctx))
+    {
+      err = -EIO;
+    }
+  }
+
+  /* Logical structure stays while any partition is left, so DELS could be repeated */
+  if(err)
+  {
+    *part = deleted;
+    LOG_ERROR("Logical GSID" GSID_FORMAT "was not deleted completely", GSID_VAR(deleted.gsid));
+  }
+  else
+  {
+    LOG_DEBUG("Logical GSID" GSID_FORMAT "deleted", GSID_VAR(deleted.gsid));
+  }
+
+  return alloc_rslt_1(res_buf, err, 0);
+}
+
+/* AND, OR, NOT - result partitions are computed from the same partitions of operands */
+/* Physical B is taken whole by every partition, so OR needs partitioned B to keep result in ranges */
+static size_t route_sets(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_4 *cmd = CMDFRMT_4(cmd_buf);
+  struct partition *a = get_part(cmd->gsid_a);
+  struct partition *b = get_part(cmd->gsid_b);
+  struct partition *r = get_part(cmd->gsid_r);
+  struct cmdfrmt_4 cmd_4;
+  struct rsltfrmt_1 rslt;
+  u32 power = 0;
+  int err = 0;
+  u8 i;
+
+  if(!a && !b && !r)
+  {
+    return 0;
+  }
+
+  if(!a || !r || !part_same(a, r) || (b ? !part_same(a, b) : PURE_CMD(cmd->cmd) == OR))
+  {
+    LOG_ERROR("Operands of command 0x%02x are not partitioned the same way", PURE_CMD(cmd->cmd));
+    return -EINVAL;
+  }
+
+  for(i=0; i<a->count && !err; i++)
+  {
+    cmd_4 = (struct cmdfrmt_4) { .cmd = cmd->cmd | P_FLAG, .gsid_a = a->parts[i], .gsid_b = b ? b->parts[i] : cmd->gsid_b, .gsid_r = r->parts[i] };
+    err   = execute_int_cmd(&cmd_4, sizeof(cmd_4), &rslt, sizeof(rslt), ctx);
+    power += err ? 0 : rslt.power;
+  }
+
+  return alloc_rslt_1(res_buf, err, power);
+}
+
+/* LS, LSEQ, GR, GREQ - result partitions are slices of the same partitions of operand */
+static size_t route_slice(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_5 *cmd = CMDFRMT_5(cmd_buf);
+  struct partition *a = get_part(cmd->gsid_a);
+  struct partition *r = get_part(cmd->gsid_r);
+  struct cmdfrmt_5 cmd_5;
+  struct rsltfrmt_1 rslt;
+  u32 power = 0;
+  int err = 0;
+  u8 i;
+
+  if(!a && !r)
+  {
+    return 0;
+  }
+
+  if(!a || !r || !part_same(a, r))
+  {
+    LOG_ERROR("Operands of command 0x%02x are not partitioned the same way", PURE_CMD(cmd->cmd));
+    return -EINVAL;
+  }
+
+  for(i=0; i<a->count && !err; i++)
+  {
+    cmd_5 = (struct cmdfrmt_5) { .cmd = cmd->cmd | P_FLAG, .gsid_a = a->parts[i], .gsid_r = r->parts[i], .key = cmd->key };
+    err   = execute_int_cmd(&cmd_5, sizeof(cmd_5), &rslt, sizeof(rslt), ctx);
+    power += err ? 0 : rslt.power;
+  }
+
+  return alloc_rslt_1(res_buf, err, power);
+}
+
+/* Execute command over partition, result is given to caller */
+static size_t exec_part_cmd(const void *cmd_buf, size_t size, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct exec_ctx int_ctx = *ctx;
+  size_t rslt_size;
+
+  int_ctx.size = size;
+  rslt_size = execute_cmd(cmd_buf, res_buf, &int_ctx);
+  ctx->tsc += int_ctx.tsc;
+
+  return rslt_size;
+}
+
+/* MIN (step 1) or MAX (step -1) of partitions from given one until non empty partition */
+/* Returns -EIO if every partition is empty */
+static int walk_parts(const struct partition *part, int from, int step, struct rsltfrmt_2 *rslt, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_3 cmd_3;
+  int err = -EIO;
+  int i;
+
+  rslt->rslt = ERR;
+  for(i=from; i>=0 && i<part->count && err == -EIO; i+=step)
+  {
+    cmd_3 = (struct cmdfrmt_3) { .cmd = (step > 0 ? MIN : MAX) | P_FLAG, .gsid = part->parts[i] };
+    err   = execute_int_cmd(&cmd_3, sizeof(cmd_3), rslt, sizeof(struct rsltfrmt_2), ctx);
+  }
+
+  return err;
+}
+
+/* Allocate format 1 result of command executed over partitions */
+static size_t alloc_rslt_1(const void **res_buf, int err, u32 power)
+{
+  struct rsltfrmt_1 *rslt;
+
+  rslt = kzalloc(sizeof(struct rsltfrmt_1), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+
+  rslt->rslt  = err ? ERR : OK;
+  rslt->power = power;
+  *res_buf = rslt;
+
+  return sizeof(struct rsltfrmt_1);
+}
+
+/* Get logical structure by GSID, NULL if GSID is not logical */
+static struct partition *get_part(gsid_t gsid)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+
+  return GSID_EQUAL(gsid, zero_gsid) ? NULL : find_part(gsid);
+}
+
+/* Get logical structure slot by GSID, zero GSID gives free slot */
+static struct partition *find_part(gsid_t gsid)
+{
+  u8 i;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    if(GSID_EQUAL(parts[i].gsid, gsid))
+    {
+      return &parts[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Get logical structure having structure as partition */
+static struct partition *find_member(gsid_t gsid)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+  u8 i, j;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    for(j=0; j<parts[i].count && !GSID_EQUAL(parts[i].gsid, zero_gsid); j++)
+    {
+      if(GSID_EQUAL(parts[i].parts[j], gsid))
+      {
+        return &parts[i];
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* Check that keys of joined structure are in its partition, empty structure fits any one */
+static int check_bounds(const struct cmdfrmt_13 *cmd, u8 idx, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_3 cmd_3;
+  struct rsltfrmt_2 rslt;
+  int err;
+
+  /* Lowest key is not less than partition bound */
+  if(idx > 0)
+  {
+    cmd_3 = (struct cmdfrmt_3) { .cmd = MIN | P_FLAG, .gsid = cmd->gsids[idx] };
+    err   = execute_int_cmd(&cmd_3, sizeof(cmd_3), &rslt, sizeof(rslt), ctx);
+    if(err)
+    {
+      return err == -EIO ? 0 : err;
+    }
+
+    if(key_cmp(&rslt.key, &cmd->bounds[idx]) < 0)
+    {
+      LOG_ERROR("GSID" GSID_FORMAT "has keys below its partition", GSID_VAR(cmd->gsids[idx]));
+      return -EINVAL;
+    }
+  }
+
+  /* Highest key is less than next partition bound */
+  if(idx < cmd->count - 1)
+  {
+    cmd_3 = (struct cmdfrmt_3) { .cmd = MAX | P_FLAG, .gsid = cmd->gsids[idx] };
+    err   = execute_int_cmd(&cmd_3, sizeof(cmd_3), &rslt, sizeof(rslt), ctx);
+    if(err)
+    {
+      return err == -EIO ? 0 : err;
+    }
+
+    if(key_cmp(&rslt.key, &cmd->bounds[idx+1]) >= 0)
+    {
+      LOG_ERROR("GSID" GSID_FORMAT "has keys above its partition", GSID_VAR(cmd->gsids[idx]));
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+/* Index of partition holding key */
+static u8 part_idx(const struct partition *part, const spu_key_t *key)
+{
+  u8 i = part->count - 1;
+
+  while(i > 0 && key_cmp(key, &part->bounds[i]) < 0)
+  {
+    i--;
+  }
+
+  return i;
+}
+
+/* Check that logical structures have the same bounds */
+static u8 part_same(const struct partition *a, const struct partition *b)
+{
+  u8 i;
+
+  if(a->count != b->count)
+  {
+    return 0;
+  }
+
+  for(i=1; i<a->count; i++)
+  {
+    if(key_cmp(&a->bounds[i], &b->bounds[i]) != 0)
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Sum of cached partitions power */
+static u32 part_power(const struct partition *part)
+{
+  u32 power = 0;
+  u8 i;
+
+  for(i=0; i<part->count; i++)
+  {
+    power += get_gsid_power(part->parts[i]);
+  }
+
+  return power;
+}
+
+/* Delete structure made by partition executor */
+static void delete_str(gsid_t gsid, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_3 dels;
+  struct rsltfrmt_1 rslt;
+
+  dels = (struct cmdfrmt_3) { .cmd = DELS, .gsid = gsid };
+  execute_int_cmd(&dels, sizeof(dels), &rslt, sizeof(rslt), ctx);
+}
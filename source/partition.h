@@ -0,0 +1,30 @@
+/*
+  partition.h
+        - partitioned structures definitions
+        - logical structures split by key ranges into several SPU structures
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARTITION_H
+#define PARTITION_H
+
+size_t execute_part(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+size_t route_part(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+u8 part_is(gsid_t gsid);
+gsid_t part_route(gsid_t gsid, const spu_key_t *key);
+
+#endif /* PARTITION_H */
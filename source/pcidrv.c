@@ -25,6 +25,8 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/interrupt.h>
+#include <linux/io.h>
+#include <asm/byteorder.h>
 
 #include "spu.h"
 #include "log.h"
@@ -37,7 +39,13 @@
 
 /* PCI driver privates */
 static void __iomem *pci_iomem = NULL; // PCI device IO memory pointer
+static phys_addr_t pci_bar_start = 0;  // PCI device registers BAR physical address
+static unsigned long pci_bar_len = 0;  // PCI device registers BAR length
 static u8 revision             = 0;    // PCI device revision number
+static u32 cntl_reg_0_shadow   = 0;    // Last value written to write only control register 0
+static u32 kv_shadow[KV_REGS_NUM];     // Last known values of key and value registers
+static u32 kv_valid            = 0;    // Bit mask of valid key and value shadow words
+static u8 state_shadow[2]      = {0};  // Last read STATE_REG_0 and STATE_REG_1
 
 /* PCI driver probe and remove functions */
 static int pci_driver_probe(struct pci_dev *pdev, const struct pci_device_id *ent);
@@ -47,7 +55,12 @@ static irqreturn_t pci_driver_irq_handler(int irq, void *pdev);
 /* Internal functions */
 static int read_device_config(struct pci_dev *pdev);
 static void pci_release_device(struct pci_dev *pdev);
+static void unmap_iomem(void);
 static void clear_spu_strs(void);
+static u8 burst_run(const struct pci_burst *pci_burst, u8 start, u8 skip_shadowed);
+static inline u8 is_kv_reg(u32 addr_shift);
+static inline u8 shadow_hit(u32 addr_shift, u32 data);
+static inline void shadow_set(u32 addr_shift, u32 data);
 
 /* IDs of supported PCI devices */
 static struct pci_device_id pci_driver_ids[] =
@@ -98,11 +111,62 @@ u8 pci_get_revision(void)
   return revision;
 }
 
+/* Get PCI device registers BAR physical location */
+int pci_get_bar(phys_addr_t *start, unsigned long *len)
+{
+  if(!pci_iomem)
+  {
+    return -ENODEV;
+  }
+
+  *start = pci_bar_start;
+  *len   = pci_bar_len;
+  return 0;
+}
+
+/* Set or clear control register 0 flag */
+void pci_control_set(u8 flag, u8 enable)
+{
+  if(enable)
+  {
+    cntl_reg_0_shadow |= (1<<flag);
+  }
+  else
+  {
+    cntl_reg_0_shadow &= ~(1<<flag);
+  }
+
+  pci_single_write(cntl_reg_0_shadow, CNTL_REG_0);
+}
+
+/* Reset command and result queues only - SPU structures in DDR are kept */
+void pci_reset_queues(void)
+{
+  pci_single_write((1<<RESET_PCI_Q_FLAG)     | (1<<RESET_SPU2CPU_Q_FLAG) |
+                   (1<<SPU2CPU_DRDY_INT_CLR) | (1<<SYS2SPU_QOVF_INT_CLR), CNTL_REG_1);
+
+  /* Key and value writes still in queues are lost */
+  pci_shadow_invalidate();
+}
+
+/* Forget key and value registers shadow - SPU wrote them by itself */
+void pci_shadow_invalidate(void)
+{
+  kv_valid = 0;
+}
+
+/* Last seen SPU state - register read or cached value */
+u8 pci_status_last(u32 addr_shift)
+{
+  return state_shadow[addr_shift == STATE_REG_1];
+}
+
 /* Single PCI device memory write */
 inline void pci_single_write(u32 data, u32 addr_shift)
 {
   LOG_DEBUG("Writing value 0x%08x to address 0x%02x", data, REG_ADDR(addr_shift));
   iowrite32(data, pci_iomem + REG_ADDR(addr_shift));
+  shadow_set(addr_shift, data);
 }
 
 /* Single PCI device memory read */
@@ -113,6 +177,7 @@ inline u32 pci_single_read(u32 addr_shift)
   /* Reading */
   data = ioread32(pci_iomem + REG_ADDR(addr_shift));
   LOG_DEBUG("Read value 0x%08x from address 0x%02x", data, REG_ADDR(addr_shift));
+  shadow_set(addr_shift, data);
 
   return data;
 }
@@ -126,31 +191,103 @@ inline u8 pci_status_read(u32 addr_shift)
   data = ioread8(pci_iomem + REG_ADDR(addr_shift));
   LOG_DEBUG("Read status 0x%02x from address 0x%02x", data, REG_ADDR(addr_shift));
 
+  /* Kept for status page */
+  if(addr_shift == STATE_REG_0 || addr_shift == STATE_REG_1)
+  {
+    state_shadow[addr_shift == STATE_REG_1] = data;
+  }
+
   return data;
 }
 
 /* Multiple PCI device memory write */
+/* Key and value registers already holding data are skipped */
+/* Contiguous key and value registers are written as one copy */
 void pci_burst_write(const struct pci_burst *pci_burst)
 {
-  u8 i;
+  u8 i = 0, j, run;
+  u8 kv_pending = 0;
   LOG_DEBUG("Writing %d words", pci_burst->count);
 
-  for(i = 0; i<pci_burst->count; i++)
+  while(i < pci_burst->count)
   {
-    pci_single_write(pci_burst->data[i], pci_burst->addr_shift[i]);
+    if(shadow_hit(pci_burst->addr_shift[i], pci_burst->data[i]))
+    {
+      LOG_DEBUG("Skip writing unchanged address 0x%02x", REG_ADDR(pci_burst->addr_shift[i]));
+      i++;
+      continue;
+    }
+
+    run = burst_run(pci_burst, i, 1);
+
+    if(is_kv_reg(pci_burst->addr_shift[i]))
+    {
+      LOG_DEBUG("Writing %d words run to address 0x%02x", run, REG_ADDR(pci_burst->addr_shift[i]));
+      __iowrite32_copy(pci_iomem + REG_ADDR(pci_burst->addr_shift[i]), &pci_burst->data[i], run);
+      kv_pending = 1;
+
+      for(j = i; j < i + run; j++)
+      {
+        shadow_set(pci_burst->addr_shift[j], pci_burst->data[j]);
+      }
+    }
+    else
+    {
+      /* Raw copies have no barrier - data should reach SPU before command and control registers */
+      if(kv_pending)
+      {
+        wmb();
+        kv_pending = 0;
+      }
+
+      for(j = i; j < i + run; j++)
+      {
+        pci_single_write(pci_burst->data[j], pci_burst->addr_shift[j]);
+      }
+    }
+
+    i += run;
+  }
+
+  if(kv_pending)
+  {
+    wmb();
   }
 }
 
 /* Multiple PCI device memory read */
+/* Contiguous registers are read as one copy */
 void pci_burst_read(const struct pci_burst *pci_burst)
 {
-  u8 i;
+  u8 i = 0, run;
   LOG_DEBUG("Reading %d words", pci_burst->count);
 
-  for(i = 0; i<pci_burst->count; i++)
+  while(i < pci_burst->count)
   {
+    run = burst_run(pci_burst, i, 0);
+
     // Brust-getter should provide empty array to write data in
-    pci_burst->data[i] = pci_single_read(pci_burst->addr_shift[i]);
+#ifdef __LITTLE_ENDIAN
+    __ioread32_copy(&pci_burst->data[i], pci_iomem + REG_ADDR(pci_burst->addr_shift[i]), run);
+    LOG_DEBUG("Read %d words run from address 0x%02x", run, REG_ADDR(pci_burst->addr_shift[i]));
+    {
+      u8 j;
+      for(j = i; j < i + run; j++)
+      {
+        shadow_set(pci_burst->addr_shift[j], pci_burst->data[j]);
+      }
+    }
+#else /* __LITTLE_ENDIAN */
+    {
+      u8 j;
+      for(j = i; j < i + run; j++)
+      {
+        pci_burst->data[j] = pci_single_read(pci_burst->addr_shift[j]);
+      }
+    }
+#endif /* __LITTLE_ENDIAN */
+
+    i += run;
   }
 }
 
@@ -215,6 +352,8 @@ static int pci_driver_probe(struct pci_dev *pdev, const struct pci_device_id *en
     return -EIO;
   }
   LOG_DEBUG("Mapped resource 0x%p", pci_iomem);
+  pci_bar_start = mmio_start;
+  pci_bar_len   = mmio_len;
 
   /* Request IRQs */
   if(pdev->irq)
@@ -224,6 +363,9 @@ static int pci_driver_probe(struct pci_dev *pdev, const struct pci_device_id *en
     if(err)
     {
       LOG_WARNING("IRQ%d not free", pdev->irq);
+      unmap_iomem();
+      pci_release_region(pdev, bar);
+      pci_disable_device(pdev);
       return err;
     }
   
@@ -243,9 +385,10 @@ static int pci_driver_probe(struct pci_dev *pdev, const struct pci_device_id *en
   LOG_DEBUG("Reset SPU and queues");
 
   /* Init SPU */
-  cntl_reg_0 = (1<<SPU2CPU_DRDY_INT_EN) | (1<<SYS2SPU_QOVF_INT_EN);
+  cntl_reg_0 = (1<<SPU2CPU_DRDY_INT_EN) | (1<<SYS2SPU_QOVF_INT_EN) | (1<<ENABLE_TSC_FLAG);
   LOG_DEBUG("Intalizing SPU with CNTL_REG_0 = 0x%08x to address 0x%02x", cntl_reg_0, CNTL_REG_0);
   iowrite32(cntl_reg_0, pci_iomem + REG_ADDR(CNTL_REG_0));
+  cntl_reg_0_shadow = cntl_reg_0;
   LOG_DEBUG("Initialize SPU");
 
   /* Get SPU current state registers */
@@ -257,10 +400,15 @@ static int pci_driver_probe(struct pci_dev *pdev, const struct pci_device_id *en
   if( ((stat_reg_0 >> DDR_TEST_SUCC_FLAG) & 0x1) == 0 )
   {
     LOG_ERROR("DDR initialization failed");
+    unmap_iomem();
+    pci_release_device(pdev);
     return -EIO;
   }
   LOG_DEBUG("DDR initialized");
 
+  /* Nothing is known about key and value registers after reset */
+  pci_shadow_invalidate();
+
   /* Clear SPU structures */
   clear_spu_strs();
   LOG_DEBUG("Clear all SPU structures");
@@ -272,12 +420,20 @@ static int pci_driver_probe(struct pci_dev *pdev, const struct pci_device_id *en
 static void pci_driver_remove(struct pci_dev *pdev)
 {
   /* Release maped IO memory */
+  unmap_iomem();
+
+  pci_release_device(pdev);
+}
+
+/* Unmap registers */
+/* BAR is mapped once uncached - key and value registers share page with command ones, other cache attribute would alias it */
+static void unmap_iomem(void)
+{
   if(pci_iomem)
   {
     iounmap(pci_iomem);
+    pci_iomem = NULL;
   }
-
-  pci_release_device(pdev);
 }
 
 static int read_device_config(struct pci_dev *pdev)
@@ -337,4 +493,47 @@ static inline void clear_spu_strs(void)
     // Clear structure
     pci_single_write(CMD_SHIFT(DELS) | (i+1), CMD_REG);
   }
+}
+
+/* Length of contiguous registers run inside or outside key and value registers window */
+/* Run may be stopped by register already holding data */
+static u8 burst_run(const struct pci_burst *pci_burst, u8 start, u8 skip_shadowed)
+{
+  u8 end = start + 1;
+
+  while(end < pci_burst->count &&
+        pci_burst->addr_shift[end] == pci_burst->addr_shift[end-1] + 1 &&
+        is_kv_reg(pci_burst->addr_shift[end]) == is_kv_reg(pci_burst->addr_shift[start]) &&
+        !(skip_shadowed && shadow_hit(pci_burst->addr_shift[end], pci_burst->data[end])))
+  {
+    end++;
+  }
+
+  return end - start;
+}
+
+/* Check if register is written by contiguous run copy - raw copies skip byte swapping, so only Little-endian hosts use it */
+static inline u8 is_kv_reg(u32 addr_shift)
+{
+#ifdef __LITTLE_ENDIAN
+  return addr_shift < KV_REGS_NUM;
+#else /* __LITTLE_ENDIAN */
+  return 0;
+#endif /* __LITTLE_ENDIAN */
+}
+
+/* Check if key or value register already holds data */
+static inline u8 shadow_hit(u32 addr_shift, u32 data)
+{
+  return addr_shift < KV_REGS_NUM && (kv_valid & (1<<addr_shift)) && kv_shadow[addr_shift] == data;
+}
+
+/* Remember key or value register data */
+static inline void shadow_set(u32 addr_shift, u32 data)
+{
+  if(addr_shift < KV_REGS_NUM)
+  {
+    kv_shadow[addr_shift] = data;
+    kv_valid |= (1<<addr_shift);
+  }
 }
\ No newline at end of file
@@ -33,6 +33,9 @@
 #define   KEY_REG  0x00
 #define   VAL_REG  0x08
 
+/* Key and value registers window - written by contiguous runs */
+#define   KV_REGS_NUM  0x10
+
 /* Write only registers */
 #define   CMD_REG     0x10
 #define   CNTL_REG_0  0x11
@@ -40,6 +43,7 @@
 
 /* Read only registers */
 #define   POWER_REG    0x20
+#define   TSC_REG      0x21
 #define   STATE_REG_0  0x24
 #define   STATE_REG_1  0x25
 
@@ -80,6 +84,9 @@
 #define   SPU2CPU_DRDY_INT_CLR    7
 #define   SYS2SPU_QOVF_INT_CLR    8
 
+/* First SPU revision supporting MISD mode */
+#define MISD_REVISION 0x05
+
 /* Macro to find any error classes */
 #define ERRORS(state) ( state & ERRORS_MASK )
 
@@ -90,6 +97,8 @@
 #define STR_B_SHIFT(str)  ( str<<1*STURCTURE_NUM ) // Shift of structure B in AND, OR, NOT
 #define STR_R_SHIFT(str)  ( str<<0 )               // Shift of structure R in AND, OR, NOT, LS, LSEQ, GR, GREQ
 
+#ifdef __KERNEL__
+
 /* PCI burst write and read structure */
 struct pci_burst {
   u8 count;        // Words count - 256 max
@@ -103,10 +112,17 @@ void destroy_pci_driver(void);
 
 /* Interface functions */
 u8 pci_get_revision(void);
+int pci_get_bar(phys_addr_t *start, unsigned long *len);
+void pci_control_set(u8 flag, u8 enable);
+void pci_reset_queues(void);
+void pci_shadow_invalidate(void);
 void pci_single_write(u32 data, u32 addr_shift);
 u32 pci_single_read(u32 addr_shift);
 u8 pci_status_read(u32 addr_shift);
+u8 pci_status_last(u32 addr_shift);
 void pci_burst_write(const struct pci_burst *pci_burst);
 void pci_burst_read(const struct pci_burst *pci_burst);
 
+#endif /* __KERNEL__ */
+
 #endif /* PCIDRV_H */
\ No newline at end of file
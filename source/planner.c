@@ -0,0 +1,364 @@
+/*
+  planner.c
+        - expression planner
+        - reorders AND, OR chains by known structures power
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "expression planner"
+
+#include <linux/kernel.h>
+
+#include "spu.h"
+#include "log.h"
+#include "cmdexec.h"
+#include "exprexec.h"
+#include "planner.h"
+#include "gsidresolver.h"
+
+/* Expression tree node */
+struct plan_node
+{
+  u8 kids[2]; // Operands in execution order
+  u8 nkids;   // Operands count
+  u32 est;    // Estimated power of node result
+  u8 need;    // Temporary structures needed to evaluate subtree
+};
+
+/* Planner state */
+struct planner
+{
+  const struct expr_node *nodes;
+  struct plan_node tree[SPU_EXPR_MAX_NODES];
+  u8 order[SPU_EXPR_MAX_NODES];
+  u8 len;
+  u64 cost;
+};
+
+/* Internal functions */
+static int parse_tree(struct planner *p, u8 count, u8 *root);
+static void estimate_tree(struct planner *p, u8 i);
+static void plan_tree(struct planner *p, u8 i);
+static void plan_chain(struct planner *p, u8 i);
+static void gather_chain(struct planner *p, u8 i, u8 op, u8 *operands, u8 *nops, u8 *spares, u8 *nspares);
+static void set_need(struct planner *p, u8 i, u8 commutative);
+static void emit_tree(struct planner *p, u8 i);
+
+/* Estimate power of operation result */
+/* Slices selectivity is unknown - half of structure is assumed */
+u32 estimate_power(u8 op, u32 power_a, u32 power_b)
+{
+  switch(op)
+  {
+    case AND:
+      return min(power_a, power_b);
+
+    case OR:
+      return power_a + power_b < power_a ? U32_MAX : power_a + power_b;
+
+    case NOT:
+      return power_a;
+
+    CASE_EXPR_SLICE:
+      return power_a / 2;
+
+    default:
+      return power_a;
+  }
+}
+
+/* Build expression execution plan */
+int plan_expr(const struct expr_node *nodes, u8 count, u8 opts, struct expr_plan *plan)
+{
+  struct planner p =
+  {
+    .nodes = nodes,
+    .len   = 0,
+    .cost  = 0
+  };
+  u8 root, i;
+  int err;
+
+  err = parse_tree(&p, count, &root);
+  if(err)
+  {
+    return err;
+  }
+
+  /* Cost of nodes order as sent */
+  estimate_tree(&p, root);
+  plan->naive_cost = p.cost;
+
+  /* Reorder chains */
+  if(opts & EXPR_PLAN_OPT)
+  {
+    p.cost = 0;
+    plan_tree(&p, root);
+  }
+
+  emit_tree(&p, root);
+  for(i=0; i<count; i++)
+  {
+    plan->order[i] = p.order[i];
+  }
+  plan->est_power = p.tree[root].est;
+  plan->est_cost  = p.cost;
+
+  LOG_DEBUG("Plan estimated power %u, cost %llu, naive cost %llu", plan->est_power, plan->est_cost, plan->naive_cost);
+  return 0;
+}
+
+/* Build tree from postfix nodes */
+static int parse_tree(struct planner *p, u8 count, u8 *root)
+{
+  u8 stack[SPU_EXPR_MAX_NODES];
+  u8 depth = 0;
+  u8 i;
+
+  for(i=0; i<count; i++)
+  {
+    struct plan_node *node = &p->tree[i];
+
+    switch(p->nodes[i].op)
+    {
+      case EXPR_LEAF:
+        node->nkids = 0;
+        break;
+
+      CASE_EXPR_BINARY:
+        if(depth < 2)
+        {
+          LOG_ERROR("Not enough operands for operation 0x%02x", p->nodes[i].op);
+          return -EINVAL;
+        }
+        node->nkids   = 2;
+        node->kids[1] = stack[--depth];
+        node->kids[0] = stack[--depth];
+        break;
+
+      CASE_EXPR_SLICE:
+        if(depth < 1)
+        {
+          LOG_ERROR("Not enough operands for operation 0x%02x", p->nodes[i].op);
+          return -EINVAL;
+        }
+        node->nkids   = 1;
+        node->kids[0] = stack[--depth];
+        break;
+
+      default:
+        LOG_ERROR("Unknown expression operation 0x%02x", p->nodes[i].op);
+        return -EINVAL;
+    }
+
+    stack[depth++] = i;
+  }
+
+  /* Only one tree should be built */
+  if(depth != 1)
+  {
+    LOG_ERROR("Expression is not complete");
+    return -EINVAL;
+  }
+
+  *root = stack[0];
+  return 0;
+}
+
+/* Estimate powers and cost of tree as is */
+static void estimate_tree(struct planner *p, u8 i)
+{
+  struct plan_node *node = &p->tree[i];
+  u32 est_a = 0, est_b = 0;
+  u8 k;
+
+  for(k=0; k<node->nkids; k++)
+  {
+    estimate_tree(p, node->kids[k]);
+  }
+
+  if(node->nkids == 0)
+  {
+    node->est = get_gsid_power(p->nodes[i].gsid);
+    return;
+  }
+
+  est_a = p->tree[node->kids[0]].est;
+  est_b = node->nkids == 2 ? p->tree[node->kids[1]].est : 0;
+
+  node->est = estimate_power(p->nodes[i].op, est_a, est_b);
+  p->cost  += (u64)est_a + est_b;
+}
+
+/* Plan subtree - AND, OR chains are flattened and reordered */
+static void plan_tree(struct planner *p, u8 i)
+{
+  struct plan_node *node = &p->tree[i];
+  u8 k;
+
+  switch(p->nodes[i].op)
+  {
+    case AND:
+    case OR:
+      plan_chain(p, i);
+      return;
+
+    default:
+      for(k=0; k<node->nkids; k++)
+      {
+        plan_tree(p, node->kids[k]);
+      }
+
+      if(node->nkids > 0)
+      {
+        node->est = estimate_power(p->nodes[i].op, p->tree[node->kids[0]].est,
+                                   node->nkids == 2 ? p->tree[node->kids[1]].est : 0);
+        p->cost  += (u64)p->tree[node->kids[0]].est + (node->nkids == 2 ? p->tree[node->kids[1]].est : 0);
+      }
+      set_need(p, i, 0);
+      return;
+  }
+}
+
+/* Plan AND, OR chain - operands with least power are combined first */
+static void plan_chain(struct planner *p, u8 i)
+{
+  u8 op = p->nodes[i].op;
+  u8 operands[SPU_EXPR_MAX_NODES], spares[SPU_EXPR_MAX_NODES];
+  u8 nops = 0, nspares = 0, used = 0;
+  u8 k, x, y, id;
+
+  /* Chain root is used for last operation */
+  gather_chain(p, i, op, operands, &nops, spares, &nspares);
+  spares[nspares++] = i;
+
+  for(k=0; k<nops; k++)
+  {
+    plan_tree(p, operands[k]);
+  }
+
+  /* Combine two least operands until one left */
+  while(nops > 1)
+  {
+    x = 0;
+    for(k=1; k<nops; k++)
+    {
+      if(p->tree[operands[k]].est < p->tree[operands[x]].est)
+      {
+        x = k;
+      }
+    }
+    y = x == 0 ? 1 : 0;
+    for(k=0; k<nops; k++)
+    {
+      if(k != x && p->tree[operands[k]].est < p->tree[operands[y]].est)
+      {
+        y = k;
+      }
+    }
+
+    id = spares[used++];
+    p->tree[id].nkids   = 2;
+    p->tree[id].kids[0] = operands[x];
+    p->tree[id].kids[1] = operands[y];
+    p->tree[id].est     = estimate_power(op, p->tree[operands[x]].est, p->tree[operands[y]].est);
+    p->cost            += (u64)p->tree[operands[x]].est + p->tree[operands[y]].est;
+    set_need(p, id, 1);
+
+    /* Replace operands by combination */
+    operands[min(x, y)] = id;
+    operands[max(x, y)] = operands[--nops];
+  }
+}
+
+/* Collect operands and operations of chain */
+static void gather_chain(struct planner *p, u8 i, u8 op, u8 *operands, u8 *nops, u8 *spares, u8 *nspares)
+{
+  u8 k, kid;
+
+  for(k=0; k<p->tree[i].nkids; k++)
+  {
+    kid = p->tree[i].kids[k];
+
+    if(p->nodes[kid].op == op)
+    {
+      gather_chain(p, kid, op, operands, nops, spares, nspares);
+      spares[(*nspares)++] = kid;
+    }
+    else
+    {
+      operands[(*nops)++] = kid;
+    }
+  }
+}
+
+/* Count temporary structures needed by node, commutative operands are swapped to need less */
+/* Result structure is allocated while operands are alive */
+static void set_need(struct planner *p, u8 i, u8 commutative)
+{
+  struct plan_node *node = &p->tree[i];
+  struct plan_node *a, *b;
+  u8 tmp_a, tmp_b, need_ab, need_ba, swap;
+
+  switch(node->nkids)
+  {
+    case 0:
+      node->need = 0;
+      return;
+
+    case 1:
+      a     = &p->tree[node->kids[0]];
+      tmp_a = a->nkids ? 1 : 0;
+      node->need = max(a->need, (u8)(tmp_a + 1));
+      return;
+
+    default:
+      a     = &p->tree[node->kids[0]];
+      b     = &p->tree[node->kids[1]];
+      tmp_a = a->nkids ? 1 : 0;
+      tmp_b = b->nkids ? 1 : 0;
+
+      need_ab = max(max(a->need, (u8)(tmp_a + b->need)), (u8)(tmp_a + tmp_b + 1));
+      need_ba = max(max(b->need, (u8)(tmp_b + a->need)), (u8)(tmp_a + tmp_b + 1));
+
+      if(commutative && need_ba < need_ab)
+      {
+        swap          = node->kids[0];
+        node->kids[0] = node->kids[1];
+        node->kids[1] = swap;
+        node->need    = need_ba;
+        return;
+      }
+      node->need = need_ab;
+      return;
+  }
+}
+
+/* Emit nodes in postfix execution order */
+static void emit_tree(struct planner *p, u8 i)
+{
+  u8 k;
+
+  for(k=0; k<p->tree[i].nkids; k++)
+  {
+    emit_tree(p, p->tree[i].kids[k]);
+  }
+
+  p->order[p->len++] = i;
+}
@@ -0,0 +1,37 @@
+/*
+  planner.h
+        - expression planner definitions
+        - reorders AND, OR chains by known structures power
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+/* Expression execution plan */
+struct expr_plan
+{
+  u8 order[SPU_EXPR_MAX_NODES]; // Nodes execution order
+  u32 est_power;                // Estimated power of result
+  u64 est_cost;                 // Estimated cost of plan
+  u64 naive_cost;               // Estimated cost of nodes order as sent
+};
+
+u32 estimate_power(u8 op, u32 power_a, u32 power_b);
+int plan_expr(const struct expr_node *nodes, u8 count, u8 opts, struct expr_plan *plan);
+
+#endif /* PLANNER_H */
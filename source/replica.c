@@ -0,0 +1,615 @@
+/*
+  replica.c
+        - replicated structures
+        - reads are balanced across copies, writes go to structure and every copy
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "replica"
+
+#include <linux/slab.h>
+#include <linux/stddef.h>
+
+#include "spu.h"
+#include "log.h"
+#include "cmdexec.h"
+#include "pcidrv.h"
+#include "gsidresolver.h"
+#include "batchexec.h"
+#include "snapshot.h"
+#include "partition.h"
+#include "wbuffer.h"
+#include "values.h"
+#include "replica.h"
+
+/* Replicated structure */
+struct replica
+{
+  gsid_t gsid;                  // Replicated structure, zero for free slot
+  u8 count;                     // Copies number
+  gsid_t copies[SPU_STR_NUM-1]; // Copies structures
+  u8 next;                      // Structure of next read - 0 for structure itself, i for copy i-1
+};
+
+/* Commands of formats 4, 5 with replaced structures */
+union repl_cmd
+{
+  struct cmdfrmt_4 frmt_4;
+  struct cmdfrmt_5 frmt_5;
+};
+
+/* Replicated structures - protected by SPU commands lock */
+static struct replica repls[SPU_STR_NUM] = { { .gsid = { .cont = {0} } } };
+
+/* Command over replicated structure itself is being executed - it is not routed again */
+static u8 fanout = 0;
+
+/* Internal functions */
+static size_t read_copy(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t write_copies(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t delete_copies(const void *cmd_buf, struct exec_ctx *ctx);
+static size_t route_sets(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t write_batch(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t exec_repl_cmd(const void *cmd_buf, size_t size, const void **res_buf, struct exec_ctx *ctx);
+static size_t exec_self(const void *cmd_buf, size_t size, const void **res_buf, struct exec_ctx *ctx);
+static int make_copy(gsid_t gsid, gsid_t *copy, struct exec_ctx *ctx);
+static void drop_copy(struct replica *repl, u8 i, struct exec_ctx *ctx);
+static u8 same_status(int err, rslt_t rslt, const void *self_rslt);
+static u8 pick_copy(gsid_t *gsid);
+static struct replica *get_repl(gsid_t gsid);
+static struct replica *find_repl(gsid_t gsid);
+static struct replica *find_copy(gsid_t gsid);
+static void delete_str(gsid_t gsid, struct exec_ctx *ctx);
+
+/* REPL command executor - add or delete copies of structure */
+size_t execute_repl(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_14 *cmd = CMDFRMT_14(cmd_buf);
+  gsid_t zero_gsid = { .cont = {0} };
+  struct rsltfrmt_11 *rslt;
+  struct replica *repl;
+  gsid_t copy;
+  int err = 0;
+
+  LOG_DEBUG("REPL command execution for GSID" GSID_FORMAT "with %d copies", GSID_VAR(cmd->gsid), cmd->count);
+
+  if(ctx->size < sizeof(struct cmdfrmt_14) || cmd->count >= SPU_STR_NUM)
+  {
+    LOG_ERROR("Wrong REPL command size");
+    return -EINVAL;
+  }
+
+  /* Only writable SPU structures are replicated */
+  if(resolve_gsid(cmd->gsid, SRCH) <= 0 || snap_is(cmd->gsid) || find_copy(cmd->gsid))
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "could not be replicated", GSID_VAR(cmd->gsid));
+    return -ENOKEY;
+  }
+
+  /* Values kept by driver are not copied by OR */
+  if(vals_is(cmd->gsid))
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "has values kept by driver and could not be replicated", GSID_VAR(cmd->gsid));
+    return -EPERM;
+  }
+
+  /* Allocate result */
+  rslt = kzalloc(sizeof(struct rsltfrmt_11), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+
+  repl = find_repl(cmd->gsid);
+  if(!repl)
+  {
+    repl = find_repl(zero_gsid);
+    if(!repl)
+    {
+      LOG_ERROR("No free replicated structure slot");
+      kfree(rslt);
+      return -ENOKEY;
+    }
+    repl->gsid  = cmd->gsid;
+    repl->count = 0;
+  }
+  *res_buf = rslt;
+
+  /* Extra copies leave replica first, so DELS is not rejected */
+  while(repl->count > cmd->count)
+  {
+    delete_str(repl->copies[--repl->count], ctx);
+  }
+
+  while(repl->count < cmd->count && !err)
+  {
+    err = make_copy(repl->gsid, &copy, ctx);
+    if(!err)
+    {
+      repl->copies[repl->count++] = copy;
+    }
+  }
+
+  /* Result generation */
+  repl->next  = 0;
+  rslt->rslt  = err ? ERR : OK;
+  rslt->count = repl->count;
+  rslt->power = get_gsid_power(repl->gsid);
+
+  if(!repl->count)
+  {
+    repl->gsid = zero_gsid;
+  }
+
+  LOG_DEBUG("REPL GSID" GSID_FORMAT "has %d copies", GSID_VAR(cmd->gsid), rslt->count);
+  return sizeof(struct rsltfrmt_11);
+}
+
+/* Execute command using replicated structures, 0 if command goes on as sent */
+size_t route_repl(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  if(fanout)
+  {
+    return 0;
+  }
+
+  switch(PURE_CMD(CMDFRMT_0(cmd_buf)->cmd))
+  {
+    case SRCH:
+    case MIN:
+    case MAX:
+    case NEXT:
+    case PREV:
+    case NSM:
+    case NGR:
+      return read_copy(cmd_buf, res_buf, ctx);
+
+    case INS:
+    case DEL:
+      return write_copies(cmd_buf, res_buf, ctx);
+
+    case DELS:
+      return delete_copies(cmd_buf, ctx);
+
+    CASE_CMDFRMT_4:
+    CASE_CMDFRMT_5:
+      return route_sets(cmd_buf, res_buf, ctx);
+
+    case BTCH:
+      return write_batch(cmd_buf, res_buf, ctx);
+
+    default:
+      return 0;
+  }
+}
+
+/* Check if GSID is replicated structure */
+u8 repl_is(gsid_t gsid)
+{
+  return get_repl(gsid) != NULL;
+}
+
+/* SRCH, MIN, MAX, NEXT, PREV, NSM, NGR - read from the next copy in turn */
+static size_t read_copy(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 cmd;
+  size_t size = cmd_size(CMDFRMT_0(cmd_buf)->cmd);
+
+  /* Format 3 is the beginning of format 2 */
+  memcpy(&cmd, cmd_buf, size);
+  if(!pick_copy(&cmd.gsid))
+  {
+    return 0;
+  }
+
+  return exec_repl_cmd(&cmd, size, res_buf, ctx);
+}
+
+/* INS, DEL - structure itself first, then every copy */
+static size_t write_copies(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct replica *repl = get_repl(CMDFRMT_1(cmd_buf)->gsid);
+  struct cmdfrmt_1 cmd;
+  struct rsltfrmt_2 rslt;
+  size_t size = cmd_size(CMDFRMT_0(cmd_buf)->cmd);
+  size_t rslt_size;
+  int err;
+  u8 i;
+
+  if(!repl)
+  {
+    return 0;
+  }
+
+  rslt_size = exec_self(cmd_buf, size, res_buf, ctx);
+  if((ssize_t)rslt_size <= 0)
+  {
+    return rslt_size;
+  }
+
+  /* Copy failed to take the write or got other status is not a replica any more */
+  memcpy(&cmd, cmd_buf, size);
+  for(i=repl->count; i-- > 0; )
+  {
+    cmd.gsid = repl->copies[i];
+    err = execute_int_cmd(&cmd, size, &rslt, sizeof(rslt), ctx);
+    if(!same_status(err, rslt.rslt, *res_buf))
+    {
+      drop_copy(repl, i, ctx);
+    }
+  }
+
+  return rslt_size;
+}
+
+/* DELS - copies are deleted with structure, copy itself could not be deleted */
+static size_t delete_copies(const void *cmd_buf, struct exec_ctx *ctx)
+{
+  gsid_t gsid = CMDFRMT_3(cmd_buf)->gsid;
+  gsid_t zero_gsid = { .cont = {0} };
+  struct replica *repl = get_repl(gsid);
+
+  if(!repl)
+  {
+    if(find_copy(gsid))
+    {
+      LOG_ERROR("GSID" GSID_FORMAT "is a copy of replicated structure", GSID_VAR(gsid));
+      return -EBUSY;
+    }
+    return 0;
+  }
+
+  while(repl->count)
+  {
+    delete_str(repl->copies[--repl->count], ctx);
+  }
+  repl->gsid = zero_gsid;
+
+  LOG_DEBUG("Copies of GSID" GSID_FORMAT "deleted", GSID_VAR(gsid));
+  return 0;
+}
+
+/* AND, OR, NOT, LS, LSEQ, GR, GREQ - result is written into every copy, operands are read from copies in turn */
+static size_t route_sets(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  u8 op = PURE_CMD(CMDFRMT_0(cmd_buf)->cmd);
+  size_t size = cmd_size(op);
+  union repl_cmd cmd;
+  struct rsltfrmt_1 rslt;
+  struct replica *repl;
+  gsid_t *a, *b, *r;
+  size_t rslt_size;
+  int err;
+  u8 i;
+
+  memcpy(&cmd, cmd_buf, size);
+  switch(op)
+  {
+    CASE_CMDFRMT_4:
+      a = &cmd.frmt_4.gsid_a;
+      b = &cmd.frmt_4.gsid_b;
+      r = &cmd.frmt_4.gsid_r;
+      break;
+
+    default:
+      a = &cmd.frmt_5.gsid_a;
+      b = NULL;
+      r = &cmd.frmt_5.gsid_r;
+      break;
+  }
+
+  repl = get_repl(*r);
+  if(repl)
+  {
+    rslt_size = exec_self(cmd_buf, size, res_buf, ctx);
+    if((ssize_t)rslt_size <= 0)
+    {
+      return rslt_size;
+    }
+
+    for(i=repl->count; i-- > 0; )
+    {
+      *r  = repl->copies[i];
+      err = execute_int_cmd(&cmd, size, &rslt, sizeof(rslt), ctx);
+      if(!same_status(err, rslt.rslt, *res_buf))
+      {
+        drop_copy(repl, i, ctx);
+      }
+    }
+
+    return rslt_size;
+  }
+
+  /* Both operands are picked, so pick results are not short-circuited */
+  if(!(pick_copy(a) | (b ? pick_copy(b) : 0)))
+  {
+    return 0;
+  }
+
+  return exec_repl_cmd(&cmd, size, res_buf, ctx);
+}
+
+/* BTCH - batch over structures themselves, then batch of copy commands for every copy number */
+static size_t write_batch(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_1 *cmds = CMDFRMT_8(cmd_buf)->cmds;
+  u32 count = CMDFRMT_8(cmd_buf)->count;
+  struct cmdfrmt_1 *copy_cmds;
+  struct rsltfrmt_5 *rslt;
+  rslt_t *self_status, *want, *status;
+  struct replica *repl;
+  u32 i, n, done, sent;
+  u8 copies = 0, k;
+  int err;
+
+  /* Wrong batch is reported by batch executor */
+  if(count == 0 || count > SPU_BATCH_MAX_CMDS ||
+     ctx->size < offsetof(struct cmdfrmt_8, cmds) + count*sizeof(struct cmdfrmt_1))
+  {
+    return 0;
+  }
+
+  for(i=0; i<count; i++)
+  {
+    repl = get_repl(part_route(cmds[i].gsid, &cmds[i].key));
+    if(repl && repl->count > copies)
+    {
+      copies = repl->count;
+    }
+  }
+
+  if(!copies)
+  {
+    return 0;
+  }
+
+  /* SPU should see every buffered mutation before batch, as BTCH without copies does */
+  err = wbuf_flush_all(ctx);
+  if(err)
+  {
+    return err;
+  }
+
+  rslt      = kzalloc(sizeof(struct rsltfrmt_5), GFP_KERNEL);
+  copy_cmds = kmalloc(count*(sizeof(struct cmdfrmt_1) + 3*sizeof(rslt_t)), GFP_KERNEL);
+  if(!rslt || !copy_cmds)
+  {
+    LOG_ERROR("Could not allocate copies batch");
+    kfree(rslt);
+    kfree(copy_cmds);
+    return -ENOMEM;
+  }
+  self_status = (rslt_t *)(copy_cmds + count);
+  want        = self_status + count;
+  status      = want + count;
+
+  /* Structures themselves first, status of every command is kept for copies */
+  err = run_batch(cmds, count, &done, self_status, ctx);
+  rslt->rslt  = err ? ERR : OK;
+  rslt->count = done;
+  *res_buf = rslt;
+
+  /* Copies are dropped from the last one, so lower copy numbers are kept */
+  /* Copy takes only commands taken by structure itself */
+  for(k=copies; k-- > 0; )
+  {
+    for(i=0, n=0; i<done; i++)
+    {
+      repl = get_repl(part_route(cmds[i].gsid, &cmds[i].key));
+      if(repl && k < repl->count)
+      {
+        copy_cmds[n]      = cmds[i];
+        copy_cmds[n].gsid = repl->copies[k];
+        want[n]           = self_status[i];
+        n++;
+      }
+    }
+
+    if(!n)
+    {
+      continue;
+    }
+
+    /* Copy missed a write or got other status than structure itself */
+    run_batch(copy_cmds, n, &sent, status, ctx);
+    for(i=0; i<n; i++)
+    {
+      if(i < sent && ERRORS(status[i]) == ERRORS(want[i]))
+      {
+        continue;
+      }
+
+      repl = find_copy(copy_cmds[i].gsid);
+      if(repl && k < repl->count && GSID_EQUAL(repl->copies[k], copy_cmds[i].gsid))
+      {
+        drop_copy(repl, k, ctx);
+      }
+    }
+  }
+
+  kfree(copy_cmds);
+  return sizeof(struct rsltfrmt_5);
+}
+
+/* Execute command over copy, result is given to caller */
+static size_t exec_repl_cmd(const void *cmd_buf, size_t size, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct exec_ctx int_ctx = *ctx;
+  size_t rslt_size;
+
+  int_ctx.size = size;
+  rslt_size = execute_cmd(cmd_buf, res_buf, &int_ctx);
+  ctx->tsc += int_ctx.tsc;
+
+  return rslt_size;
+}
+
+/* Execute command over replicated structure itself */
+static size_t exec_self(const void *cmd_buf, size_t size, const void **res_buf, struct exec_ctx *ctx)
+{
+  size_t rslt_size;
+
+  fanout    = 1;
+  rslt_size = exec_repl_cmd(cmd_buf, size, res_buf, ctx);
+  fanout    = 0;
+
+  return rslt_size;
+}
+
+/* Copy structure by OR with empty one */
+static int make_copy(gsid_t gsid, gsid_t *copy, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_4 or_cmd;
+  struct rsltfrmt_1 rslt;
+  gsid_t empty;
+  int err;
+
+  if(create_gsid(&empty) != 0)
+  {
+    return -ENOKEY;
+  }
+  if(create_gsid(copy) != 0)
+  {
+    delete_str(empty, ctx);
+    return -ENOKEY;
+  }
+
+  or_cmd = (struct cmdfrmt_4) { .cmd = OR | P_FLAG, .gsid_a = gsid, .gsid_b = empty, .gsid_r = *copy };
+  err = execute_int_cmd(&or_cmd, sizeof(or_cmd), &rslt, sizeof(rslt), ctx);
+  delete_str(empty, ctx);
+
+  if(err)
+  {
+    LOG_ERROR("Structure could not be copied");
+    delete_str(*copy, ctx);
+  }
+
+  return err;
+}
+
+/* Delete copy which missed a write */
+static void drop_copy(struct replica *repl, u8 i, struct exec_ctx *ctx)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+  gsid_t copy = repl->copies[i];
+
+  LOG_WARNING("Copy GSID" GSID_FORMAT "missed a write and is dropped", GSID_VAR(copy));
+
+  for(; i+1<repl->count; i++)
+  {
+    repl->copies[i] = repl->copies[i+1];
+  }
+  repl->count--;
+  repl->next = 0;
+
+  if(!repl->count)
+  {
+    repl->gsid = zero_gsid;
+  }
+
+  delete_str(copy, ctx);
+}
+
+/* Check that copy took the write with the same status as structure itself */
+static u8 same_status(int err, rslt_t rslt, const void *self_rslt)
+{
+  /* Result is copied for error status too */
+  if(err && err != -EIO)
+  {
+    return 0;
+  }
+
+  return ERRORS(rslt) == ERRORS(RSLTFRMT_0(self_rslt)->rslt);
+}
+
+/* Replace replicated structure by the next one in turn, 0 if structure itself is taken */
+static u8 pick_copy(gsid_t *gsid)
+{
+  struct replica *repl = get_repl(*gsid);
+  u8 i;
+
+  if(!repl)
+  {
+    return 0;
+  }
+
+  i = repl->next;
+  repl->next = (repl->next + 1) % (repl->count + 1);
+  if(!i)
+  {
+    return 0;
+  }
+
+  *gsid = repl->copies[i-1];
+  return 1;
+}
+
+/* Get replicated structure by GSID, NULL if GSID is not replicated */
+static struct replica *get_repl(gsid_t gsid)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+
+  return GSID_EQUAL(gsid, zero_gsid) ? NULL : find_repl(gsid);
+}
+
+/* Get replicated structure slot by GSID, zero GSID gives free slot */
+static struct replica *find_repl(gsid_t gsid)
+{
+  u8 i;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    if(GSID_EQUAL(repls[i].gsid, gsid))
+    {
+      return &repls[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Get replicated structure having structure as copy */
+static struct replica *find_copy(gsid_t gsid)
+{
+  u8 i, j;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    for(j=0; j<repls[i].count; j++)
+    {
+      if(GSID_EQUAL(repls[i].copies[j], gsid))
+      {
+        return &repls[i];
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* Delete structure made by replica executor */
+static void delete_str(gsid_t gsid, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_3 dels;
+  struct rsltfrmt_1 rslt;
+
+  dels = (struct cmdfrmt_3) { .cmd = DELS, .gsid = gsid };
+  execute_int_cmd(&dels, sizeof(dels), &rslt, sizeof(rslt), ctx);
+}
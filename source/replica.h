@@ -0,0 +1,29 @@
+/*
+  replica.h
+        - replicated structures definitions
+        - read copies of structures kept in other SPU structures
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+size_t execute_repl(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+size_t route_repl(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+u8 repl_is(gsid_t gsid);
+
+#endif /* REPLICA_H */
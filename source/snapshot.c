@@ -0,0 +1,309 @@
+/*
+  snapshot.c
+        - structure snapshots
+        - read-only copies referenced by opened files
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "snapshot"
+
+#include <linux/slab.h>
+#include <linux/list.h>
+
+#include "spu.h"
+#include "log.h"
+#include "cmdexec.h"
+#include "gsidresolver.h"
+#include "values.h"
+#include "snapshot.h"
+
+/* Snapshot structure */
+struct snapshot
+{
+  gsid_t gsid; // Zero for free slot
+  u32 refs;    // Opened files references, snapshot is deleted when 0
+};
+
+/* Reference of opened file to snapshot */
+struct snap_ref
+{
+  struct list_head list;
+  const void *owner;
+  gsid_t gsid;
+};
+
+/* Snapshots and references - protected by SPU commands lock */
+static struct snapshot snaps[SPU_STR_NUM] = { { .gsid = { .cont = {0} } } };
+static LIST_HEAD(snap_refs);
+
+/* Internal functions */
+static struct snapshot *find_snap(gsid_t gsid);
+static void delete_str(gsid_t gsid, struct exec_ctx *ctx);
+
+/* SNAP command executor - OR of structure with empty one into new read-only structure */
+size_t execute_snap(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_4 or_cmd;
+  struct rsltfrmt_1 rslt;
+  struct snapshot *snap;
+  struct snap_ref *ref;
+  gsid_t zero_gsid = { .cont = {0} };
+  gsid_t empty;
+  int err;
+
+  LOG_DEBUG("SNAP command execution for GSID" GSID_FORMAT, GSID_VAR(CMDFRMT_3(cmd_buf)->gsid));
+
+  if(ctx->size < sizeof(struct cmdfrmt_3) || ctx->size < sizeof(struct rsltfrmt_9))
+  {
+    LOG_ERROR("Wrong SNAP command size");
+    return -EINVAL;
+  }
+
+  /* Snapshot is referenced by file which created it */
+  if(!ctx->owner)
+  {
+    LOG_ERROR("SNAP command has no owner file");
+    return -EINVAL;
+  }
+
+  /* Values kept by driver are not copied by OR */
+  if(vals_is(CMDFRMT_3(cmd_buf)->gsid))
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "has values kept by driver and could not be snapshotted", GSID_VAR(CMDFRMT_3(cmd_buf)->gsid));
+    return -EPERM;
+  }
+
+  /* Structures of released snapshots are reused */
+  snap_collect(ctx);
+
+  snap = find_snap(zero_gsid);
+  if(!snap)
+  {
+    LOG_ERROR("No free snapshot slot");
+    return -ENOKEY;
+  }
+
+  ref = kzalloc(sizeof(struct snap_ref), GFP_KERNEL);
+  if(!ref)
+  {
+    LOG_ERROR("Could not allocate snapshot reference");
+    return -ENOMEM;
+  }
+
+  /* Allocate result */
+  *res_buf = kzalloc(sizeof(struct rsltfrmt_9), GFP_KERNEL);
+  if(!(*res_buf))
+  {
+    LOG_ERROR("Could not allocate result structure");
+    kfree(ref);
+    return -ENOMEM;
+  }
+  RSLTFRMT_9(*res_buf)->rslt = ERR;
+
+  /* Empty operand and snapshot structures */
+  if(create_gsid(&empty) != 0)
+  {
+    kfree(ref);
+    return sizeof(struct rsltfrmt_9);
+  }
+  if(create_gsid(&ref->gsid) != 0)
+  {
+    delete_str(empty, ctx);
+    kfree(ref);
+    return sizeof(struct rsltfrmt_9);
+  }
+
+  or_cmd = (struct cmdfrmt_4) { .cmd = OR | P_FLAG, .gsid_a = CMDFRMT_3(cmd_buf)->gsid, .gsid_b = empty, .gsid_r = ref->gsid };
+  err = execute_int_cmd(&or_cmd, sizeof(or_cmd), &rslt, sizeof(rslt), ctx);
+  delete_str(empty, ctx);
+  if(err)
+  {
+    LOG_ERROR("Structure could not be copied into snapshot");
+    delete_str(ref->gsid, ctx);
+    kfree(ref);
+    return sizeof(struct rsltfrmt_9); // ERR result code already in result structure
+  }
+
+  /* Snapshot is registered only when copied, so copy itself is not read-only */
+  snap->gsid  = ref->gsid;
+  snap->refs  = 1;
+  ref->owner  = ctx->owner;
+  list_add(&ref->list, &snap_refs);
+
+  /* Result generation */
+  RSLTFRMT_9(*res_buf)->rslt  = OK;
+  RSLTFRMT_9(*res_buf)->gsid  = ref->gsid;
+  RSLTFRMT_9(*res_buf)->power = rslt.power;
+
+  LOG_DEBUG("SNAP return snapshot GSID" GSID_FORMAT "with power %u", GSID_VAR(ref->gsid), rslt.power);
+  return sizeof(struct rsltfrmt_9);
+}
+
+/* Check that command does not change snapshot */
+int snap_check(const void *cmd_buf)
+{
+  gsid_t gsid;
+
+  switch(PURE_CMD(CMDFRMT_0(cmd_buf)->cmd))
+  {
+    /* Changed structure GSID is right after command in formats 1, 2, 3 */
+    case INS:
+    case DEL:
+    case DELS:
+      gsid = CMDFRMT_3(cmd_buf)->gsid;
+      break;
+
+    CASE_CMDFRMT_4:
+      gsid = CMDFRMT_4(cmd_buf)->gsid_r;
+      break;
+
+    CASE_CMDFRMT_5:
+      gsid = CMDFRMT_5(cmd_buf)->gsid_r;
+      break;
+
+    default:
+      return 0;
+  }
+
+  if(snap_is(gsid))
+  {
+    LOG_ERROR("Snapshot GSID" GSID_FORMAT "is read-only", GSID_VAR(gsid));
+    return -EROFS;
+  }
+
+  return 0;
+}
+
+/* Check if GSID is snapshot */
+u8 snap_is(gsid_t gsid)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+
+  return !GSID_EQUAL(gsid, zero_gsid) && find_snap(gsid) != NULL;
+}
+
+/* Take one more reference of snapshot by opened file */
+int snap_get(gsid_t gsid, const void *owner)
+{
+  struct snapshot *snap = snap_is(gsid) ? find_snap(gsid) : NULL;
+  struct snap_ref *ref;
+
+  if(!snap || !snap->refs)
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "is not a snapshot", GSID_VAR(gsid));
+    return -ENOKEY;
+  }
+
+  ref = kzalloc(sizeof(struct snap_ref), GFP_KERNEL);
+  if(!ref)
+  {
+    LOG_ERROR("Could not allocate snapshot reference");
+    return -ENOMEM;
+  }
+  ref->owner = owner;
+  ref->gsid  = gsid;
+  list_add(&ref->list, &snap_refs);
+  snap->refs++;
+
+  LOG_DEBUG("Snapshot GSID" GSID_FORMAT "has %u references", GSID_VAR(gsid), snap->refs);
+  return 0;
+}
+
+/* Drop one reference of snapshot by opened file, structure is deleted by snap_collect */
+int snap_put(gsid_t gsid, const void *owner)
+{
+  struct snap_ref *ref;
+
+  list_for_each_entry(ref, &snap_refs, list)
+  {
+    if(ref->owner == owner && GSID_EQUAL(ref->gsid, gsid))
+    {
+      find_snap(gsid)->refs--;
+      list_del(&ref->list);
+      kfree(ref);
+      LOG_DEBUG("Snapshot GSID" GSID_FORMAT "reference dropped", GSID_VAR(gsid));
+      return 0;
+    }
+  }
+
+  LOG_ERROR("GSID" GSID_FORMAT "is not a snapshot of file", GSID_VAR(gsid));
+  return -ENOKEY;
+}
+
+/* Drop every reference of closed file */
+void snap_release(const void *owner)
+{
+  struct snap_ref *ref, *tmp;
+
+  list_for_each_entry_safe(ref, tmp, &snap_refs, list)
+  {
+    if(ref->owner == owner)
+    {
+      find_snap(ref->gsid)->refs--;
+      list_del(&ref->list);
+      kfree(ref);
+    }
+  }
+}
+
+/* Delete snapshots without references */
+void snap_collect(struct exec_ctx *ctx)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+  gsid_t gsid;
+  u8 i;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    if(!GSID_EQUAL(snaps[i].gsid, zero_gsid) && !snaps[i].refs)
+    {
+      /* Slot is freed first, so DELS is not rejected as snapshot change */
+      gsid          = snaps[i].gsid;
+      snaps[i].gsid = zero_gsid;
+      delete_str(gsid, ctx);
+      LOG_DEBUG("Snapshot GSID" GSID_FORMAT "deleted", GSID_VAR(gsid));
+    }
+  }
+}
+
+/* Get snapshot slot by GSID, zero GSID gives free slot */
+static struct snapshot *find_snap(gsid_t gsid)
+{
+  u8 i;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    if(GSID_EQUAL(snaps[i].gsid, gsid))
+    {
+      return &snaps[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Delete structure made by snapshot executor */
+static void delete_str(gsid_t gsid, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_3 dels;
+  struct rsltfrmt_0 rslt;
+
+  dels = (struct cmdfrmt_3) { .cmd = DELS, .gsid = gsid };
+  execute_int_cmd(&dels, sizeof(dels), &rslt, sizeof(rslt), ctx);
+}
@@ -0,0 +1,33 @@
+/*
+  snapshot.h
+        - structure snapshots definitions
+        - read-only copies referenced by opened files
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+size_t execute_snap(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+int snap_check(const void *cmd_buf);
+u8 snap_is(gsid_t gsid);
+int snap_get(gsid_t gsid, const void *owner);
+int snap_put(gsid_t gsid, const void *owner);
+void snap_release(const void *owner);
+void snap_collect(struct exec_ctx *ctx);
+
+#endif /* SNAPSHOT_H */
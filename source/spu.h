@@ -22,6 +22,8 @@
 #ifndef SPU_H
 #define SPU_H
 
+/* Character device control codes definitions */
+#include <linux/ioctl.h>
 
 
 /* Use namespace only when compiling C++ */
@@ -35,8 +37,9 @@ namespace SPU
 /***************************************
   Used base types
 ***************************************/
-typedef unsigned int  u32;
-typedef unsigned char u8;
+typedef unsigned long long u64;
+typedef unsigned int       u32;
+typedef unsigned char      u8;
 
 
 
@@ -76,6 +79,42 @@ typedef unsigned char u8;
 /* Number of structures in SPU memory */
 #define SPU_STR_NUM 7
 
+/* Maximum number of nodes in one expression tree */
+#define SPU_EXPR_MAX_NODES 16
+
+/* Maximum number of commands in one batch */
+#define SPU_BATCH_MAX_CMDS 4096
+
+/* Maximum number of keys in one MGET */
+#define SPU_MGET_MAX_KEYS 4096
+
+/* Maximum number of pairs in one TOPK */
+#define SPU_TOPK_MAX_PAIRS 4096
+
+/* Structure handles of one opened file */
+#define SPU_HNDL_MAX 64
+
+/* Default time file waits busy SPU for before command fails with -ETIMEDOUT */
+#define SPU_DEADLINE_MS 1000
+
+/* Longest time file without deadline polls SPU for, SPU is held all this time */
+#define SPU_POLL_MAX_MS 60000
+
+/* Bytes of results kept for one file between writev and readv */
+#define SPU_RSLT_QUEUE_SIZE 65536
+
+/* Write-behind buffer - keys of one structure kept before flush and flush delay */
+#define SPU_WBUF_MAX_KEYS  4096
+#define SPU_WBUF_FLUSH_MS  10
+
+/* Command trace - bytes kept per CPU and command bytes kept in one record */
+#define SPU_TRACE_RING_SIZE (1<<20)
+#define SPU_TRACE_CMD_MAX   (SPU_TRACE_RING_SIZE/16)
+
+/* Value store - bytes of one value and bytes of all value arenas */
+#define SPU_VALS_MAX_LEN   (1<<16)
+#define SPU_VALS_MAX_BYTES (64<<20)
+
 
 
 /***************************************
@@ -102,7 +141,18 @@ enum cmd
   NEXT = 0x10, // Next key-value pair by key
   PREV = 0x11, // Previous key-value pair by key
   NSM  = 0x12, // Next smaller key-value pair by key
-  NGR  = 0x13  // Next greater key-value pair by key
+  NGR  = 0x13, // Next greater key-value pair by key
+  EXPR = 0x14, // Execute expression tree of AND, OR, NOT, LS, LSEQ, GR, GREQ special command (not from SPU)
+  MISD = 0x15, // Execute SRCH, MIN, MAX, NEXT, PREV, NSM, NGR over several structures special command (not from SPU)
+  BTCH = 0x16, // Execute batch of INS, DEL with suspended queue special command (not from SPU)
+  MGET = 0x17, // Execute SRCH, NEXT, PREV, NSM, NGR for many keys of one structure special command (not from SPU)
+  AGGR = 0x18, // Aggregate keys or values over key range special command (not from SPU)
+  TOPK = 0x19, // Get several first or last pairs by MIN, NEXT or MAX, PREV special command (not from SPU)
+  SNAP = 0x1A, // Copy structure into read-only snapshot special command (not from SPU)
+  HNDL = 0x1B, // Execute command of formats 1-5 or SNAP over file structure handles special command (not from SPU)
+  PART = 0x1C, // Create or split logical structure partitioned by key ranges special command (not from SPU)
+  REPL = 0x1D, // Set number of read replicas of structure special command (not from SPU)
+  VALS = 0x1E  // Execute INS, DEL, SRCH, MIN, MAX, NEXT, PREV, NSM, NGR with values kept by driver special command (not from SPU)
 }; /* enum cmd */
 
 /* SPU command flags */
@@ -144,6 +194,57 @@ enum rslt_mask
   ERRORS_MASK = 0x0E
 }; /* enum rslt_mask */
 
+/* Expression tree node kinds - others are operation commands */
+enum expr_node_kind
+{
+  EXPR_LEAF = 0x00 // Leaf node - structure given by GSID
+}; /* enum expr_node_kind */
+
+/* Range aggregate functions, values are taken as unsigned integers of lower 64 bits */
+enum aggr_func
+{
+  AGGR_COUNT = 0x00, // Number of keys
+  AGGR_SUM   = 0x01, // Sum of values modulo 2^64
+  AGGR_MIN   = 0x02, // Minimal value
+  AGGR_MAX   = 0x03  // Maximal value
+}; /* enum aggr_func */
+
+/* Top-K options */
+enum topk_opt
+{
+  TOPK_NO_OPTS  = 0x00, // K smallest keys from the first one
+  TOPK_LAST_OPT = 0x01, // K largest keys from the last one
+  TOPK_FROM_OPT = 0x02  // Start after given key (next K after key for pagination)
+}; /* enum topk_opt */
+
+/* Expression options */
+enum expr_opt
+{
+  EXPR_NO_OPTS  = 0x00, // Execute nodes in given order
+  EXPR_PLAN_OPT = 0x01  // Reorder AND, OR chains by known structures power
+}; /* enum expr_opt */
+
+/* Structure handle flags */
+enum hndl_flag
+{
+  HNDL_NO_FLAGS  = 0x00, // Structure is kept when handle is closed
+  HNDL_TEMP_FLAG = 0x01  // Structure is deleted when handle or file is closed
+}; /* enum hndl_flag */
+
+/* Partitioned structure operations */
+enum part_op
+{
+  PART_CREATE_OP = 0x00, // Join existing structures into new logical structure
+  PART_SPLIT_OP  = 0x01  // Split partition of logical structure at key
+}; /* enum part_op */
+
+/* Character device file options */
+enum file_opt
+{
+  NO_OPTS = 0x00, // No options
+  TSC_OPT = 0x01  // Add device cycles trailer after every result
+}; /* enum file_opt */
+
 
 
 /***************************************
@@ -251,7 +352,7 @@ struct cmdfrmt_2
   spu_key_t key;
 };
 
-/* Command format 3 - DELS, MIN, MAX */
+/* Command format 3 - DELS, MIN, MAX, SNAP */
 struct cmdfrmt_3
 {
   cmd_t cmd;
@@ -276,6 +377,69 @@ struct cmdfrmt_5
   spu_key_t key;
 };
 
+/* Expression tree node */
+/* AND, OR, NOT pop B and A operands, LS, LSEQ, GR, GREQ pop A operand */
+struct expr_node
+{
+  cmd_t op;      // EXPR_LEAF or operation command
+  gsid_t gsid;   // Leaf structure GSID
+  spu_key_t key; // Slice key for LS, LSEQ, GR, GREQ
+};
+
+/* Command format 6 - EXPR */
+/* Nodes are in postfix order, only first count nodes are sent */
+struct cmdfrmt_6
+{
+  cmd_t cmd;
+  u8 count;
+  u8 opts; // See enum expr_opt
+  struct expr_node nodes[SPU_EXPR_MAX_NODES];
+};
+
+/* Command format 7 - MISD */
+/* Only first count GSIDs are used, key is ignored by MIN and MAX */
+struct cmdfrmt_7
+{
+  cmd_t cmd;
+  cmd_t op; // SRCH, MIN, MAX, NEXT, PREV, NSM, NGR
+  u8 count;
+  gsid_t gsids[SPU_STR_NUM];
+  spu_key_t key;
+};
+
+
+
+/* Command format 8 - BTCH */
+/* Commands are INS or DEL without P flag, DEL ignores value */
+struct cmdfrmt_8
+{
+  cmd_t cmd;
+  u32 count;
+  struct cmdfrmt_1 cmds[];
+};
+
+/* Command format 9 - MGET */
+/* Command buffer size should fit result, see SPU_MGET_RSLT_SIZE */
+struct cmdfrmt_9
+{
+  cmd_t cmd;
+  cmd_t op; // SRCH, NEXT, PREV, NSM, NGR
+  u32 count;
+  gsid_t gsid;
+  spu_key_t keys[];
+};
+
+/* Command format 10 - AGGR */
+/* Range is [from, to) */
+struct cmdfrmt_10
+{
+  cmd_t cmd;
+  u8 func; // See enum aggr_func
+  gsid_t gsid;
+  spu_key_t from;
+  spu_key_t to;
+};
+
 
 
 /***************************************
@@ -305,6 +469,187 @@ struct rsltfrmt_2
   u32 power;
 };
 
+/* Result format 3 - EXPR */
+/* Result structure is owned by caller and should be deleted with DELS */
+/* Cost is sum of estimated operands power of all operations */
+struct rsltfrmt_3
+{
+  rslt_t rslt;
+  gsid_t gsid;
+  u32 power;
+  u32 est_power;                // Estimated power of result
+  u64 est_cost;                 // Estimated cost of executed plan
+  u64 naive_cost;               // Estimated cost of nodes order as sent
+  u8 plan[SPU_EXPR_MAX_NODES];  // Executed nodes order - indexes of sent nodes
+};
+
+/* Result of one structure in MISD command */
+struct misd_item
+{
+  gsid_t gsid;
+  struct rsltfrmt_2 rslt;
+};
+
+/* Result format 4 - MISD */
+/* Items are in order of sent GSIDs, command buffer size should fit result */
+struct rsltfrmt_4
+{
+  rslt_t rslt;
+  u8 count;
+  u8 misd; // 1 if executed in parallel, 0 if executed one by one
+  struct misd_item items[SPU_STR_NUM];
+};
+
+/* Result format 5 - BTCH */
+struct rsltfrmt_5
+{
+  rslt_t rslt;
+  u32 count; // Commands sent to SPU
+};
+
+/* Result format 6 - MGET */
+/* Items are in order of sent keys, bit i of found is set if item i has no error status */
+struct rsltfrmt_6
+{
+  rslt_t rslt;
+  u32 count;
+  u32 found_count;
+  u32 found[SPU_MGET_MAX_KEYS/32];
+  struct rsltfrmt_2 items[];
+};
+
+/* Command format 11 - TOPK */
+/* Command buffer size should fit result, see SPU_TOPK_RSLT_SIZE */
+struct cmdfrmt_11
+{
+  cmd_t cmd;
+  u8 opts;   // See enum topk_opt
+  u32 count; // K
+  gsid_t gsid;
+  spu_key_t key; // Start key, used with TOPK_FROM_OPT only
+};
+
+/* Result format 7 - AGGR */
+struct rsltfrmt_7
+{
+  rslt_t rslt;
+  u8 sliced;  // 1 if counted by slices, 0 if range was scanned
+  u32 count;  // Keys in range
+  u64 value;  // Aggregate, equals to count for AGGR_COUNT and 0 for empty range
+};
+
+/* Key-value pair of TOPK */
+struct spu_pair
+{
+  spu_key_t key;
+  val_t val;
+};
+
+/* Result format 8 - TOPK */
+/* Pairs are in order of walk: ascending keys or descending with TOPK_LAST_OPT */
+struct rsltfrmt_8
+{
+  rslt_t rslt;
+  u32 count; // Pairs found, less than K if structure ended
+  u32 power;
+  struct spu_pair pairs[];
+};
+
+/* Command format 12 - HNDL */
+/* Structures are given by handles of file, fields of inner command format are used */
+struct cmdfrmt_12
+{
+  cmd_t cmd;
+  cmd_t op;    // Command of formats 1-5 or SNAP with flags
+  u8 hndl_a;   // Structure A (the only one for formats 1, 2, 3)
+  u8 hndl_b;   // Structure B of format 4
+  u8 hndl_r;   // Result structure of formats 4, 5
+  spu_key_t key;
+  val_t val;
+};
+
+/* Result format 9 - SNAP */
+/* Snapshot is read-only and is deleted when every file referencing it is closed */
+struct rsltfrmt_9
+{
+  rslt_t rslt;
+  gsid_t gsid; // Snapshot structure
+  u32 power;
+};
+
+/* Command format 13 - PART */
+/* PART_CREATE_OP uses gsids and bounds, PART_SPLIT_OP uses gsid and key */
+struct cmdfrmt_13
+{
+  cmd_t cmd;
+  u8 op;                         // See enum part_op
+  u8 count;                      // Partitions of created structure
+  gsid_t gsid;                   // Logical structure to split
+  gsid_t gsids[SPU_STR_NUM];     // Partitions of created structure in keys order
+  spu_key_t bounds[SPU_STR_NUM]; // Lowest key of every partition, the first one is ignored
+  spu_key_t key;                 // Lowest key of new partition made by split
+};
+
+/* Result format 10 - PART */
+struct rsltfrmt_10
+{
+  rslt_t rslt;
+  gsid_t gsid; // Logical structure
+  u8 count;    // Partitions of logical structure
+  u32 power;   // Sum of partitions power
+};
+
+/* Command format 14 - REPL */
+/* Copies are added or deleted until structure has count of them, 0 drops replication */
+struct cmdfrmt_14
+{
+  cmd_t cmd;
+  u8 count; // Copies besides structure itself
+  gsid_t gsid;
+};
+
+/* Result format 11 - REPL */
+struct rsltfrmt_11
+{
+  rslt_t rslt;
+  u8 count;  // Copies made
+  u32 power;
+};
+
+/* Command format 15 - VALS */
+/* SPU value of pair is handle of value kept by driver, command buffer size should fit result, see SPU_VALS_RSLT_SIZE */
+struct cmdfrmt_15
+{
+  cmd_t cmd;
+  cmd_t op;    // INS, DEL, SRCH, MIN, MAX, NEXT, PREV, NSM, NGR
+  gsid_t gsid;
+  spu_key_t key;
+  u32 len;     // Value bytes of INS, value bytes room in result of others
+  u8 val[];
+};
+
+/* Result format 12 - VALS */
+/* Value is cut to room given by command, len is full value length */
+struct rsltfrmt_12
+{
+  rslt_t rslt;
+  spu_key_t key;
+  u32 len;
+  u32 power;
+  u8 val[];
+};
+
+/* MGET command and result buffer sizes */
+#define SPU_MGET_CMD_SIZE(count)  ( sizeof(struct cmdfrmt_9) + (count)*sizeof(spu_key_t) )
+#define SPU_MGET_RSLT_SIZE(count) ( sizeof(struct rsltfrmt_6) + (count)*sizeof(struct rsltfrmt_2) )
+
+/* TOPK result buffer size */
+#define SPU_TOPK_RSLT_SIZE(count) ( sizeof(struct rsltfrmt_8) + (count)*sizeof(struct spu_pair) )
+
+/* VALS command and result buffer sizes */
+#define SPU_VALS_CMD_SIZE(len)  ( sizeof(struct cmdfrmt_15) + (len) )
+#define SPU_VALS_RSLT_SIZE(len) ( sizeof(struct rsltfrmt_12) + (len) )
+
 
 
 /***************************************
@@ -314,12 +659,160 @@ struct rsltfrmt_2
 typedef struct cmdfrmt_0 adds_cmd_t;
 typedef struct cmdfrmt_1 ins_cmd_t;
 typedef struct cmdfrmt_2 srch_cmd_t, del_cmd_t, next_cmd_t, prev_cmd_t, nsm_cmd_t, ngr_cmd_t;
-typedef struct cmdfrmt_3 dels_cmd_t, min_cmd_t, max_cmd_t;
+typedef struct cmdfrmt_3 dels_cmd_t, min_cmd_t, max_cmd_t, snap_cmd_t;
 typedef struct cmdfrmt_4 and_cmd_t, or_cmd_t, not_cmd_t;
 typedef struct cmdfrmt_5 ls_cmd_t, lseq_cmd_t, gr_cmd_t, greq_cmd_t;
+typedef struct cmdfrmt_6 expr_cmd_t;
+typedef struct cmdfrmt_7 misd_cmd_t;
+typedef struct cmdfrmt_8 btch_cmd_t;
+typedef struct cmdfrmt_9 mget_cmd_t;
+typedef struct cmdfrmt_10 aggr_cmd_t;
+typedef struct cmdfrmt_11 topk_cmd_t;
+typedef struct cmdfrmt_12 hndl_cmd_t;
+typedef struct cmdfrmt_13 part_cmd_t;
+typedef struct cmdfrmt_14 repl_cmd_t;
+typedef struct cmdfrmt_15 vals_cmd_t;
+typedef struct expr_node expr_node_t;
 typedef struct rsltfrmt_0 adds_rslt_t;
 typedef struct rsltfrmt_1 dels_rslt_t, ins_rslt_t, and_rslt_t, or_rslt_t, not_rslt_t, ls_rslt_t, lseq_rslt_t, gr_rslt_t, greq_rslt_t;
 typedef struct rsltfrmt_2 srch_rslt_t, del_rslt_t, min_rslt_t, max_rslt_t, next_rslt_t, prev_rslt_t, nsm_rslt_t, ngr_rslt_t;
+typedef struct rsltfrmt_3 expr_rslt_t;
+typedef struct rsltfrmt_4 misd_rslt_t;
+typedef struct rsltfrmt_5 btch_rslt_t;
+typedef struct rsltfrmt_6 mget_rslt_t;
+typedef struct rsltfrmt_7 aggr_rslt_t;
+typedef struct rsltfrmt_8 topk_rslt_t;
+typedef struct rsltfrmt_9 snap_rslt_t;
+typedef struct rsltfrmt_10 part_rslt_t;
+typedef struct rsltfrmt_11 repl_rslt_t;
+typedef struct rsltfrmt_12 vals_rslt_t;
+
+
+
+/***************************************
+  Result trailers
+***************************************/
+
+/* Device cycles trailer - placed right after result when TSC_OPT is set */
+/* Cycles from command write until driver saw SPU ready - includes driver poll period, zero without P flag */
+/* Write buffer without room for trailer gets result only */
+typedef u32 tsc_t;
+
+
+
+/***************************************
+  Driver statistics
+***************************************/
+
+/* Statistics of executed commands */
+struct spu_stats
+{
+  u64 cmds;       // Commands sent to SPU
+  u64 polled;     // Commands with P flag (finish was polled)
+  u64 errors;     // Commands failed in driver or returned with error status
+  u64 dev_cycles; // SPU TSC cycles spent by polled commands
+  u64 host_ns;    // Host time spent by polled commands in driver, ns
+  u64 busy;       // Commands waited while SPU queue was full or overflowed
+  u64 rejected;   // Commands failed with -EAGAIN or -ETIMEDOUT because SPU was busy
+  u64 recovered;  // SPU queues resets after queue error or poll timeout
+  u64 replayed;   // Idempotent commands sent again after SPU queues reset
+  u64 vals_bytes; // Memory of value arenas, bytes
+  u64 vals_live;  // Bytes of values kept in arenas
+};
+
+
+
+/***************************************
+  Status page
+***************************************/
+
+/* Structure slot of status page */
+struct spu_status_str
+{
+  gsid_t gsid; // Zero for free slot
+  u32 power;   // Last known or estimated keys number
+};
+
+/* Driver status page mapped read-only at SPU_MMAP_STATUS */
+/* seq is odd while driver updates page - reader copies page until seq is even and unchanged */
+struct spu_status
+{
+  u32 seq;
+  u8 state_0;     // Last seen STATE_REG_0
+  u8 state_1;     // Last seen STATE_REG_1
+  u8 free_strs;   // Free SPU structures
+  u8 reserved;
+  u32 wbuf_keys;  // Keys waiting in write-behind buffers
+  u32 reserved_1;
+  u64 cmds;       // Commands sent to SPU, as in struct spu_stats
+  u64 errors;     // Commands failed, as in struct spu_stats
+  struct spu_status_str strs[SPU_STR_NUM]; // SPU structures by number - 1
+};
+
+
+
+/***************************************
+  Command trace
+***************************************/
+
+/* Trace record of one command sent to character device */
+/* Followed by kept command bytes, whole record is padded to 8 bytes */
+struct spu_trace_rec
+{
+  u64 start_ns; // Host time of command start, ns
+  u64 host_ns;  // Host time spent by command in driver, ns
+  u32 tsc;      // SPU TSC cycles, 0 if was not polled
+  u32 size;     // Command size
+  u32 kept;     // Command bytes kept, less than size if command is longer than SPU_TRACE_CMD_MAX
+  u32 err;      // Driver error as positive errno, 0 if result was returned
+  rslt_t rslt;  // Result status
+  u8 cpu;
+  u8 reserved[2];
+  gsid_t gsid;  // Structure created by ADDS, EXPR, SNAP, zero for other commands
+};
+
+/* Trace record size with kept command bytes */
+#define SPU_TRACE_REC_SIZE(kept) ( (sizeof(struct spu_trace_rec) + (kept) + 7) & ~7UL )
+
+
+
+/***************************************
+  Character device control
+***************************************/
+
+/* Write-behind buffer switch of structure */
+struct spu_wbuf
+{
+  gsid_t gsid;
+  u32 enable; // Non zero to buffer INS, DEL without P flag, zero to flush and stop buffering
+};
+
+/* Structure handle opening */
+struct spu_hndl
+{
+  gsid_t gsid;
+  u32 flags; // See enum hndl_flag
+};
+
+/* ioctl magic number */
+#define SPU_IOC_MAGIC 'S'
+
+/* ioctl commands */
+#define SPU_IOC_SET_OPTS     _IOW(SPU_IOC_MAGIC, 0x01, u32)              // Set file options, see enum file_opt
+#define SPU_IOC_GET_OPTS     _IOR(SPU_IOC_MAGIC, 0x02, u32)              // Get file options
+#define SPU_IOC_GET_STATS    _IOR(SPU_IOC_MAGIC, 0x03, struct spu_stats) // Get driver statistics
+#define SPU_IOC_GET_STR      _IOW(SPU_IOC_MAGIC, 0x04, gsid_t)           // Get SPU structure number of GSID as return value
+#define SPU_IOC_SET_WBUF     _IOW(SPU_IOC_MAGIC, 0x05, struct spu_wbuf)  // Enable or disable write-behind buffer of structure
+#define SPU_IOC_GET_SNAP     _IOW(SPU_IOC_MAGIC, 0x06, gsid_t)           // Take snapshot reference by file
+#define SPU_IOC_PUT_SNAP     _IOW(SPU_IOC_MAGIC, 0x07, gsid_t)           // Drop snapshot reference of file
+#define SPU_IOC_OPEN_HNDL    _IOW(SPU_IOC_MAGIC, 0x08, struct spu_hndl)  // Open structure handle of file as return value
+#define SPU_IOC_CLOSE_HNDL   _IOW(SPU_IOC_MAGIC, 0x09, u32)              // Close structure handle of file
+#define SPU_IOC_SET_DEADLINE _IOW(SPU_IOC_MAGIC, 0x0A, u32)              // Set time to wait busy SPU for in ms, 0 to wait without limit
+#define SPU_IOC_RESET_Q      _IO(SPU_IOC_MAGIC, 0x0B)                    // Reset SPU queues keeping structures
+
+/* mmap offsets in pages */
+#define SPU_MMAP_REGS   0x0 // SPU registers page - exclusive bypass mode, driver stops own commands
+#define SPU_MMAP_STATUS 0x1 // Driver status page - read-only, see struct spu_status
 
 
 
@@ -0,0 +1,130 @@
+/*
+  status.c
+        - driver status page
+        - SPU state and structures are published for user space without syscalls
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "status page"
+
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/io.h>
+
+#include "spu.h"
+#include "log.h"
+#include "pcidrv.h"
+#include "cmdexec.h"
+#include "gsidresolver.h"
+#include "wbuffer.h"
+#include "status.h"
+
+/* Status page - written under SPU commands lock only */
+static struct spu_status *status_page = NULL;
+
+/* Allocate status page */
+int create_status(void)
+{
+  BUILD_BUG_ON(sizeof(struct spu_status) > PAGE_SIZE);
+
+  status_page = (struct spu_status *) get_zeroed_page(GFP_KERNEL);
+  if(!status_page)
+  {
+    LOG_ERROR("Could not allocate status page");
+    return -ENOMEM;
+  }
+
+  status_update();
+  return 0;
+}
+
+/* Free status page - it is not mapped when character device is destroyed */
+void destroy_status(void)
+{
+  if(status_page)
+  {
+    free_page((unsigned long) status_page);
+    status_page = NULL;
+  }
+}
+
+/* Publish current SPU state, odd sequence number marks page being written */
+void status_update(void)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+  struct spu_stats stats;
+  u8 free_strs = 0;
+  int str;
+
+  if(!status_page)
+  {
+    return;
+  }
+
+  get_stats(&stats);
+
+  WRITE_ONCE(status_page->seq, status_page->seq + 1);
+  smp_wmb();
+
+  status_page->state_0   = pci_status_last(STATE_REG_0);
+  status_page->state_1   = pci_status_last(STATE_REG_1);
+  status_page->wbuf_keys = wbuf_pending();
+  status_page->cmds      = stats.cmds;
+  status_page->errors    = stats.errors;
+
+  for(str=SPU_STR(0); str<=SPU_STR_NUM; str++)
+  {
+    status_page->strs[STR_IDX(str)].gsid  = get_str_gsid(str);
+    status_page->strs[STR_IDX(str)].power = get_str_power(str);
+    if(GSID_EQUAL(status_page->strs[STR_IDX(str)].gsid, zero_gsid))
+    {
+      free_strs++;
+    }
+  }
+  status_page->free_strs = free_strs;
+
+  smp_wmb();
+  WRITE_ONCE(status_page->seq, status_page->seq + 1);
+}
+
+/* Map status page read-only */
+int status_mmap(struct vm_area_struct *vma)
+{
+  if(!status_page)
+  {
+    return -ENODEV;
+  }
+
+  if(vma->vm_end - vma->vm_start > PAGE_SIZE)
+  {
+    LOG_ERROR("Status page mapping is longer than page");
+    return -EINVAL;
+  }
+
+  if(vma->vm_flags & VM_WRITE)
+  {
+    LOG_DEBUG("Status page could not be mapped writable");
+    return -EPERM;
+  }
+
+  vma->vm_flags &= ~VM_MAYWRITE;
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+  return remap_pfn_range(vma, vma->vm_start, virt_to_phys(status_page) >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot);
+}
@@ -0,0 +1,30 @@
+/*
+  status.h
+        - driver status page definitions
+        - page shared read-only with user space, see SPU_MMAP_STATUS
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATUS_H
+#define STATUS_H
+
+int create_status(void);
+void destroy_status(void);
+void status_update(void);
+int status_mmap(struct vm_area_struct *vma);
+
+#endif /* STATUS_H */
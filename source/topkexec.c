@@ -0,0 +1,107 @@
+/*
+  topkexec.c
+        - top-K command executor implementation
+        - MIN, NEXT or MAX, PREV chain inside driver
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "TOPK execution"
+
+#include <linux/slab.h>
+
+#include "spu.h"
+#include "log.h"
+#include "pcidrv.h"
+#include "cmdexec.h"
+#include "topkexec.h"
+#include "gsidresolver.h"
+#include "partition.h"
+
+/* TOPK command executor */
+size_t execute_topk(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_11 *cmd = CMDFRMT_11(cmd_buf);
+  u8 last = (cmd->opts & TOPK_LAST_OPT) != 0;
+  struct cmdfrmt_2 cmd_2 =
+  {
+    .gsid = cmd->gsid
+  };
+  struct rsltfrmt_8 *rslt;
+  struct rsltfrmt_2 rslt_2;
+  int err = 0;
+
+  LOG_DEBUG("TOPK command execution for %u pairs with options 0x%02x", cmd->count, cmd->opts);
+
+  /* Check command and result fit buffer */
+  if(ctx->size < sizeof(struct cmdfrmt_11) || cmd->count == 0 || cmd->count > SPU_TOPK_MAX_PAIRS ||
+     ctx->size < SPU_TOPK_RSLT_SIZE(cmd->count))
+  {
+    LOG_ERROR("Wrong TOPK command size");
+    return -EINVAL;
+  }
+
+  if(!part_is(cmd->gsid) && resolve_gsid(cmd->gsid, SRCH) <= 0)
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "was not found", GSID_VAR(cmd->gsid));
+    return -ENOKEY;
+  }
+
+  /* Allocate result */
+  rslt = kzalloc(SPU_TOPK_RSLT_SIZE(cmd->count), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+  *res_buf = rslt;
+
+  /* First pair is the edge one or the one after start key */
+  if(cmd->opts & TOPK_FROM_OPT)
+  {
+    cmd_2.cmd = (last ? PREV : NEXT) | P_FLAG;
+    cmd_2.key = cmd->key;
+  }
+  else
+  {
+    cmd_2.cmd = (last ? MAX : MIN) | P_FLAG;
+  }
+
+  while(rslt->count < cmd->count)
+  {
+    err = execute_int_cmd(&cmd_2, sizeof(cmd_2), &rslt_2, sizeof(rslt_2), ctx);
+    if(err)
+    {
+      break;
+    }
+
+    rslt->pairs[rslt->count].key = rslt_2.key;
+    rslt->pairs[rslt->count].val = rslt_2.val;
+    rslt->power = rslt_2.power;
+    rslt->count++;
+
+    cmd_2.cmd = (last ? PREV : NEXT) | P_FLAG;
+    cmd_2.key = rslt_2.key;
+  }
+
+  /* Error status is returned when structure has no more pairs */
+  rslt->rslt = (err && err != -EIO) ? ERR : OK;
+
+  LOG_DEBUG("TOPK got %u pairs of %u", rslt->count, cmd->count);
+  return SPU_TOPK_RSLT_SIZE(cmd->count);
+}
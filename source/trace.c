@@ -0,0 +1,330 @@
+/*
+  trace.c
+        - command trace
+        - per-CPU rings of commands read from debugfs
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "trace"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/fs.h>
+
+#include "spu.h"
+#include "log.h"
+#include "cmdexec.h"
+#include "trace.h"
+
+/* Trace ring of one CPU - records are consumed by read */
+struct trace_ring
+{
+  spinlock_t lock;
+  u8 *buf;     // SPU_TRACE_RING_SIZE bytes, records may wrap around end
+  size_t head; // Next record offset
+  size_t tail; // Oldest record offset
+  size_t used; // Bytes of records
+};
+
+/* Rings are allocated when trace is enabled for the first time */
+static DEFINE_PER_CPU(struct trace_ring, trace_rings);
+static u8 rings_allocated = 0;
+static u32 trace_enabled  = 0;
+static DEFINE_MUTEX(trace_mutex);
+static struct dentry *trace_dir = NULL;
+
+/* Internal functions */
+static ssize_t enable_read(struct file *file, char __user *buf, size_t count, loff_t *offset);
+static ssize_t enable_write(struct file *file, const char __user *buf, size_t count, loff_t *offset);
+static ssize_t ring_read(struct file *file, char __user *buf, size_t count, loff_t *offset);
+static int alloc_rings(void);
+static void ring_put(struct trace_ring *ring, const void *data, size_t size);
+static void ring_get(struct trace_ring *ring, size_t from, void *data, size_t size);
+
+/* Trace switch file operations */
+static const struct file_operations enable_fops =
+{
+  .owner = THIS_MODULE,
+  .read  = enable_read,
+  .write = enable_write
+};
+
+/* Trace ring file operations */
+static const struct file_operations ring_fops =
+{
+  .owner = THIS_MODULE,
+  .open  = simple_open,
+  .read  = ring_read
+};
+
+/* Create debugfs directory with trace switch and one ring file per CPU */
+int create_trace(void)
+{
+  char name[16];
+  int cpu;
+
+  trace_dir = debugfs_create_dir(SPU_CDEV_NAME, NULL);
+  if(IS_ERR_OR_NULL(trace_dir))
+  {
+    LOG_ERROR("Could not create debugfs directory, trace is not available");
+    trace_dir = NULL;
+    return 0;
+  }
+
+  debugfs_create_file("trace_enable", 0600, trace_dir, NULL, &enable_fops);
+  for_each_possible_cpu(cpu)
+  {
+    spin_lock_init(&per_cpu(trace_rings, cpu).lock);
+    snprintf(name, sizeof(name), "trace%d", cpu);
+    debugfs_create_file(name, 0400, trace_dir, per_cpu_ptr(&trace_rings, cpu), &ring_fops);
+  }
+
+  LOG_DEBUG("Trace debugfs files created");
+  return 0;
+}
+
+/* Remove debugfs files and free rings */
+void destroy_trace(void)
+{
+  int cpu;
+
+  trace_enabled = 0;
+  debugfs_remove_recursive(trace_dir);
+
+  for_each_possible_cpu(cpu)
+  {
+    vfree(per_cpu(trace_rings, cpu).buf);
+    per_cpu(trace_rings, cpu).buf = NULL;
+  }
+}
+
+/* Put record of executed command into ring of current CPU - oldest records are dropped */
+void trace_cmd(const void *cmd_buf, size_t rslt_size, const void *res_buf, const struct exec_ctx *ctx, u64 start_ns, u64 host_ns)
+{
+  struct spu_trace_rec rec = { 0 };
+  struct spu_trace_rec old;
+  struct trace_ring *ring;
+  size_t size;
+  u8 pad[8] = { 0 };
+
+  if(!READ_ONCE(trace_enabled))
+  {
+    return;
+  }
+
+  rec.start_ns = start_ns;
+  rec.host_ns  = host_ns;
+  rec.tsc      = ctx->tsc;
+  rec.size     = ctx->size;
+  rec.kept     = min_t(size_t, ctx->size, SPU_TRACE_CMD_MAX);
+
+  if((ssize_t)rslt_size <= 0)
+  {
+    rec.err = (ssize_t)rslt_size < 0 ? -(ssize_t)rslt_size : ENOEXEC;
+  }
+  else
+  {
+    rec.rslt = RSLTFRMT_0(res_buf)->rslt;
+
+    /* GSID of created structure is needed to replay commands using it */
+    switch(PURE_CMD(CMDFRMT_0(cmd_buf)->cmd))
+    {
+      case ADDS:
+        rec.gsid = RSLTFRMT_0(res_buf)->gsid;
+        break;
+
+      case EXPR:
+        rec.gsid = RSLTFRMT_3(res_buf)->gsid;
+        break;
+
+      case SNAP:
+        rec.gsid = RSLTFRMT_9(res_buf)->gsid;
+        break;
+
+      case PART:
+        rec.gsid = RSLTFRMT_10(res_buf)->gsid;
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  size = SPU_TRACE_REC_SIZE(rec.kept);
+
+  ring = get_cpu_ptr(&trace_rings);
+  rec.cpu = smp_processor_id();
+  spin_lock(&ring->lock);
+
+  /* Drop oldest records to make room */
+  while(SPU_TRACE_RING_SIZE - ring->used < size)
+  {
+    ring_get(ring, ring->tail, &old, sizeof(old));
+    ring->tail  = (ring->tail + SPU_TRACE_REC_SIZE(old.kept)) % SPU_TRACE_RING_SIZE;
+    ring->used -= SPU_TRACE_REC_SIZE(old.kept);
+  }
+
+  ring_put(ring, &rec, sizeof(rec));
+  ring_put(ring, cmd_buf, rec.kept);
+  ring_put(ring, pad, size - sizeof(rec) - rec.kept);
+  ring->used += size;
+
+  spin_unlock(&ring->lock);
+  put_cpu_ptr(&trace_rings);
+}
+
+/* Get trace switch */
+static ssize_t enable_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
+{
+  char val[3] = { trace_enabled ? '1' : '0', '\n', 0 };
+
+  return simple_read_from_buffer(buf, count, offset, val, 2);
+}
+
+/* Set trace switch - rings are allocated on first enable */
+static ssize_t enable_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
+{
+  u32 enable;
+  int err;
+
+  err = kstrtou32_from_user(buf, count, 0, &enable);
+  if(err)
+  {
+    return err;
+  }
+
+  mutex_lock(&trace_mutex);
+  err = enable ? alloc_rings() : 0;
+  if(!err)
+  {
+    WRITE_ONCE(trace_enabled, enable != 0);
+    LOG_INFO("Command trace %s", enable ? "enabled" : "disabled");
+  }
+  mutex_unlock(&trace_mutex);
+
+  return err ? err : count;
+}
+
+/* Read whole records of CPU ring, read records are removed from ring */
+static ssize_t ring_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
+{
+  struct trace_ring *ring = file->private_data;
+  struct spu_trace_rec rec;
+  size_t size = 0, rec_size;
+  u8 *data;
+  ssize_t err = 0;
+
+  if(!ring->buf)
+  {
+    return 0;
+  }
+
+  data = vmalloc(min_t(size_t, count, SPU_TRACE_RING_SIZE));
+  if(!data)
+  {
+    return -ENOMEM;
+  }
+
+  spin_lock(&ring->lock);
+  while(ring->used)
+  {
+    ring_get(ring, ring->tail, &rec, sizeof(rec));
+    rec_size = SPU_TRACE_REC_SIZE(rec.kept);
+    if(size + rec_size > count)
+    {
+      break;
+    }
+
+    ring_get(ring, ring->tail, data + size, rec_size);
+    ring->tail  = (ring->tail + rec_size) % SPU_TRACE_RING_SIZE;
+    ring->used -= rec_size;
+    size       += rec_size;
+  }
+
+  /* Buffer could not fit even one record */
+  if(!size && ring->used)
+  {
+    err = -EINVAL;
+  }
+  spin_unlock(&ring->lock);
+
+  if(size && copy_to_user(buf, data, size))
+  {
+    err = -EFAULT;
+  }
+  vfree(data);
+
+  return err ? err : size;
+}
+
+/* Allocate rings of every CPU */
+static int alloc_rings(void)
+{
+  struct trace_ring *ring;
+  int cpu;
+
+  if(rings_allocated)
+  {
+    return 0;
+  }
+
+  for_each_possible_cpu(cpu)
+  {
+    ring = per_cpu_ptr(&trace_rings, cpu);
+    if(!ring->buf)
+    {
+      ring->buf = vmalloc(SPU_TRACE_RING_SIZE);
+    }
+    if(!ring->buf)
+    {
+      LOG_ERROR("Could not allocate trace ring of CPU %d", cpu);
+      return -ENOMEM;
+    }
+    ring->head = 0;
+    ring->tail = 0;
+    ring->used = 0;
+  }
+
+  rings_allocated = 1;
+  return 0;
+}
+
+/* Copy bytes to ring head */
+static void ring_put(struct trace_ring *ring, const void *data, size_t size)
+{
+  size_t first = min_t(size_t, size, SPU_TRACE_RING_SIZE - ring->head);
+
+  memcpy(ring->buf + ring->head, data, first);
+  memcpy(ring->buf, (const u8 *) data + first, size - first);
+  ring->head = (ring->head + size) % SPU_TRACE_RING_SIZE;
+}
+
+/* Copy bytes from ring offset */
+static void ring_get(struct trace_ring *ring, size_t from, void *data, size_t size)
+{
+  size_t first = min_t(size_t, size, SPU_TRACE_RING_SIZE - from);
+
+  memcpy(data, ring->buf + from, first);
+  memcpy((u8 *) data + first, ring->buf, size - first);
+}
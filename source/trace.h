@@ -0,0 +1,29 @@
+/*
+  trace.h
+        - command trace definitions
+        - per-CPU rings of commands read from debugfs
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+int create_trace(void);
+void destroy_trace(void);
+void trace_cmd(const void *cmd_buf, size_t rslt_size, const void *res_buf, const struct exec_ctx *ctx, u64 start_ns, u64 host_ns);
+
+#endif /* TRACE_H */
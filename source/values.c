@@ -0,0 +1,596 @@
+/*
+  values.c
+        - value store
+        - values of any length are kept in arena of structure, SPU value is handle of value
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "value store"
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/stddef.h>
+
+#include "spu.h"
+#include "log.h"
+#include "cmdexec.h"
+#include "pcidrv.h"
+#include "gsidresolver.h"
+#include "snapshot.h"
+#include "partition.h"
+#include "values.h"
+
+/* Smallest arena and handles table */
+#define ARENA_MIN_SIZE  4096
+#define ARENA_MIN_SLOTS 64
+
+/* Length of free slot and end of free slots chain */
+#define SLOT_FREE U32_MAX
+#define SLOT_NONE U32_MAX
+
+/* Value slot - handle of value is slot index */
+struct vals_slot
+{
+  u32 off; // Value offset in arena, next free slot for free one
+  u32 len; // Value length, SLOT_FREE for free slot
+};
+
+/* Values arena of structure */
+struct vals_arena
+{
+  gsid_t gsid;             // Structure, zero for free arena
+  u8 *buf;                 // Values one after another
+  u32 size;                // Arena bytes
+  u32 used;                // Bytes up to end of last value
+  u32 live;                // Bytes of values in use
+  struct vals_slot *slots; // Handles table
+  u32 slots_num;
+  u32 free_slot;           // First free slot, SLOT_NONE if table is full
+};
+
+/* Value arenas and accounting - protected by SPU commands lock */
+static struct vals_arena arenas[SPU_STR_NUM] = { { .gsid = { .cont = {0} } } };
+static u64 vals_bytes = 0;
+static u64 vals_live  = 0;
+
+/* Inner commands of VALS are being executed - they are not checked */
+static u8 inner = 0;
+
+/* Internal functions */
+static int ins_val(const struct cmdfrmt_15 *cmd, struct rsltfrmt_12 *rslt, struct exec_ctx *ctx);
+static int read_val(const struct cmdfrmt_15 *cmd, struct rsltfrmt_12 *rslt, u32 *copied, struct exec_ctx *ctx);
+static int put_val(struct vals_arena *arena, const u8 *val, u32 len, u32 *hndl);
+static const u8 *get_val(const struct vals_arena *arena, u32 hndl, u32 *len);
+static void free_val(struct vals_arena *arena, u32 hndl);
+static int compact_arena(struct vals_arena *arena, u32 len);
+static int grow_slots(struct vals_arena *arena);
+static void drop_arena(struct vals_arena *arena);
+static struct vals_arena *get_arena(gsid_t gsid);
+static struct vals_arena *find_arena(gsid_t gsid);
+
+/* VALS command executor - pair value is kept by driver, SPU value is its handle */
+size_t execute_vals(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_15 *cmd = CMDFRMT_15(cmd_buf);
+  u8 op = PURE_CMD(cmd->op);
+  struct rsltfrmt_12 *rslt;
+  u32 room, copied = 0;
+  int err;
+
+  LOG_DEBUG("VALS command 0x%02x execution for GSID" GSID_FORMAT, op, GSID_VAR(cmd->gsid));
+
+  /* Value of INS is in command, values of others are returned in buffer */
+  room = op == INS ? 0 : cmd->len;
+  if(ctx->size < sizeof(struct cmdfrmt_15) || cmd->len > SPU_VALS_MAX_LEN ||
+     ctx->size < SPU_VALS_RSLT_SIZE(room) || (op == INS && ctx->size < SPU_VALS_CMD_SIZE(cmd->len)))
+  {
+    LOG_ERROR("Wrong VALS command size");
+    return -EINVAL;
+  }
+
+  switch(op)
+  {
+    CASE_VALS_OP:
+      break;
+
+    default:
+      LOG_ERROR("Command 0x%02x could not be executed by VALS", op);
+      return -EINVAL;
+  }
+
+  /* Logical structure has no SPU structure */
+  if(!part_is(cmd->gsid) && resolve_gsid(cmd->gsid, SRCH) <= 0)
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "was not found", GSID_VAR(cmd->gsid));
+    return -ENOKEY;
+  }
+
+  if((op == INS || op == DEL) && snap_is(cmd->gsid))
+  {
+    LOG_ERROR("Snapshot GSID" GSID_FORMAT "is read-only", GSID_VAR(cmd->gsid));
+    return -EROFS;
+  }
+
+  /* SPU values of pairs inserted by INS are not handles */
+  if(op == INS && !vals_is(cmd->gsid) && !part_is(cmd->gsid) && get_str_power(resolve_gsid(cmd->gsid, SRCH)))
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "has pairs with values kept by SPU", GSID_VAR(cmd->gsid));
+    return -ENOTEMPTY;
+  }
+
+  /* Allocate result */
+  rslt = kzalloc(SPU_VALS_RSLT_SIZE(room), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+
+  inner = 1;
+  if(op == INS)
+  {
+    err = ins_val(cmd, rslt, ctx);
+  }
+  else
+  {
+    err = read_val(cmd, rslt, &copied, ctx);
+  }
+  inner = 0;
+
+  if(err)
+  {
+    kfree(rslt);
+    return err;
+  }
+
+  *res_buf = rslt;
+  LOG_DEBUG("VALS command returned %u bytes of %u bytes value", copied, rslt->len);
+  return SPU_VALS_RSLT_SIZE(copied);
+}
+
+/* Check that structure with values kept by driver is changed only by VALS */
+int vals_check(const void *cmd_buf, const struct exec_ctx *ctx)
+{
+  const struct cmdfrmt_8 *btch = CMDFRMT_8(cmd_buf);
+  gsid_t gsid;
+  u32 i;
+
+  if(inner)
+  {
+    return 0;
+  }
+
+  switch(PURE_CMD(CMDFRMT_0(cmd_buf)->cmd))
+  {
+    /* Changed structure GSID is right after command in formats 1, 2 */
+    case INS:
+    case DEL:
+      gsid = CMDFRMT_2(cmd_buf)->gsid;
+      break;
+
+    CASE_CMDFRMT_4:
+      gsid = CMDFRMT_4(cmd_buf)->gsid_r;
+      break;
+
+    CASE_CMDFRMT_5:
+      gsid = CMDFRMT_5(cmd_buf)->gsid_r;
+      break;
+
+    /* Wrong batch is reported by batch executor */
+    case BTCH:
+      if(ctx->size < sizeof(struct cmdfrmt_8) || btch->count > SPU_BATCH_MAX_CMDS ||
+         ctx->size < offsetof(struct cmdfrmt_8, cmds) + btch->count*sizeof(struct cmdfrmt_1))
+      {
+        return 0;
+      }
+
+      for(i=0; i<btch->count; i++)
+      {
+        if(vals_is(btch->cmds[i].gsid))
+        {
+          LOG_ERROR("Values of GSID" GSID_FORMAT "are kept by driver, VALS should be used", GSID_VAR(btch->cmds[i].gsid));
+          return -EPERM;
+        }
+      }
+      return 0;
+
+    default:
+      return 0;
+  }
+
+  if(vals_is(gsid))
+  {
+    LOG_ERROR("Values of GSID" GSID_FORMAT "are kept by driver, VALS should be used", GSID_VAR(gsid));
+    return -EPERM;
+  }
+
+  return 0;
+}
+
+/* Free arena of structure deleted by DELS - failed DELS keeps values */
+void vals_deleted(const void *cmd_buf, size_t rslt_size, const void *res_buf)
+{
+  gsid_t gsid = CMDFRMT_3(cmd_buf)->gsid;
+
+  if(PURE_CMD(CMDFRMT_0(cmd_buf)->cmd) != DELS || (ssize_t)rslt_size <= 0 || !res_buf ||
+     ERRORS(RSLTFRMT_0(res_buf)->rslt) || !vals_is(gsid))
+  {
+    return;
+  }
+
+  drop_arena(find_arena(gsid));
+  LOG_DEBUG("Values of GSID" GSID_FORMAT "freed", GSID_VAR(gsid));
+}
+
+/* Check if structure values are kept by driver */
+u8 vals_is(gsid_t gsid)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+
+  return !GSID_EQUAL(gsid, zero_gsid) && find_arena(gsid) != NULL;
+}
+
+/* Get memory of arenas and bytes of values in them */
+void get_vals_stats(u64 *bytes, u64 *live)
+{
+  *bytes = vals_bytes;
+  *live  = vals_live;
+}
+
+/* Free every arena - no commands are executed */
+void destroy_vals(void)
+{
+  u8 i;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    drop_arena(&arenas[i]);
+  }
+}
+
+/* INS - value is put into arena first, replaced value is freed when key got new handle */
+static int ins_val(const struct cmdfrmt_15 *cmd, struct rsltfrmt_12 *rslt, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 srch = { .cmd = SRCH | P_FLAG, .gsid = cmd->gsid, .key = cmd->key };
+  struct cmdfrmt_1 ins  = { .cmd = INS | P_FLAG, .gsid = cmd->gsid, .key = cmd->key };
+  struct rsltfrmt_2 old;
+  struct rsltfrmt_1 ins_rslt;
+  struct vals_arena *arena;
+  u32 hndl;
+  u8 found;
+  int err;
+
+  arena = get_arena(cmd->gsid);
+  if(!arena)
+  {
+    LOG_ERROR("No free value arena");
+    return -ENOKEY;
+  }
+
+  err = execute_int_cmd(&srch, sizeof(srch), &old, sizeof(old), ctx);
+  if(err && err != -EIO)
+  {
+    return err;
+  }
+  found = !err;
+
+  err = put_val(arena, cmd->val, cmd->len, &hndl);
+  if(err)
+  {
+    return err;
+  }
+
+  ins.val.cont[0] = hndl;
+  err = execute_int_cmd(&ins, sizeof(ins), &ins_rslt, sizeof(ins_rslt), ctx);
+  if(err)
+  {
+    free_val(arena, hndl);
+    if(err != -EIO)
+    {
+      return err;
+    }
+  }
+  else if(found)
+  {
+    free_val(arena, old.val.cont[0]);
+  }
+
+  rslt->rslt  = ins_rslt.rslt;
+  rslt->key   = cmd->key;
+  rslt->len   = err ? 0 : cmd->len;
+  rslt->power = ins_rslt.power;
+  return 0;
+}
+
+/* DEL, SRCH, MIN, MAX, NEXT, PREV, NSM, NGR - value of found pair is copied into result */
+static int read_val(const struct cmdfrmt_15 *cmd, struct rsltfrmt_12 *rslt, u32 *copied, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 read = { .cmd = PURE_CMD(cmd->op) | P_FLAG, .gsid = cmd->gsid, .key = cmd->key };
+  struct vals_arena *arena = vals_is(cmd->gsid) ? find_arena(cmd->gsid) : NULL;
+  struct rsltfrmt_2 pair;
+  const u8 *val = NULL;
+  u32 len;
+  int err;
+
+  /* Pair deleted from structure without driver values would lose its value */
+  if(PURE_CMD(cmd->op) == DEL && !arena)
+  {
+    LOG_ERROR("Values of GSID" GSID_FORMAT "are not kept by driver", GSID_VAR(cmd->gsid));
+    rslt->rslt = ERR;
+    return 0;
+  }
+
+  /* MIN and MAX are format 3 - key is not sent */
+  err = execute_int_cmd(&read, cmd_size(read.cmd), &pair, sizeof(pair), ctx);
+  if(err && err != -EIO)
+  {
+    return err;
+  }
+
+  rslt->rslt  = pair.rslt;
+  rslt->key   = pair.key;
+  rslt->power = pair.power;
+
+  /* Pair was not found */
+  if(err)
+  {
+    return 0;
+  }
+
+  if(arena)
+  {
+    val = get_val(arena, pair.val.cont[0], &len);
+  }
+
+  if(!val)
+  {
+    LOG_ERROR("Pair of GSID" GSID_FORMAT "has no value kept by driver", GSID_VAR(cmd->gsid));
+    rslt->rslt |= ERR;
+    return 0;
+  }
+
+  *copied   = min_t(u32, len, cmd->len);
+  rslt->len = len;
+  memcpy(rslt->val, val, *copied);
+
+  if(PURE_CMD(cmd->op) == DEL)
+  {
+    free_val(arena, pair.val.cont[0]);
+  }
+
+  return 0;
+}
+
+/* Put value at arena end, arena is compacted or grown when value does not fit */
+static int put_val(struct vals_arena *arena, const u8 *val, u32 len, u32 *hndl)
+{
+  int err;
+
+  if(arena->size - arena->used < len)
+  {
+    err = compact_arena(arena, len);
+    if(err)
+    {
+      return err;
+    }
+  }
+
+  if(arena->free_slot == SLOT_NONE)
+  {
+    err = grow_slots(arena);
+    if(err)
+    {
+      return err;
+    }
+  }
+
+  *hndl = arena->free_slot;
+  arena->free_slot = arena->slots[*hndl].off;
+  arena->slots[*hndl].off = arena->used;
+  arena->slots[*hndl].len = len;
+
+  memcpy(arena->buf + arena->used, val, len);
+  arena->used += len;
+  arena->live += len;
+  vals_live   += len;
+
+  return 0;
+}
+
+/* Get value by handle, NULL for wrong handle */
+static const u8 *get_val(const struct vals_arena *arena, u32 hndl, u32 *len)
+{
+  if(hndl >= arena->slots_num || arena->slots[hndl].len == SLOT_FREE)
+  {
+    return NULL;
+  }
+
+  *len = arena->slots[hndl].len;
+  return arena->buf + arena->slots[hndl].off;
+}
+
+/* Free value, arena is compacted when most of it is not used */
+static void free_val(struct vals_arena *arena, u32 hndl)
+{
+  if(hndl >= arena->slots_num || arena->slots[hndl].len == SLOT_FREE)
+  {
+    LOG_WARNING("Value handle %u is not used", hndl);
+    return;
+  }
+
+  arena->live -= arena->slots[hndl].len;
+  vals_live   -= arena->slots[hndl].len;
+
+  arena->slots[hndl].off = arena->free_slot;
+  arena->slots[hndl].len = SLOT_FREE;
+  arena->free_slot = hndl;
+
+  if(!arena->live)
+  {
+    arena->used = 0;
+  }
+  else if(arena->size > ARENA_MIN_SIZE && arena->live < arena->size/4)
+  {
+    /* Failed compaction keeps old arena */
+    compact_arena(arena, 0);
+  }
+}
+
+/* Copy values into new arena without gaps, new arena is twice as large as needed */
+/* Handles are kept, only offsets are changed */
+static int compact_arena(struct vals_arena *arena, u32 len)
+{
+  u64 need = (u64) arena->live + len;
+  u32 size = ARENA_MIN_SIZE;
+  u32 off = 0, i;
+  u8 *buf;
+
+  while(size < 2*need)
+  {
+    size *= 2;
+  }
+
+  if(vals_bytes - arena->size + size > SPU_VALS_MAX_BYTES)
+  {
+    LOG_ERROR("Value arenas are larger than %d bytes", SPU_VALS_MAX_BYTES);
+    return -ENOSPC;
+  }
+
+  buf = vmalloc(size);
+  if(!buf)
+  {
+    LOG_ERROR("Could not allocate value arena of %u bytes", size);
+    return -ENOMEM;
+  }
+
+  for(i=0; i<arena->slots_num; i++)
+  {
+    if(arena->slots[i].len != SLOT_FREE)
+    {
+      memcpy(buf + off, arena->buf + arena->slots[i].off, arena->slots[i].len);
+      arena->slots[i].off = off;
+      off += arena->slots[i].len;
+    }
+  }
+
+  LOG_DEBUG("Value arena of GSID" GSID_FORMAT "compacted from %u to %u bytes", GSID_VAR(arena->gsid), arena->size, size);
+
+  vfree(arena->buf);
+  vals_bytes += size;
+  vals_bytes -= arena->size;
+  arena->buf  = buf;
+  arena->size = size;
+  arena->used = off;
+  return 0;
+}
+
+/* Double handles table, new slots are chained as free */
+static int grow_slots(struct vals_arena *arena)
+{
+  u32 num = arena->slots_num ? arena->slots_num*2 : ARENA_MIN_SLOTS;
+  struct vals_slot *slots;
+  u32 i;
+
+  if(vals_bytes + (num - arena->slots_num)*sizeof(struct vals_slot) > SPU_VALS_MAX_BYTES)
+  {
+    LOG_ERROR("Value arenas are larger than %d bytes", SPU_VALS_MAX_BYTES);
+    return -ENOSPC;
+  }
+
+  slots = vmalloc(num*sizeof(struct vals_slot));
+  if(!slots)
+  {
+    LOG_ERROR("Could not allocate %u value handles", num);
+    return -ENOMEM;
+  }
+
+  if(arena->slots)
+  {
+    memcpy(slots, arena->slots, arena->slots_num*sizeof(struct vals_slot));
+    vfree(arena->slots);
+  }
+
+  for(i=arena->slots_num; i<num; i++)
+  {
+    slots[i].off = i+1 < num ? i+1 : arena->free_slot;
+    slots[i].len = SLOT_FREE;
+  }
+
+  vals_bytes += (num - arena->slots_num)*sizeof(struct vals_slot);
+  arena->free_slot = arena->slots_num;
+  arena->slots     = slots;
+  arena->slots_num = num;
+  return 0;
+}
+
+/* Free arena memory and slot */
+static void drop_arena(struct vals_arena *arena)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+
+  if(arena->buf)
+  {
+    vfree(arena->buf);
+  }
+
+  if(arena->slots)
+  {
+    vfree(arena->slots);
+  }
+
+  vals_bytes -= arena->size + arena->slots_num*sizeof(struct vals_slot);
+  vals_live  -= arena->live;
+
+  *arena = (struct vals_arena) { .gsid = zero_gsid, .free_slot = SLOT_NONE };
+}
+
+/* Get arena of structure, new empty arena is taken for structure without values */
+static struct vals_arena *get_arena(gsid_t gsid)
+{
+  gsid_t zero_gsid = { .cont = {0} };
+  struct vals_arena *arena;
+
+  arena = find_arena(gsid);
+  if(!arena)
+  {
+    arena = find_arena(zero_gsid);
+    if(arena)
+    {
+      *arena = (struct vals_arena) { .gsid = gsid, .free_slot = SLOT_NONE };
+    }
+  }
+
+  return arena;
+}
+
+/* Get arena by GSID, zero GSID gives free arena */
+static struct vals_arena *find_arena(gsid_t gsid)
+{
+  u8 i;
+
+  for(i=0; i<SPU_STR_NUM; i++)
+  {
+    if(GSID_EQUAL(arenas[i].gsid, gsid))
+    {
+      return &arenas[i];
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,43 @@
+/*
+  values.h
+        - value store definitions
+        - values of pairs kept in driver arenas, SPU keeps their handles
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VALUES_H
+#define VALUES_H
+
+/* Macros to switch across VALS operations */
+#define CASE_VALS_OP case INS:\
+                     case DEL:\
+                     case SRCH:\
+                     case MIN:\
+                     case MAX:\
+                     case NEXT:\
+                     case PREV:\
+                     case NSM:\
+                     case NGR
+
+size_t execute_vals(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+int vals_check(const void *cmd_buf, const struct exec_ctx *ctx);
+void vals_deleted(const void *cmd_buf, size_t rslt_size, const void *res_buf);
+u8 vals_is(gsid_t gsid);
+void get_vals_stats(u64 *bytes, u64 *live);
+void destroy_vals(void);
+
+#endif /* VALUES_H */
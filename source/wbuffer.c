@@ -0,0 +1,573 @@
+/*
+  wbuffer.c
+        - write-behind buffer implementation
+        - INS, DEL without polling are kept on host and flushed in batches
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Define local logging object - current part of driver */
+#undef LOG_OBJECT
+#define LOG_OBJECT "write-behind buffer"
+
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+
+#include "spu.h"
+#include "log.h"
+#include "pcidrv.h"
+#include "cmdexec.h"
+#include "batchexec.h"
+#include "gsidresolver.h"
+#include "wbuffer.h"
+
+/* Buffered mutation - last INS or DEL of a key */
+struct wbuf_entry
+{
+  struct rb_node node; // Log tree node ordered by key
+  cmd_t cmd;           // INS or DEL
+  spu_key_t key;
+  val_t val;
+};
+
+/* Sorted log of one structure */
+struct wbuf_log
+{
+  gsid_t gsid;        // Structure the log belongs to
+  u8 enabled;         // Mutations of structure are buffered
+  struct rb_root root;
+  u32 count;          // Buffered keys
+  u32 ins;            // Buffered INS - power of structure is estimated with them
+};
+
+/* Logs by SPU structure index */
+static struct wbuf_log wbuf_logs[SPU_STR_NUM];
+static u8 wbuf_enabled = 0; // Structures with enabled buffer
+static u32 wbuf_keys = 0;   // Buffered keys in all logs
+static u8 wbuf_busy = 0;    // Buffer own commands are sent to SPU as is
+
+/* Internal functions */
+static struct wbuf_log *find_log(gsid_t gsid, int *str);
+static struct wbuf_entry *find_entry(struct wbuf_log *log, const spu_key_t *key);
+static struct wbuf_entry *near_entry(struct wbuf_log *log, const spu_key_t *key, u8 greater);
+static int put_entry(struct wbuf_log *log, cmd_t cmd, const spu_key_t *key, const val_t *val);
+static void drop_log(struct wbuf_log *log);
+static void drop_entries(struct wbuf_log *log, u32 count);
+static int check_failed(struct wbuf_log *log, const struct cmdfrmt_1 *cmds, const rslt_t *status, u32 count, struct exec_ctx *ctx);
+static int flush_log(struct wbuf_log *log, struct exec_ctx *ctx);
+static size_t buffer_cmd(struct wbuf_log *log, const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static size_t merged_read(struct wbuf_log *log, int str, const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+static int dev_read(struct wbuf_log *log, cmd_t op, const spu_key_t *key, struct rsltfrmt_2 *rslt, struct exec_ctx *ctx);
+
+/* Write-behind buffer in command workflow */
+/* Returns 0 if command should be executed by SPU as usual */
+size_t execute_wbuf(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  u8 cmd = CMDFRMT_0(cmd_buf)->cmd;
+  struct wbuf_log *log;
+  int str, err;
+
+  if(!wbuf_enabled || wbuf_busy)
+  {
+    return 0;
+  }
+
+  switch(PURE_CMD(cmd))
+  {
+    case ADDS:
+      return 0;
+
+    /* Single structure commands - GSID is right after command in formats 1, 2, 3 */
+    CASE_CMDFRMT_1:
+    CASE_CMDFRMT_2:
+    CASE_CMDFRMT_3:
+      log = find_log(CMDFRMT_3(cmd_buf)->gsid, &str);
+      if(!log)
+      {
+        return 0;
+      }
+
+      if(PURE_CMD(cmd) == DELS)
+      {
+        LOG_DEBUG("Structure %d is deleted, buffered mutations are dropped", str);
+        drop_log(log);
+        log->enabled = 0;
+        wbuf_enabled--;
+        return 0;
+      }
+
+      if((PURE_CMD(cmd) == INS || PURE_CMD(cmd) == DEL) && GET_P_FLAG(cmd) == 0)
+      {
+        return buffer_cmd(log, cmd_buf, res_buf, ctx);
+      }
+
+      if(GET_P_FLAG(cmd))
+      {
+        switch(PURE_CMD(cmd))
+        {
+          CASE_WBUF_READ:
+            return merged_read(log, str, cmd_buf, res_buf, ctx);
+
+          default:
+            break;
+        }
+      }
+
+      /* SPU should see every buffered mutation of structure */
+      err = flush_log(log, ctx);
+      return err ? err : 0;
+
+    /* Commands over several structures */
+    default:
+      err = wbuf_flush_all(ctx);
+      return err ? err : 0;
+  }
+}
+
+/* Enable or disable write-behind buffer of structure, disabled buffer is flushed */
+int wbuf_enable(gsid_t gsid, u8 enable, struct exec_ctx *ctx)
+{
+  struct wbuf_log *log;
+  int str, err = 0;
+
+  str = resolve_gsid(gsid, SRCH);
+  if(str <= 0)
+  {
+    LOG_ERROR("GSID" GSID_FORMAT "was not found", GSID_VAR(gsid));
+    return -ENOKEY;
+  }
+  log = &wbuf_logs[STR_IDX(str)];
+
+  if(enable && !log->enabled)
+  {
+    log->gsid    = gsid;
+    log->root    = RB_ROOT;
+    log->count   = 0;
+    log->ins     = 0;
+    log->enabled = 1;
+    wbuf_enabled++;
+    LOG_DEBUG("Structure %d write-behind buffer enabled", str);
+  }
+  else if(!enable && log->enabled)
+  {
+    /* Log is kept enabled while some mutations are not flushed */
+    err = flush_log(log, ctx);
+    if(err && log->count)
+    {
+      return err;
+    }
+    log->enabled = 0;
+    wbuf_enabled--;
+    LOG_DEBUG("Structure %d write-behind buffer disabled", str);
+  }
+
+  return err;
+}
+
+/* Flush every buffered mutation */
+int wbuf_flush_all(struct exec_ctx *ctx)
+{
+  u8 i;
+  int err, first_err = 0;
+
+  for(i=0; i<SPU_STR_NUM && wbuf_keys; i++)
+  {
+    if(wbuf_logs[i].enabled && wbuf_logs[i].count)
+    {
+      err = flush_log(&wbuf_logs[i], ctx);
+      first_err = first_err ? first_err : err;
+    }
+  }
+
+  return first_err;
+}
+
+/* Count of buffered keys waiting for flush */
+u32 wbuf_pending(void)
+{
+  return wbuf_keys;
+}
+
+/* Get enabled log by GSID */
+static struct wbuf_log *find_log(gsid_t gsid, int *str)
+{
+  struct wbuf_log *log;
+
+  *str = resolve_gsid(gsid, SRCH);
+  if(*str <= 0)
+  {
+    return NULL;
+  }
+
+  log = &wbuf_logs[STR_IDX(*str)];
+  return log->enabled && GSID_EQUAL(log->gsid, gsid) ? log : NULL;
+}
+
+/* Find buffered mutation of key */
+static struct wbuf_entry *find_entry(struct wbuf_log *log, const spu_key_t *key)
+{
+  struct rb_node *node = log->root.rb_node;
+  struct wbuf_entry *entry;
+  int cmp;
+
+  while(node)
+  {
+    entry = rb_entry(node, struct wbuf_entry, node);
+    cmp   = key_cmp(key, &entry->key);
+
+    if(cmp == 0)
+    {
+      return entry;
+    }
+    node = cmp < 0 ? node->rb_left : node->rb_right;
+  }
+
+  return NULL;
+}
+
+/* Find nearest buffered INS strictly greater (or less) than key, first (or last) one without key */
+static struct wbuf_entry *near_entry(struct wbuf_log *log, const spu_key_t *key, u8 greater)
+{
+  struct rb_node *node = log->root.rb_node, *found = NULL;
+  struct wbuf_entry *entry;
+
+  if(!key)
+  {
+    found = greater ? rb_first(&log->root) : rb_last(&log->root);
+  }
+  else
+  {
+    while(node)
+    {
+      entry = rb_entry(node, struct wbuf_entry, node);
+      if(greater ? key_cmp(&entry->key, key) > 0 : key_cmp(&entry->key, key) < 0)
+      {
+        found = node;
+        node  = greater ? node->rb_left : node->rb_right;
+      }
+      else
+      {
+        node = greater ? node->rb_right : node->rb_left;
+      }
+    }
+  }
+
+  /* Deleted keys are skipped */
+  for(; found; found = greater ? rb_next(found) : rb_prev(found))
+  {
+    entry = rb_entry(found, struct wbuf_entry, node);
+    if(PURE_CMD(entry->cmd) == INS)
+    {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/* Put mutation into log - previous mutation of the same key is replaced */
+static int put_entry(struct wbuf_log *log, cmd_t cmd, const spu_key_t *key, const val_t *val)
+{
+  struct rb_node **link = &log->root.rb_node, *parent = NULL;
+  struct wbuf_entry *entry;
+  int cmp;
+
+  while(*link)
+  {
+    parent = *link;
+    entry  = rb_entry(parent, struct wbuf_entry, node);
+    cmp    = key_cmp(key, &entry->key);
+
+    if(cmp == 0)
+    {
+      log->ins  += (PURE_CMD(cmd) == INS) - (PURE_CMD(entry->cmd) == INS);
+      entry->cmd = cmd;
+      if(val)
+      {
+        entry->val = *val;
+      }
+      return 0;
+    }
+    link = cmp < 0 ? &parent->rb_left : &parent->rb_right;
+  }
+
+  entry = kzalloc(sizeof(struct wbuf_entry), GFP_KERNEL);
+  if(!entry)
+  {
+    LOG_ERROR("Could not allocate buffered mutation");
+    return -ENOMEM;
+  }
+  entry->cmd = cmd;
+  entry->key = *key;
+  if(val)
+  {
+    entry->val = *val;
+  }
+
+  rb_link_node(&entry->node, parent, link);
+  rb_insert_color(&entry->node, &log->root);
+  log->count++;
+  log->ins += PURE_CMD(cmd) == INS;
+  wbuf_keys++;
+
+  return 0;
+}
+
+/* Free every buffered mutation of log */
+static void drop_log(struct wbuf_log *log)
+{
+  drop_entries(log, log->count);
+}
+
+/* Free first count buffered mutations of log in key order */
+static void drop_entries(struct wbuf_log *log, u32 count)
+{
+  struct wbuf_entry *entry;
+  struct rb_node *node;
+
+  for(; count && (node = rb_first(&log->root)); count--)
+  {
+    entry = rb_entry(node, struct wbuf_entry, node);
+    log->ins -= PURE_CMD(entry->cmd) == INS;
+    rb_erase(node, &log->root);
+    kfree(entry);
+    log->count--;
+    wbuf_keys--;
+  }
+}
+
+/* Mutations with error status - DEL of key absent in SPU is fine, INS not seen in SPU is failure */
+static int check_failed(struct wbuf_log *log, const struct cmdfrmt_1 *cmds, const rslt_t *status, u32 count, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 cmd =
+  {
+    .cmd  = SRCH | P_FLAG,
+    .gsid = log->gsid
+  };
+  struct rsltfrmt_2 rslt;
+  u32 i;
+  int err = 0;
+
+  wbuf_busy = 1;
+  for(i=0; i<count && !err; i++)
+  {
+    if(PURE_CMD(cmds[i].cmd) != INS || !ERRORS(status[i]))
+    {
+      continue;
+    }
+
+    cmd.key = cmds[i].key;
+    err = execute_int_cmd(&cmd, sizeof(struct cmdfrmt_2), &rslt, sizeof(struct rsltfrmt_2), ctx);
+    if(!err && memcmp(&rslt.val, &cmds[i].val, sizeof(val_t)))
+    {
+      err = -EIO;
+    }
+  }
+  wbuf_busy = 0;
+
+  if(err == -EIO)
+  {
+    LOG_ERROR("Buffered INS was not executed by SPU");
+  }
+
+  return err;
+}
+
+/* Send buffered mutations to SPU in key order as one batch */
+static int flush_log(struct wbuf_log *log, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_1 *cmds;
+  struct wbuf_entry *entry;
+  struct rb_node *node;
+  rslt_t *status;
+  u32 i = 0, sent = 0;
+  int err;
+
+  if(!log->count)
+  {
+    return 0;
+  }
+
+  cmds = kmalloc(log->count*(sizeof(struct cmdfrmt_1) + sizeof(rslt_t)), GFP_KERNEL);
+  if(!cmds)
+  {
+    LOG_ERROR("Could not allocate flush batch");
+    return -ENOMEM;
+  }
+  status = (rslt_t *)(cmds + log->count);
+
+  for(node = rb_first(&log->root); node; node = rb_next(node))
+  {
+    entry = rb_entry(node, struct wbuf_entry, node);
+    cmds[i].cmd  = entry->cmd;
+    cmds[i].gsid = log->gsid;
+    cmds[i].key  = entry->key;
+    cmds[i].val  = entry->val;
+    i++;
+  }
+
+  /* DEL of key absent in SPU gives error status - rest of batch is still sent */
+  err = run_batch(cmds, log->count, &sent, status, ctx);
+  LOG_DEBUG("Flushed %u of %u buffered mutations", sent, log->count);
+  if(err == -EIO)
+  {
+    err = check_failed(log, cmds, status, sent, ctx);
+  }
+
+  /* Mutations not sent are kept in log for next flush */
+  kfree(cmds);
+  if(err && err != -EIO)
+  {
+    LOG_ERROR("Flush failed, %u buffered mutations are kept", log->count - sent);
+    drop_entries(log, sent);
+    return err;
+  }
+  drop_log(log);
+  return err;
+}
+
+/* Keep INS or DEL without polling in log */
+static size_t buffer_cmd(struct wbuf_log *log, const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  u8 cmd = CMDFRMT_0(cmd_buf)->cmd;
+  struct rsltfrmt_0 *rslt;
+  int err;
+
+  /* Full log is flushed before mutation is taken - on error mutation is not buffered */
+  if(log->count >= SPU_WBUF_MAX_KEYS)
+  {
+    err = flush_log(log, ctx);
+    if(err)
+    {
+      return err;
+    }
+  }
+
+  err = put_entry(log, PURE_CMD(cmd), &CMDFRMT_2(cmd_buf)->key, PURE_CMD(cmd) == INS ? &CMDFRMT_1(cmd_buf)->val : NULL);
+  if(err)
+  {
+    return err;
+  }
+
+  rslt = kmalloc(sizeof(struct rsltfrmt_0), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+  rslt->rslt = OK;
+  *res_buf = rslt;
+
+  return sizeof(struct rsltfrmt_0);
+}
+
+/* Answer SRCH, MIN, MAX, NEXT, PREV by SPU result merged with log */
+static size_t merged_read(struct wbuf_log *log, int str, const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx)
+{
+  u8 op = PURE_CMD(CMDFRMT_0(cmd_buf)->cmd);
+  const spu_key_t *key = (op == MIN || op == MAX) ? NULL : &CMDFRMT_2(cmd_buf)->key;
+  u8 greater = (op == MIN || op == NEXT);
+  struct rsltfrmt_2 *rslt, dev_rslt;
+  struct wbuf_entry *entry;
+  int found;
+
+  rslt = kzalloc(sizeof(struct rsltfrmt_2), GFP_KERNEL);
+  if(!rslt)
+  {
+    LOG_ERROR("Could not allocate result structure");
+    return -ENOMEM;
+  }
+
+  if(op == SRCH)
+  {
+    entry = find_entry(log, key);
+    if(entry)
+    {
+      rslt->rslt  = PURE_CMD(entry->cmd) == INS ? OK : ERR;
+      rslt->key   = entry->key;
+      rslt->val   = entry->val;
+      rslt->power = get_str_power(str) + log->ins;
+      *res_buf    = rslt;
+      return sizeof(struct rsltfrmt_2);
+    }
+  }
+  else
+  {
+    entry = near_entry(log, key, greater);
+  }
+
+  found = dev_read(log, op, key, &dev_rslt, ctx);
+  if(found < 0)
+  {
+    kfree(rslt);
+    return found;
+  }
+
+  /* Nearest of SPU and log keys */
+  if(entry && (!found || (greater ? key_cmp(&entry->key, &dev_rslt.key) < 0 : key_cmp(&entry->key, &dev_rslt.key) > 0)))
+  {
+    rslt->rslt  = OK;
+    rslt->key   = entry->key;
+    rslt->val   = entry->val;
+    rslt->power = found ? dev_rslt.power : get_str_power(str);
+  }
+  else
+  {
+    *rslt = dev_rslt;
+  }
+  *res_buf = rslt;
+
+  /* SPU does not see buffered INS yet - upper estimation as for batches */
+  rslt->power += log->ins;
+
+  return sizeof(struct rsltfrmt_2);
+}
+
+/* Read SPU skipping keys the log decides on, returns 1 if key was found */
+static int dev_read(struct wbuf_log *log, cmd_t op, const spu_key_t *key, struct rsltfrmt_2 *rslt, struct exec_ctx *ctx)
+{
+  struct cmdfrmt_2 cmd =
+  {
+    .cmd  = op | P_FLAG,
+    .gsid = log->gsid
+  };
+  int err;
+
+  if(key)
+  {
+    cmd.key = *key;
+  }
+
+  wbuf_busy = 1;
+  do
+  {
+    err = execute_int_cmd(&cmd, sizeof(struct cmdfrmt_2), rslt, sizeof(struct rsltfrmt_2), ctx);
+
+    /* Buffered key hides SPU one, step over it */
+    cmd.cmd = ((op == MIN || op == NEXT) ? NEXT : PREV) | P_FLAG;
+    cmd.key = rslt->key;
+  }
+  while(!err && op != SRCH && find_entry(log, &rslt->key));
+  wbuf_busy = 0;
+
+  /* Error status is returned when there is no such key */
+  if(err == -EIO)
+  {
+    return 0;
+  }
+
+  return err ? err : 1;
+}
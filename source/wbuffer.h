@@ -0,0 +1,37 @@
+/*
+  wbuffer.h
+        - write-behind buffer definitions
+        - INS, DEL without polling are kept on host and flushed in batches
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WBUFFER_H
+#define WBUFFER_H
+
+/* Macros to switch across commands answered with buffer merged in */
+#define CASE_WBUF_READ case SRCH:\
+                       case MIN:\
+                       case MAX:\
+                       case NEXT:\
+                       case PREV
+
+size_t execute_wbuf(const void *cmd_buf, const void **res_buf, struct exec_ctx *ctx);
+int wbuf_enable(gsid_t gsid, u8 enable, struct exec_ctx *ctx);
+int wbuf_flush_all(struct exec_ctx *ctx);
+u32 wbuf_pending(void);
+
+#endif /* WBUFFER_H */
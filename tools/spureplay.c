@@ -0,0 +1,606 @@
+/*
+  spureplay.c
+        - replay of driver command trace into SPU character device
+        - original, scaled or maximal speed and latency distributions report
+
+  Copyright 2019  Dubrovin Egor <dubrovin.en@ya.ru>
+                  Alex Popov <alexpopov@bmstu.ru>
+                  Bauman Moscow State Technical University
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "spu.h"
+
+/* Command code without flags */
+#define PURE_CMD(cmd) ( (cmd)&CMD_MASK )
+
+/* Command buffer - results are written over command */
+#define REPLAY_BUF_SIZE ( SPU_TRACE_CMD_MAX + 4096 )
+
+/* Maximum number of structures created while trace was recorded */
+#define REPLAY_MAX_GSIDS 4096
+
+/* Command of trace */
+struct replay_rec
+{
+  struct spu_trace_rec hdr;
+  u8 *cmd;
+  u64 replay_ns; // Latency of replayed command
+};
+
+/* Structure created in trace and the same structure created by replay */
+struct gsid_map
+{
+  gsid_t trace;
+  gsid_t replay;
+};
+
+/* Replay options */
+struct replay_opts
+{
+  const char *dev; // NULL to replay without device
+  const char *out; // Trace of replayed commands, NULL if not needed
+  double scale;    // Speed up of original timing, 0 for maximal speed
+};
+
+/* Latency distribution */
+struct replay_dist
+{
+  u64 p50, p99, p999, max;
+};
+
+/* Command names by command code */
+static const char *cmd_names[CMD_MASK+1] =
+{
+  [ADDS] = "ADDS", [DEL]  = "DEL",  [INS]  = "INS",  [MIN]  = "MIN",  [MAX]  = "MAX",  [SRCH] = "SRCH",
+  [OR]   = "OR",   [AND]  = "AND",  [NOT]  = "NOT",  [LSEQ] = "LSEQ", [LS]   = "LS",   [GREQ] = "GREQ",
+  [GR]   = "GR",   [DELS] = "DELS", [NEXT] = "NEXT", [PREV] = "PREV", [NSM]  = "NSM",  [NGR]  = "NGR",
+  [EXPR] = "EXPR", [MISD] = "MISD", [BTCH] = "BTCH", [MGET] = "MGET", [AGGR] = "AGGR", [TOPK] = "TOPK",
+  [SNAP] = "SNAP", [HNDL] = "HNDL", [PART] = "PART", [REPL] = "REPL",
+  [VALS] = "VALS"
+};
+
+static struct gsid_map gsids[REPLAY_MAX_GSIDS];
+static size_t gsids_count = 0;
+
+/* Internal functions */
+static int load_trace(const char *path, struct replay_rec **recs, size_t *count, size_t *skipped);
+static int rec_cmp(const void *a, const void *b);
+static int replay(struct replay_rec *recs, size_t count, const struct replay_opts *opts);
+static void map_gsids(u8 *cmd, u32 size);
+static void map_gsid(gsid_t *gsid);
+static void add_gsid(const gsid_t *trace, const gsid_t *replay);
+static int write_rec(FILE *out, const struct replay_rec *rec, u64 start_ns);
+static void report(const struct replay_rec *recs, size_t count);
+static void print_dist(const char *name, const struct replay_rec *recs, size_t count, int cmd);
+static void get_dist(u64 *lat, size_t count, struct replay_dist *dist);
+static int u64_cmp(const void *a, const void *b);
+static u64 now_ns(void);
+
+int main(int argc, char **argv)
+{
+  struct replay_opts opts = { .dev = "/dev/" SPU_CDEV_NAME, .out = NULL, .scale = 1.0 };
+  struct replay_rec *recs = NULL;
+  size_t count = 0, skipped = 0;
+  int opt, i, err;
+
+  while((opt = getopt(argc, argv, "d:x:mno:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'd':
+        opts.dev = optarg;
+        break;
+
+      case 'x':
+        opts.scale = atof(optarg);
+        break;
+
+      case 'm':
+        opts.scale = 0;
+        break;
+
+      case 'n':
+        opts.dev = NULL;
+        break;
+
+      case 'o':
+        opts.out = optarg;
+        break;
+
+      default:
+        fprintf(stderr, "Usage: %s [-d device] [-x scale | -m] [-n] [-o out_trace] trace...\n", argv[0]);
+        fprintf(stderr, "  -d device  character device to replay into, /dev/%s by default\n", SPU_CDEV_NAME);
+        fprintf(stderr, "  -x scale   speed up of original timing, 1 by default\n");
+        fprintf(stderr, "  -m         maximal speed - commands are sent back-to-back\n");
+        fprintf(stderr, "  -n         no device - check replay timing only\n");
+        fprintf(stderr, "  -o trace   write trace of replayed commands to compare with later runs\n");
+        return 1;
+    }
+  }
+
+  if(optind == argc)
+  {
+    fprintf(stderr, "No trace given, see %s -h\n", argv[0]);
+    return 1;
+  }
+
+  /* Traces of every CPU are merged by start time */
+  for(i=optind; i<argc; i++)
+  {
+    if(load_trace(argv[i], &recs, &count, &skipped))
+    {
+      return 1;
+    }
+  }
+  qsort(recs, count, sizeof(struct replay_rec), rec_cmp);
+
+  printf("Loaded %zu commands, %zu truncated or HNDL commands skipped\n", count, skipped);
+  if(!count)
+  {
+    return 1;
+  }
+
+  err = replay(recs, count, &opts);
+  if(err < 0)
+  {
+    return 1;
+  }
+
+  report(recs, count);
+  return err ? 1 : 0;
+}
+
+/* Append complete records of trace file */
+static int load_trace(const char *path, struct replay_rec **recs, size_t *count, size_t *skipped)
+{
+  struct spu_trace_rec hdr;
+  struct replay_rec *grown;
+  size_t cap = *count, pad;
+  FILE *file;
+
+  file = fopen(path, "rb");
+  if(!file)
+  {
+    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  while(fread(&hdr, sizeof(hdr), 1, file) == 1)
+  {
+    if(hdr.kept > SPU_TRACE_CMD_MAX || hdr.kept > hdr.size)
+    {
+      fprintf(stderr, "Trace %s is damaged\n", path);
+      fclose(file);
+      return -1;
+    }
+
+    if(*count == cap)
+    {
+      cap   = cap ? cap*2 : 4096;
+      grown = realloc(*recs, cap*sizeof(struct replay_rec));
+      if(!grown)
+      {
+        fclose(file);
+        return -ENOMEM;
+      }
+      *recs = grown;
+    }
+
+    (*recs)[*count].hdr = hdr;
+    (*recs)[*count].cmd = malloc(hdr.kept ? hdr.kept : 1);
+    pad = SPU_TRACE_REC_SIZE(hdr.kept) - sizeof(hdr) - hdr.kept;
+    if(!(*recs)[*count].cmd || fread((*recs)[*count].cmd, 1, hdr.kept, file) != hdr.kept ||
+       fseek(file, pad, SEEK_CUR) != 0)
+    {
+      fprintf(stderr, "Trace %s is truncated\n", path);
+      fclose(file);
+      return -1;
+    }
+
+    /* Truncated commands and commands by handles of traced file could not be sent again */
+    if(hdr.kept < hdr.size || hdr.size == 0 || PURE_CMD((*recs)[*count].cmd[0]) == HNDL)
+    {
+      free((*recs)[*count].cmd);
+      (*skipped)++;
+      continue;
+    }
+    (*count)++;
+  }
+
+  fclose(file);
+  return 0;
+}
+
+/* Order of records by start time */
+static int rec_cmp(const void *a, const void *b)
+{
+  u64 a_ns = ((const struct replay_rec *) a)->hdr.start_ns;
+  u64 b_ns = ((const struct replay_rec *) b)->hdr.start_ns;
+
+  return a_ns < b_ns ? -1 : (a_ns > b_ns);
+}
+
+/* Send every command keeping trace timing, 1 if some command failed, negative if replay could not start */
+static int replay(struct replay_rec *recs, size_t count, const struct replay_opts *opts)
+{
+  struct timespec target_ts;
+  FILE *out = NULL;
+  u64 start_ns, sent_ns, target_ns, first_ns = recs[0].hdr.start_ns;
+  u64 lag_ns = 0, lag_max = 0;
+  size_t i, errors = 0;
+  ssize_t size;
+  u8 *buf;
+  int fd = -1;
+
+  buf = aligned_alloc(8, REPLAY_BUF_SIZE);
+  if(!buf)
+  {
+    return -ENOMEM;
+  }
+
+  if(opts->dev)
+  {
+    fd = open(opts->dev, O_RDWR);
+    if(fd < 0)
+    {
+      fprintf(stderr, "Could not open %s: %s\n", opts->dev, strerror(errno));
+      free(buf);
+      return -1;
+    }
+  }
+
+  if(opts->out)
+  {
+    out = fopen(opts->out, "wb");
+    if(!out)
+    {
+      fprintf(stderr, "Could not open %s: %s\n", opts->out, strerror(errno));
+      if(fd >= 0)
+      {
+        close(fd);
+      }
+      free(buf);
+      return -1;
+    }
+  }
+
+  start_ns = now_ns();
+  for(i=0; i<count; i++)
+  {
+    /* Wait for command time in scaled trace timing */
+    if(opts->scale > 0)
+    {
+      target_ns = start_ns + (u64)((recs[i].hdr.start_ns - first_ns)/opts->scale);
+      if(now_ns() < target_ns)
+      {
+        target_ts.tv_sec  = target_ns/1000000000ULL;
+        target_ts.tv_nsec = target_ns%1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target_ts, NULL);
+      }
+      else
+      {
+        lag_ns += now_ns() - target_ns;
+        lag_max = now_ns() - target_ns > lag_max ? now_ns() - target_ns : lag_max;
+      }
+    }
+
+    memcpy(buf, recs[i].cmd, recs[i].hdr.size);
+    map_gsids(buf, recs[i].hdr.size);
+
+    sent_ns = now_ns();
+    size = fd < 0 ? (ssize_t) recs[i].hdr.size : write(fd, buf, recs[i].hdr.size);
+    recs[i].replay_ns = now_ns() - sent_ns;
+
+    if(size <= 0 || (fd >= 0 && (((struct rsltfrmt_0 *) buf)->rslt & ERRORS_MASK)))
+    {
+      errors++;
+    }
+    else if(fd >= 0)
+    {
+      /* ADDS, EXPR, SNAP and PART results start with created GSID */
+      switch(PURE_CMD(recs[i].cmd[0]))
+      {
+        case ADDS:
+        case EXPR:
+        case SNAP:
+          add_gsid(&recs[i].hdr.gsid, &((struct rsltfrmt_0 *) buf)->gsid);
+          break;
+
+        case PART:
+          if(((struct cmdfrmt_13 *) recs[i].cmd)->op == PART_CREATE_OP)
+          {
+            add_gsid(&recs[i].hdr.gsid, &((struct rsltfrmt_0 *) buf)->gsid);
+          }
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    if(out && write_rec(out, &recs[i], sent_ns))
+    {
+      fprintf(stderr, "Could not write %s\n", opts->out);
+      errors++;
+      break;
+    }
+  }
+
+  printf("Replayed %zu commands in %.3f ms, %zu errors\n", count, (now_ns() - start_ns)/1e6, errors);
+  if(opts->scale > 0)
+  {
+    printf("Schedule lag: mean %.3f us, max %.3f us\n", lag_ns/1e3/count, lag_max/1e3);
+  }
+
+  if(out)
+  {
+    fclose(out);
+  }
+  if(fd >= 0)
+  {
+    close(fd);
+  }
+  free(buf);
+
+  /* Failed commands make replay failed, but latencies are still reported */
+  return errors ? 1 : 0;
+}
+
+/* Replace GSIDs of structures created in trace by GSIDs created by replay */
+static void map_gsids(u8 *cmd, u32 size)
+{
+  u32 i;
+
+  switch(PURE_CMD(cmd[0]))
+  {
+    /* GSID is right after command in formats 1, 2, 3 */
+    case INS:
+    case DEL:
+    case SRCH:
+    case NEXT:
+    case PREV:
+    case NSM:
+    case NGR:
+    case DELS:
+    case MIN:
+    case MAX:
+    case SNAP:
+      map_gsid(&((struct cmdfrmt_3 *) cmd)->gsid);
+      break;
+
+    case AND:
+    case OR:
+    case NOT:
+      map_gsid(&((struct cmdfrmt_4 *) cmd)->gsid_a);
+      map_gsid(&((struct cmdfrmt_4 *) cmd)->gsid_b);
+      map_gsid(&((struct cmdfrmt_4 *) cmd)->gsid_r);
+      break;
+
+    case LS:
+    case LSEQ:
+    case GR:
+    case GREQ:
+      map_gsid(&((struct cmdfrmt_5 *) cmd)->gsid_a);
+      map_gsid(&((struct cmdfrmt_5 *) cmd)->gsid_r);
+      break;
+
+    case EXPR:
+      for(i=0; i<((struct cmdfrmt_6 *) cmd)->count && i<SPU_EXPR_MAX_NODES; i++)
+      {
+        if(((struct cmdfrmt_6 *) cmd)->nodes[i].op == EXPR_LEAF)
+        {
+          map_gsid(&((struct cmdfrmt_6 *) cmd)->nodes[i].gsid);
+        }
+      }
+      break;
+
+    case MISD:
+      for(i=0; i<((struct cmdfrmt_7 *) cmd)->count && i<SPU_STR_NUM; i++)
+      {
+        map_gsid(&((struct cmdfrmt_7 *) cmd)->gsids[i]);
+      }
+      break;
+
+    case BTCH:
+      for(i=0; i<((struct cmdfrmt_8 *) cmd)->count && sizeof(struct cmdfrmt_8) + (i+1)*sizeof(struct cmdfrmt_1) <= size; i++)
+      {
+        map_gsid(&((struct cmdfrmt_8 *) cmd)->cmds[i].gsid);
+      }
+      break;
+
+    case MGET:
+      map_gsid(&((struct cmdfrmt_9 *) cmd)->gsid);
+      break;
+
+    case AGGR:
+      map_gsid(&((struct cmdfrmt_10 *) cmd)->gsid);
+      break;
+
+    case TOPK:
+      map_gsid(&((struct cmdfrmt_11 *) cmd)->gsid);
+      break;
+
+    case PART:
+      map_gsid(&((struct cmdfrmt_13 *) cmd)->gsid);
+      for(i=0; i<((struct cmdfrmt_13 *) cmd)->count && i<SPU_STR_NUM; i++)
+      {
+        map_gsid(&((struct cmdfrmt_13 *) cmd)->gsids[i]);
+      }
+      break;
+
+    case REPL:
+      map_gsid(&((struct cmdfrmt_14 *) cmd)->gsid);
+      break;
+
+    case VALS:
+      map_gsid(&((struct cmdfrmt_15 *) cmd)->gsid);
+      break;
+
+    default:
+      break;
+  }
+}
+
+/* Replace one GSID if it was created in trace */
+static void map_gsid(gsid_t *gsid)
+{
+  size_t i;
+
+  for(i=0; i<gsids_count; i++)
+  {
+    if(!memcmp(&gsids[i].trace, gsid, sizeof(gsid_t)))
+    {
+      *gsid = gsids[i].replay;
+      return;
+    }
+  }
+}
+
+/* Remember structure created by replay */
+static void add_gsid(const gsid_t *trace, const gsid_t *replay)
+{
+  if(gsids_count == REPLAY_MAX_GSIDS)
+  {
+    fprintf(stderr, "Too many structures created, later commands use trace GSIDs\n");
+    return;
+  }
+
+  gsids[gsids_count].trace  = *trace;
+  gsids[gsids_count].replay = *replay;
+  gsids_count++;
+}
+
+/* Write replayed command in trace format - GSIDs are kept as in trace */
+static int write_rec(FILE *out, const struct replay_rec *rec, u64 start_ns)
+{
+  struct spu_trace_rec hdr = rec->hdr;
+  u8 pad[8] = { 0 };
+
+  hdr.start_ns = start_ns;
+  hdr.host_ns  = rec->replay_ns;
+  hdr.tsc      = 0;
+
+  if(fwrite(&hdr, sizeof(hdr), 1, out) != 1 || fwrite(rec->cmd, 1, hdr.kept, out) != hdr.kept ||
+     fwrite(pad, 1, SPU_TRACE_REC_SIZE(hdr.kept) - sizeof(hdr) - hdr.kept, out) != SPU_TRACE_REC_SIZE(hdr.kept) - sizeof(hdr) - hdr.kept)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Print latency distributions of trace and replay - total and by command */
+static void report(const struct replay_rec *recs, size_t count)
+{
+  u8 seen[CMD_MASK+1] = { 0 };
+  size_t i;
+
+  printf("\nLatency, us: trace (t) and replay (r), change of replay against trace\n");
+  printf("%-6s %8s %10s %10s %10s %10s %10s %10s %10s %10s %8s %8s\n",
+         "cmd", "count", "t p50", "r p50", "t p99", "r p99", "t p99.9", "r p99.9", "t max", "r max", "p50 %", "p99 %");
+
+  print_dist("all", recs, count, -1);
+  for(i=0; i<count; i++)
+  {
+    seen[PURE_CMD(recs[i].cmd[0])] = 1;
+  }
+  for(i=0; i<=CMD_MASK; i++)
+  {
+    if(seen[i])
+    {
+      print_dist(cmd_names[i] ? cmd_names[i] : "?", recs, count, i);
+    }
+  }
+}
+
+/* Print distributions of one command, all commands if cmd is negative */
+static void print_dist(const char *name, const struct replay_rec *recs, size_t count, int cmd)
+{
+  struct replay_dist trace, replay;
+  u64 *trace_lat, *replay_lat;
+  size_t i, n = 0;
+
+  trace_lat  = malloc(count*sizeof(u64));
+  replay_lat = malloc(count*sizeof(u64));
+  if(!trace_lat || !replay_lat)
+  {
+    free(trace_lat);
+    free(replay_lat);
+    return;
+  }
+
+  for(i=0; i<count; i++)
+  {
+    if(cmd < 0 || PURE_CMD(recs[i].cmd[0]) == cmd)
+    {
+      trace_lat[n]  = recs[i].hdr.host_ns;
+      replay_lat[n] = recs[i].replay_ns;
+      n++;
+    }
+  }
+  get_dist(trace_lat, n, &trace);
+  get_dist(replay_lat, n, &replay);
+
+  printf("%-6s %8zu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %+8.1f %+8.1f\n", name, n,
+         trace.p50/1e3, replay.p50/1e3, trace.p99/1e3, replay.p99/1e3, trace.p999/1e3, replay.p999/1e3,
+         trace.max/1e3, replay.max/1e3,
+         trace.p50 ? 100.0*((double)replay.p50 - trace.p50)/trace.p50 : 0.0,
+         trace.p99 ? 100.0*((double)replay.p99 - trace.p99)/trace.p99 : 0.0);
+
+  free(trace_lat);
+  free(replay_lat);
+}
+
+/* Percentiles of latencies, array is sorted */
+static void get_dist(u64 *lat, size_t count, struct replay_dist *dist)
+{
+  memset(dist, 0, sizeof(struct replay_dist));
+  if(!count)
+  {
+    return;
+  }
+
+  qsort(lat, count, sizeof(u64), u64_cmp);
+  dist->p50  = lat[(count-1)*50/100];
+  dist->p99  = lat[(count-1)*99/100];
+  dist->p999 = lat[(count-1)*999/1000];
+  dist->max  = lat[count-1];
+}
+
+/* Order of latencies */
+static int u64_cmp(const void *a, const void *b)
+{
+  u64 a_ns = *(const u64 *) a, b_ns = *(const u64 *) b;
+
+  return a_ns < b_ns ? -1 : (a_ns > b_ns);
+}
+
+/* Monotonic time, ns */
+static u64 now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}